@@ -1,6 +1,8 @@
+#define _GNU_SOURCE  // memfd_create
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
@@ -8,12 +10,48 @@
 #include <limits.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <fnmatch.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <termios.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/sendfile.h>
 
-#define MAXARGS 10
-#define ARGLEN 30
+#define PARSECACHE 64  // Parsed command lines kept in the parse cache
+#define HEREPIPE 4096  // Here-documents up to this size are fed through a pipe
 #define HISTSIZE 10
-#define MAXJOBS 100
-#define MAXVARS 100  // Max number of variables
+#define MAXJOBS 1024
+#define PIDHASH 8192  // Slots in the pid -> job index, a power of two
+#define MAXVARS 1024  // Max number of variables
+#define MAXFUNCS 1024  // Max number of shell functions
+#define MAXDEPTH 1000  // Max nesting of function calls
+#define MAXPATHDIRS 64  // PATH directories in the command index
+#define SNAPVERSION 2  // Format of the startup snapshot
+#define ALIASHASH 256  // Buckets in the alias table, a power of two
+#define SERVER_MAGIC 0x52364853u  // "SH6R", first field of a server request
+#define SERVER_MAXCMD (1 << 20)   // Longest command line a client may send
+#define ZYGOTE_MAGIC 0x5a36485au  // "ZH6Z", first field of a pool request
+#define ZYGOTE_MAXMSG (128 * 1024)  // Largest request, with argv and environment
+#define MUXRING 65536       // Output kept per background job for jobs -o
+#define MUXBUDGET (1 << 20)  // Ring memory of all jobs together
+#define MUXKEEP 16          // Finished jobs whose output stays available
+#define MAXPROCSUB 64       // Open <(list) and >(list) descriptors
+#define MEMOSIZE (64 << 20)  // Default size bound of the memo cache ($MEMOSIZE)
+#define PROMPTCACHE 32      // Prompt segment values kept, by segment and directory
+#define SEGMENTOUT 4096     // Worker output kept for parsing a segment
 
 // Variable structure
 struct var {
@@ -24,38 +62,784 @@ struct var {
 struct var var_table[MAXVARS];  // Variable table
 int var_count = 0;              // Current number of variables
 
+// Shell function: name() { body; }
+struct function {
+    char *name;
+    struct node *body;  // Compiled body, shared with the tree that defined it
+};
+
+// Variable value saved by "local", put back when the function returns
+struct saved_var {
+    char *name;
+    char *value;  // NULL if the variable did not exist
+    int global;
+    char *env;    // Environment entry, NULL if there was none
+};
+
+// Call frame of a running function
+struct frame {
+    char **args;  // Positional parameters $1, $2, ...
+    int nargs;
+    struct saved_var *locals;
+    int nlocals;
+};
+
+// Alias: name=value, chained in its hash bucket
+struct alias {
+    char *name;
+    char *value;
+    struct alias *next;
+};
+
+// Aliases being expanded, innermost first, so none expands inside itself
+struct alias_chain {
+    struct alias *alias;
+    const struct alias_chain *outer;
+};
+
+struct alias *alias_table[ALIASHASH];
+int alias_count = 0;
+
+struct function func_table[MAXFUNCS];
+int func_count = 0;
+struct frame frames[MAXDEPTH];  // Function call stack
+int frame_depth = 0;
+int func_returning = 0;  // Set by "return" until the call unwinds
+int loop_exit = 0;        // 'b' or 'c' from the break or continue builtin until a loop takes it
+int loop_exit_count = 0;  // Loops it still applies to, as in break 2
+int loops_running = 0;    // Loops around the command being run
+
 char* command_history[HISTSIZE];
 int hist_index = 0;
-pid_t jobs[MAXJOBS];  // Array to store background job PIDs
-int job_count = 0;     // Current number of jobs
+
+// Job: the processes of one pipeline, sharing a process group
+enum job_state { JOB_RUNNING, JOB_STOPPED, JOB_DONE };
+
+struct proc {
+    pid_t pid;
+    int status;  // Wait status once done
+    enum job_state state;
+    struct timespec started;  // When it was forked
+    double elapsed_ms;        // Fork to reap, once done
+};
+
+struct job {
+    int id;          // Job number shown as [n]
+    pid_t pgid;
+    struct proc *procs;
+    int nprocs;
+    char *cmd;       // Command text for jobs and fg
+    int foreground;
+    struct termios tmodes;  // Terminal modes saved when it was stopped
+    struct timespec deadline;  // CLOCK_MONOTONIC time of the timeout, tv_sec 0 if none
+    int timeout_sig;           // Sent at the deadline
+    double kill_after;         // Seconds until SIGKILL follows, 0 for never
+    int timed_out;
+    int queued;    // Waiting in job_events to be reported
+    int notified;  // Done line already printed (set -b)
+};
+
+// Job n lives in jobs[n - 1] for as long as it exists; free slots have id 0
+struct job jobs[MAXJOBS];  // Background and stopped jobs
+int job_count = 0;         // Slots in use are all below this
+int current_job = -1;      // Slot of the job %+ refers to
+
+// pid -> job slot, so reaping a child does not search every job. Open
+// addressing; pid 0 marks a free entry and -1 a deleted one.
+struct pid_entry {
+    pid_t pid;
+    int slot;
+};
+struct pid_entry pid_index[PIDHASH];
+
+// Jobs that finished or stopped since the last prompt, filled by the SIGCHLD
+// handler. A job is queued at most once, so MAXJOBS entries are enough.
+int job_events[MAXJOBS];
+unsigned job_events_head = 0, job_events_tail = 0;
+int notify_now = 0;  // set -b: report finished jobs immediately
+int job_control = 0;       // Interactive: jobs get process groups and the terminal
+pid_t shell_pgid;
+struct termios shell_tmodes;
+// Status of the last command ($?) and of each stage of the last foreground
+// pipeline: ${PIPESTATUS[i]}, ${PIPESIGNAL[i]} and ${PIPETIME[i]} in ms
+int last_status = 0;
+int pipefail = 0;  // set -o pipefail: a pipeline fails if any stage does
+int *pipe_status = NULL;
+int *pipe_signal = NULL;  // Signal that ended the stage, or 0
+double *pipe_time = NULL;
+int pipe_count = 0;
+unsigned pipe_serial = 0;  // Bumped on each update
+struct job *fg_job = NULL;  // Foreground job being waited for, seen by the SIGALRM handler
+
+// Output of a background job under set -o multiplex. The job writes into a
+// pipe that the shell drains through output_epoll; complete lines go to the
+// terminal tagged [n], and the last bytes stay in a ring for jobs -o n.
+// Offsets count all bytes read, so byte k lives in ring[k % cap].
+struct job_output {
+    int id;                  // Job number, the tag of its lines
+    int fd;                  // Read end of the job's pipe, -1 at end of output
+    char *ring;
+    size_t cap;              // Grows up to MUXRING within MUXBUDGET
+    size_t total;            // Bytes read
+    size_t shown;            // Bytes written to the terminal
+    size_t scanned;          // No newline in [shown, scanned)
+    int paused;              // Out of output_epoll while the ring is full
+    unsigned long finished;  // Order in which the output ended, 0 while open
+};
+
+struct job_output *outputs[MAXJOBS + MUXKEEP];
+int output_count = 0;
+int open_outputs = 0;           // Outputs still being read
+size_t output_bytes = 0;        // Ring memory in use, at most MUXBUDGET
+unsigned long output_serial = 0;
+int output_epoll = -1;
+int sigchld_fd = -1;            // signalfd for SIGCHLD, polled by wait_job with outputs open
+int multiplex = 0;              // set -o multiplex
+int output_held = 0;            // A foreground job has the terminal: only its output is shown
+int output_fg_id = 0;
+int output_clear_line = 0;      // The line editor's line is on screen and must be cleared first
+
+// The shell's ends of the pipes of <(list) and >(list), inherited by the
+// command they were expanded for and closed once it has finished
+int procsub_fds[MAXPROCSUB];
+int procsub_count = 0;
+
+// memo: variables that change what most commands print, always in the key
+const char *memo_env[] = { "PATH", "LANG", "LC_ALL", NULL };
+
+// What a file contributes to a memo key; a missing file is all zeros
+struct memo_stamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+// A file in the memo cache, as listed for eviction
+struct memo_object {
+    char *name;
+    off_t size;
+    struct timespec used;  // mtime, updated on every hit
+};
+
+// A memo key: everything the output depends on, and its hash naming the
+// key file. The file holds the bytes too, so a hash collision is a miss.
+struct memo_key {
+    char *data;
+    size_t len;
+    size_t cap;
+    unsigned long long hash;
+};
+
+int memo_hits = 0, memo_misses = 0;
+
+// An asynchronous prompt segment: a command run in the background from the
+// current directory and a parser turning its output into the text shown
+struct prompt_segment {
+    char escape;  // \g in PS1
+    char *const argv[8];
+    void (*parse)(const char *out, size_t len, int truncated, char *value, size_t size);
+};
+
+// The last value of a segment in one directory, and its worker if running
+struct segment_result {
+    int segment;            // Index in prompt_segments
+    char *dir;              // NULL for an unused slot
+    char value[128];
+    unsigned long serial;   // commands_run when the value was computed
+    unsigned long started;  // commands_run when the worker started
+    unsigned long used;     // segment_clock when last shown
+    int running;
+    int fd;                 // Worker's output while running
+    char out[SEGMENTOUT];
+    size_t len;
+    int truncated;          // Output past out[] was dropped
+};
+
+struct segment_result segment_cache[PROMPTCACHE];
+unsigned long segment_clock = 0;
+unsigned long commands_run = 0;  // Command lines run at the prompt
+double last_duration_ms = -1;    // Wall time of the last of them, for \D
+char *prompt_text = NULL;        // Built by build_prompt()
+
+// Tokens produced by tokenize()
+enum token_type {
+    TOK_WORD, TOK_NEWLINE, TOK_SEMI, TOK_DSEMI, TOK_AMP, TOK_AND, TOK_OR, TOK_PIPE,
+    TOK_LPAREN, TOK_RPAREN,
+    TOK_FANOUT, TOK_COMMA, TOK_FANEND,  // |> { , } of a fan-out
+    // Redirection operators: < > >> <> << <<- <<< >& <& &> &>> and the n in n>
+    TOK_LESS, TOK_GREAT, TOK_DGREAT, TOK_LESSGREAT, TOK_DLESS, TOK_DLESSDASH, TOK_TLESS,
+    TOK_GREATAND, TOK_LESSAND, TOK_ANDGREAT, TOK_ANDDGREAT, TOK_IONUMBER,
+    TOK_EOF
+};
+
+struct token {
+    enum token_type type;
+    char *text;  // Word as typed, quotes included (TOK_WORD, TOK_IONUMBER)
+    char *body;  // Here-document text, on the delimiter word after << or <<-
+    int start;   // Offsets of the token in the command line
+    int end;
+};
+
+// Parser state for one command line
+struct parser {
+    struct token *toks;
+    int pos;
+    const char *line;
+    int incomplete;  // Input ended inside an unfinished construct
+    int error;       // A syntax error has been reported
+};
+
+enum redir_type {
+    REDIR_IN,       // < file
+    REDIR_OUT,      // > file
+    REDIR_APPEND,   // >> file
+    REDIR_RDWR,     // <> file
+    REDIR_DUP,      // n>&m, n<&m, n>&-
+    REDIR_HEREDOC,  // <<EOF ... EOF
+    REDIR_HERESTR   // <<< word
+};
+
+struct redir {
+    enum redir_type type;
+    int fd;        // Descriptor being redirected
+    char *target;  // File name, descriptor or here-string as typed; here-document text
+    int literal;   // Here-document with a quoted delimiter: no expansion
+    struct redir *next;
+};
+
+enum node_type {
+    NODE_CMD,       // Simple command
+    NODE_PIPE,      // cmd | cmd | ...
+    NODE_AND,       // left && right
+    NODE_OR,        // left || right
+    NODE_SEQ,       // left ; right
+    NODE_BG,        // left &
+    NODE_SUBSHELL,  // ( list )
+    NODE_GROUP,     // { list; }
+    NODE_BENCH,     // bench [options] pipeline
+    NODE_IF,        // if left; then right; else alt; fi
+    NODE_WHILE,     // while left; do right; done
+    NODE_UNTIL,     // until left; do right; done
+    NODE_FOR,       // for argv[0] in argv[1..]; do right; done
+    NODE_CASE,      // case argv[0] in stages...; esac
+    NODE_CASE_ITEM, // argv) right ;;
+    NODE_PROGRAM,   // Control flow compiled to bytecode
+    NODE_FUNCDEF,   // argv[0]() left
+    NODE_SCHED,     // sched [options] left
+    NODE_LIMIT,     // limit [options] left
+    NODE_TIMEOUT,   // timeout [options] pipeline
+    NODE_FANOUT     // left |> { stages, ... }
+};
+
+// Bytecode run by run_program(). Control structures are compiled once when
+// the line is parsed; the commands inside them stay prebuilt syntax trees.
+enum opcode {
+    OP_RUN,      // status = exec_node(nodes[arg])
+    OP_JMP,      // pc = target
+    OP_JZ,       // pc = target if status is 0
+    OP_JNZ,      // pc = target if status is not 0
+    OP_STATUS,   // status = arg
+    OP_SAVE,     // saved = status, the result of the innermost loop
+    OP_RESTORE,  // status = saved
+    OP_FOR,      // push an iterator over words[arg .. arg + count - 1]
+    OP_NEXT,     // set variable words[arg] to the next item, or pop and jump
+    OP_POP,      // drop the innermost iterator (break out of a for loop)
+    OP_CASE,     // subject = expansion of words[arg]
+    OP_MATCH     // pc = target if pattern words[arg] matches the subject
+};
+
+struct instr {
+    enum opcode op;
+    int arg;
+    int count;
+    int target;
+};
+
+struct program {
+    struct instr *code;
+    int ncode;
+    struct node **nodes;  // Prebuilt commands run by OP_RUN
+    int nnodes;
+    char **words;         // Loop variables, word lists and case patterns
+    int nwords;
+    int max_depth;        // Deepest nesting of for loops
+    struct loop_range *loops;  // Innermost first, for break and continue run as builtins
+    int nloops;
+};
+
+// Code of one loop's body, [start, end), and where break and continue go
+struct loop_range {
+    int start;
+    int end;
+    int continue_pc;
+    int break_pc;
+    int is_for;  // Has an iterator to pop when the loop is left
+};
+
+// Iterator of a running for loop
+struct for_iter {
+    char **items;
+    int pos;
+};
+
+// Jumps of the loop being compiled that break and continue resolve to
+struct loop_ctx {
+    int continue_pc;
+    int *breaks;  // OP_JMPs to patch with the loop's exit
+    int nbreaks;
+};
+
+// Node of the syntax tree built by the parser
+struct node {
+    enum node_type type;
+    char **argv;           // Words of NODE_CMD, options of prefix nodes (bench, sched, ...)
+    int argc;
+    struct redir *redirs;  // NODE_CMD, NODE_SUBSHELL and NODE_GROUP
+    struct node *left;     // Body, or left operand
+    struct node *right;    // Right operand, or loop/branch body
+    struct node *alt;      // else/elif branch of NODE_IF
+    struct node **stages;  // NODE_PIPE stages
+    int nstages;
+    char *text;            // Source text for job and bench output
+    struct program *prog;  // NODE_PROGRAM bytecode
+    int refs;              // Users of a cached tree (root node only)
+};
+
+// Descriptors replaced by redirections in the shell process itself, put back
+// when the builtin or group finishes. Grows with the redirections applied.
+struct saved_fds {
+    int *fd;
+    int *copy;
+    int *opened;  // The redirection opened a file with open_redir()
+    int count;
+    int size;
+};
+
+struct builtin {
+    const char *name;
+    int (*func)(char **argv);
+};
+
+// Growable list of expanded words
+struct wordlist {
+    char **words;
+    int count;
+    int cap;
+};
+
+// One element of a compiled glob pattern
+enum glob_op { GLOB_CHAR, GLOB_ANY, GLOB_STAR, GLOB_CLASS };
+
+struct glob_atom {
+    enum glob_op op;
+    unsigned char c;        // GLOB_CHAR
+    unsigned char set[32];  // GLOB_CLASS: bitmap of accepted bytes
+};
+
+// One '/'-separated part of a glob pattern
+struct glob_part {
+    struct glob_atom *atoms;
+    int natoms;
+    char *literal;   // The part without quoting, used when is_literal
+    int is_literal;  // No wildcards: no directory read needed
+    int dot;         // Starts with '.', so it may match hidden names
+    int globstar;    // Exactly **: any number of directories
+};
+
+// Line being edited at the prompt
+struct line_edit {
+    char *buf;
+    size_t len;
+    size_t cap;
+    size_t pos;  // Cursor
+};
+
+// Executable in the command index; bit i of dirs is set when PATH directory
+// i has it, so it stays until the last of them loses it
+struct exe_entry {
+    char *name;
+    unsigned long long dirs;
+};
+
+struct exe_entry *exe_index = NULL;  // Sorted by name
+int exe_count = 0, exe_cap = 0;
+char *index_path = NULL;  // PATH the index was built from
+char *path_dirs[MAXPATHDIRS];
+int path_watch[MAXPATHDIRS];  // inotify watch of each directory
+int path_ndirs = 0;
+int inotify_fd = -1;
+int index_pipe = -1;  // Output of the background scan until it is read
+
+// Startup file and its state when the shell read it
+struct rc_file {
+    const char *path;
+    int exists;
+    struct stat st;
+};
+
+// Startup snapshot file: this header, then size bytes of fields
+struct snap_header {
+    char build[64];  // snap_build_id() of the shell that wrote it
+    unsigned long long size;
+    unsigned long long checksum;
+};
+
+struct snap_buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct snap_reader {
+    const char *pos;
+    const char *end;
+    int bad;  // Read past the end: the snapshot is damaged
+};
+
+// Command index from the snapshot with what it was built from
+struct {
+    char *path;
+    char **dirs;
+    struct timespec *mtimes;
+    int ndirs;
+    struct exe_entry *entries;
+    int count;
+} snap_index;
+
+// Request sent to the command server with the client's fds 0, 1 and 2,
+// followed by cwd_len bytes of working directory and cmd_len of command
+struct server_request {
+    unsigned int magic;
+    unsigned int cwd_len;
+    unsigned int cmd_len;
+};
+
+int server_conn = -1;  // Client connection of a server session
+
+// Request handing a command to a process of the pre-forked pool (--zygote),
+// sent with the fds for 0, 1 and 2. Followed by size bytes of NUL-terminated
+// strings: the working directory, argc words and envc environment entries.
+struct zygote_request {
+    unsigned int magic;
+    pid_t pgid;         // Process group to join, 0 to lead a new one
+    int take_terminal;  // Make that group the terminal's foreground group
+    mode_t umask;
+    struct rlimit limits[RLIM_NLIMITS];
+    unsigned int argc;
+    unsigned int envc;
+    unsigned int size;
+};
+
+int zygote_fd = -1;      // Shell's end of the pool socket
+pid_t zygote_owner = 0;  // Pool processes are reparented to this shell only
+int use_zygote = 0;      // set -o zygote: start commands from the pool
+
+// Parse cache entry, keyed by the exact command line text
+struct cache_entry {
+    char *line;
+    unsigned int hash;
+    struct node *tree;
+    unsigned long last_used;  // LRU tick of the last hit
+};
+
+struct cache_entry parse_cache[PARSECACHE];
+unsigned long cache_tick = 0;
+unsigned long cache_hits = 0, cache_misses = 0;
+struct rusage last_usage;  // Resource usage of the last foreground command
+int report_status = 1;     // Print "Child exited" after foreground commands
+pid_t shell_pid;           // PID of the interactive shell, not its children
+
+// Page cache policy for files opened by redirections (set -o redirect-policy=...)
+#define RP_SEQUENTIAL 1  // posix_fadvise(POSIX_FADV_SEQUENTIAL): larger readahead
+#define RP_NOREUSE 2     // POSIX_FADV_NOREUSE: data is accessed once (ignored before Linux 6.3)
+#define RP_DONTNEED 4    // POSIX_FADV_DONTNEED: drop the file's cached pages when the shell undoes the redirection
+#define RP_DIRECT 8      // O_DIRECT: bypass the page cache
+#define RP_NOATIME 16    // O_NOATIME: no access time updates on reads
+
+struct policy_flag {
+    const char *name;
+    int bit;
+};
+
+struct policy_flag policy_flags[] = {
+    { "sequential", RP_SEQUENTIAL },
+    { "noreuse", RP_NOREUSE },
+    { "dontneed", RP_DONTNEED },
+    { "direct", RP_DIRECT },
+    { "noatime", RP_NOATIME },
+    { NULL, 0 }
+};
+
+int redirect_policy = 0;
+
+// On/off options for set -o name / set +o name
+struct shell_option {
+    const char *name;
+    int *value;
+};
+
+struct shell_option shell_options[] = {
+    { "notify", &notify_now },  // Also set -b
+    { "pipefail", &pipefail },
+    { "zygote", &use_zygote },
+    { "multiplex", &multiplex },
+    { NULL, NULL }
+};
 
 // Function declarations
-int execute(char* arglist[], char* infile, char* outfile, int background);
-void execute_pipe(char* arglist1[], char* arglist2[], char* infile, char* outfile);
-char** tokenize(char* cmdline);
-char* read_cmd(char* prompt);
+int run_line(char *cmdline);
+int run_tree(struct node *tree);
+struct node* parse_group_or_simple(struct parser *p);
+struct node* parse_funcdef(struct parser *p);
+struct node* parse_timeout(struct parser *p);
+struct node* parse_prefix(struct parser *p, enum node_type type);
+int exec_prefixed(struct node *n);
+int apply_sched(struct node *n);
+int apply_limit(struct node *n);
+int parse_cpulist(const char *list, cpu_set_t *set);
+struct node* parse_cached(const char *cmdline, int *incomplete);
+struct node* parse_line(const char *cmdline, int *incomplete);
+struct node* parse_list(struct parser *p);
+struct node* parse_and_or(struct parser *p);
+struct node* parse_pipeline(struct parser *p);
+struct node* parse_fanout(struct parser *p, struct node *producer, int first);
+struct node* parse_command(struct parser *p);
+struct node* compile_tree(struct node *n);
+int run_program(struct program *pr);
+int loops_around(struct program *pr, int pc);
+int take_loop_exit(struct program *pr, int pc, struct for_iter *iters, int *depth);
+void free_program(struct program *pr);
+void free_node(struct node *n);
+void release_tree(struct node *tree);
+struct node* cache_lookup(const char *cmdline);
+void cache_insert(const char *cmdline, struct node *tree);
+void cache_clear();
+void print_cache_stats();
+int exec_node(struct node *n);
+int exec_node_type(struct node *n);
+int status_code(int wstatus);
+void set_pipestatus(int count, const int *wstatus, const double *elapsed_ms);
+int exec_simple(struct node *n);
+void exec_in_child(struct node *n);
+int execute(char* arglist[], struct redir *redirs);
+int execute_pipe(struct node *pipeline);
+int execute_fanout(struct node *n);
+void fanout_pump(int in, int *out, int n);
+int tee_exact(int in, int out, size_t len, int spare[2]);
+void discard_pipe(int fd, size_t len);
+int exec_subshell(struct node *n);
+int exec_group(struct node *n);
+int exec_program(struct node *n);
+int run_background(struct node *n);
+int apply_redirs(struct redir *r, struct saved_fds *saved);
+void restore_fds(struct saved_fds *saved);
+void save_fd(struct saved_fds *saved, int fd);
+int here_fd(const char *text, size_t len);
+int open_redir(const char *target, int flags);
+void drop_cached(int fd);
+int set_option(const char *name, int on);
+void print_options();
+char* expand_heredoc(const char *text);
+const char* procsub_end(const char *open);
+char* start_procsub(const char *text, int output);
+void close_procsubs(int keep);
+unsigned long long memo_hash(unsigned long long h, const void *data, size_t len);
+void memo_key_add(struct memo_key *key, const void *data, size_t len);
+void memo_key_file(struct memo_key *key, const char *path);
+int find_program(const char *name, char *path, size_t size);
+void memo_key(struct memo_key *key, char **argv, char **deps, int ndeps, char **envs, int nenvs);
+int memo_path(char *buf, size_t size, const char *sub, const char *name);
+off_t memo_limit();
+int write_all(int fd, const char *buf, size_t len);
+int memo_serve(const struct memo_key *key, int *status);
+int same_contents(const char *a, const char *b);
+void memo_store(const struct memo_key *key, const char *tmp, unsigned long long hash, off_t size, int status);
+int memo_record(char **argv, const struct memo_key *key);
+int memo_run(char **argv, const struct memo_key *key);
+int compare_memo_object(const void *a, const void *b);
+int memo_scan(const char *sub, struct memo_object **objects, off_t *total);
+void free_memo_objects(struct memo_object *objects, int count);
+void memo_evict();
+long exec_budget(const char *path, char **fixed);
+void start_batch(const char *path, char **argv, int nfixed, int nitems, int parallel, int *running, int *status);
+void reap_batch(int *running, int *status);
+int run_batches(const char *path, char **fixed, int delim, int maxitems, int parallel, int stats);
+char** expand_words(char **words);
+char* expand_word(const char *word);
+const char* lookup_var(const char *name);
+char* param_value(const char *name);
+char* pipe_param(const char *name);
+char* expand_param(const char **cpp);
+int is_assignment(const char *word);
+int assign_vars(struct node *n);
+void free_words(char **words);
+int glob_expand(const char *pattern, struct wordlist *wl);
+struct builtin* find_builtin(const char *name);
+pid_t fork_child(sigset_t *oldmask);
+void exit_shell(int status);
+void block_sigchld(sigset_t *oldmask);
+void add_usage(struct rusage *a, const struct rusage *b);
+struct token* tokenize(const char* cmdline, int *incomplete);
+struct token* tokenize_with(const char* cmdline, int *incomplete, const struct alias_chain *active);
+int expand_alias(struct token **toks, int *n, int *cap, const struct alias_chain *active);
+int is_reserved_word(const char *word);
+struct alias* find_alias(const char *name);
+void set_alias(const char *name, const char *value);
+int unset_alias(const char *name);
+void print_alias(struct alias *a);
+int compare_aliases(const void *a, const void *b);
+const char* read_heredoc(const char *cp, struct token *tok, int strip_tabs);
+char* heredoc_delimiter(const char *word);
+void append_char(char **buf, size_t *len, size_t *cap, char c);
+int is_redir_token(enum token_type type);
+void free_tokens(struct token *toks);
+char* read_cmd(const char *prompt);
+const char* build_prompt();
+void format_duration(double ms, char *buf, size_t size);
+int find_segment(char escape);
+struct segment_result* segment_result(int segment, const char *dir);
+void start_segment(struct segment_result *r);
+int segment_fds(struct pollfd *fds);
+int read_segments();
+void parse_git_status(const char *out, size_t len, int truncated, char *value, size_t size);
+char* edit_line(const char *prompt);
+void refresh_line(struct line_edit *ed, const char *prompt);
+void line_insert(struct line_edit *ed, const char *text);
+void complete_line(struct line_edit *ed, int tabs);
+char* complete_quote(const char *text);
+void complete_variables(const char *prefix, struct wordlist *wl);
+void complete_commands(const char *prefix, struct wordlist *wl);
+void complete_files(const char *word, int command, struct wordlist *wl);
+void start_command_index();
+int is_executable(int dirfd, const char *name);
+void load_command_index();
+int compare_exe(const void *a, const void *b);
+int index_lookup(const char *prefix);
+void index_update(const char *name, int dir, int exists);
+int compare_strings(const void *a, const void *b);
+void load_rc_files();
+int source_file(const char *path);
+void snap_put(struct snap_buf *b, const void *data, size_t n);
+void snap_put_int(struct snap_buf *b, long long v);
+void snap_put_str(struct snap_buf *b, const char *s);
+void snap_put_words(struct snap_buf *b, char **words, int count);
+void snap_put_node(struct snap_buf *b, struct node *n);
+long long snap_get_int(struct snap_reader *r);
+int snap_get_count(struct snap_reader *r);
+char* snap_get_str(struct snap_reader *r);
+char** snap_get_words(struct snap_reader *r, int *count);
+struct node* snap_get_node(struct snap_reader *r);
+const char* snap_build_id();
+void save_snapshot(const char *path, struct rc_file *rcs, int nrc);
+unsigned long long snap_checksum(const char *data, size_t len);
+int load_snapshot(const char *path, struct rc_file *rcs, int nrc);
+int snap_index_current();
+int adopt_snap_index();
+void free_snap_index();
+int run_server(const char *path, int max_sessions);
+void serve_session(int conn);
+int recv_request(int conn, struct server_request *req, int fds[3]);
+int read_full(int fd, char *buf, size_t len);
+void start_zygote(int size);
+void zygote_helper(int pool_fd, int notify[2], pid_t shell, int size);
+void zygote_spawn(int pool_fd, int notify_fd, pid_t shell);
+void zygote_child(int pool_fd, int notify_fd, pid_t shell, int orphaned_fd);
+pid_t zygote_exec(struct job *j, char *arglist[], struct redir *redirs);
 void add_to_history(const char* cmdline);
 void repeat_command(int command_number);
 void free_history();
 void list_jobs();
-void kill_job(int job_number);
+void init_job_control();
+pid_t fork_job(struct job *j, sigset_t *oldmask);
+int job_own_group(struct job *j);
+void add_proc(struct job *j, pid_t pid);
+int wait_job(struct job *j);
+struct job* add_job(struct job *j);
+void free_job(struct job *j);
+void remove_job(int i);
+void notify_jobs();
+int start_output(int id, int fd);
+void read_output(struct job_output *o);
+int grow_output(struct job_output *o);
+int emit_output(struct job_output *o, int force);
+int drain_outputs();
+void flush_outputs();
+void drop_output(int i);
+struct job_output* find_output(int id);
+int outputs_active();
+pid_t wait_child(int *status, struct rusage *usage);
+void index_job_pids(int slot);
+int lookup_pid(pid_t pid);
+size_t format_job(struct job *j, char *buf, size_t size);
+const char* signal_name(int sig);
+int find_job(const char *spec);
+void continue_job(struct job *j);
+void mark_process(pid_t pid, int status);
+enum job_state job_state(struct job *j);
+int parse_signal(const char *name);
+int exec_timeout(struct node *n);
+int set_job_timeout(struct job *j, struct node *n);
+double parse_duration(const char *text);
+void add_seconds(struct timespec *ts, double seconds);
+void check_deadline(struct job *j, const struct timespec *now);
+void arm_timer();
+void sigalrm_handler(int signum);
+char* join_words(char **words);
 void help();
+int bench(struct node *n);
+int is_bench_option(struct token *t);
+int parse_count(const char *text);
+double square_root(double x);
 // Function declarations for variables
 void set_var(char *name, char *value, int global);
+void assign_var(char *name, char *value);
 char* get_var(char *name);
 void unset_var(char *name);
 void print_vars();
+// Function declarations for shell functions
+struct function* find_function(const char *name);
+void define_function(char *name, struct node *body);
+void unset_function(char *name);
+int call_function(struct node *body, char **argv);
 
 
+// Reaps background children and records their state in the job table.
+// Foreground waits keep SIGCHLD blocked, so their children are not taken.
 void sigchld_handler(int signum) {
-    while (waitpid(-1, NULL, WNOHANG) > 0);
+    int saved_errno = errno;
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0) {
+        mark_process(pid, status);
+    }
+    errno = saved_errno;
 }
 
-int main() {
+int main(int argc, char *argv[]) {
     char *cmdline;
-    char **arglist;
-    int mera = 0;
+    const char *server_path = NULL;
+    int max_sessions = 16;
+    int zygote_size = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--server") == 0 && i + 1 < argc) {
+            server_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-sessions") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            max_sessions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--zygote") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            zygote_size = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "usage: %s [--zygote N] [--server socket [--max-sessions N]]\n", argv[0]);
+            return 2;
+        }
+    }
 
+    shell_pid = getpid();
+    // First, while the shell is small and has no handlers installed
+    if (zygote_size > 0 && server_path == NULL) {
+        start_zygote(zygote_size);
+    }
     struct sigaction sa;
     sa.sa_handler = sigchld_handler;
     sigemptyset(&sa.sa_mask);
@@ -64,23 +848,27 @@ int main() {
         perror("sigaction failed");
         exit(1);
     }
+    // Job timeouts. The handler only sends signals; the waits and reads it
+    // interrupts are restarted.
+    sa.sa_handler = sigalrm_handler;
+    if (sigaction(SIGALRM, &sa, NULL) == -1) {
+        perror("sigaction failed");
+        exit(1);
+    }
+    if (server_path != NULL) {
+        load_rc_files();
+        return run_server(server_path, max_sessions);
+    }
+    init_job_control();
+    load_rc_files();
+    if (job_control && index_path == NULL) {
+        start_command_index();
+    }
 
     while (1) {
-        struct passwd *pw = getpwuid(getuid());
-        const char *username = pw ? pw->pw_name : "unknown";
-        char cwd[PATH_MAX];
-        getcwd(cwd, sizeof(cwd));
-        int length_needed = snprintf(NULL, 0, "%s@%s$ ", username, cwd) + 1;
-        char *prompt = malloc(length_needed);
-        if (prompt == NULL) {
-            perror("Unable to allocate memory for prompt");
-            exit(1);
-        }
-        snprintf(prompt, length_needed, "%s@%s$ ", username, cwd);
+        notify_jobs();
 
-
-        if ((cmdline = read_cmd(prompt)) == NULL) {
-            free(prompt);
+        if ((cmdline = read_cmd(build_prompt())) == NULL) {
             break;
         }
 
@@ -93,355 +881,7179 @@ int main() {
                 command_number -= 1; // Adjust for zero-based index
             }
             repeat_command(command_number);
+            commands_run++;
             free(cmdline);
-            free(prompt);
             continue; // Skip the rest of the loop
         }
 
+        // Keep reading lines while the command is unfinished, e.g. an open
+        // quote or group, or a line ending in '|' or '&&'
+        struct node *tree;
+        int incomplete;
+        while ((tree = parse_cached(cmdline, &incomplete)) == NULL && incomplete) {
+            char *more = read_cmd("> ");
+            if (more == NULL) {
+                fprintf(stderr, "syntax error: unexpected end of input\n");
+                break;
+            }
+            cmdline = realloc(cmdline, strlen(cmdline) + strlen(more) + 2);
+            strcat(cmdline, "\n");
+            strcat(cmdline, more);
+            free(more);
+        }
+
         // Add command to history
         add_to_history(cmdline);
 
-        // Tokenize the command line
-        if ((arglist = tokenize(cmdline)) != NULL) {
-            char *infile = NULL;
-            char *outfile = NULL;
-            char *arglist2[MAXARGS + 1];
-            int i = 0, j = 0;
-            int background = 0;
-
-            int last_arg = 0;
-            while (arglist[last_arg] != NULL) {
-                last_arg++;
-            }
-            last_arg--;
-            if (strcmp(arglist[last_arg], "&") == 0) {
-                background = 1;
-                arglist[last_arg] = NULL;
-            }
-
-            if (strcmp(arglist[0], "set") == 0 && arglist[1] != NULL && arglist[2] != NULL) {
-                // "set name value" command
-                set_var(arglist[1], arglist[2], 0);  // 0 indicates local variable
-            } else if (strcmp(arglist[0], "export") == 0 && arglist[1] != NULL) {
-                // "export name" command
-                char *value = get_var(arglist[1]);
-                if (value != NULL) {
-                    set_var(arglist[1], value, 1);  // Set as global
-                    setenv(arglist[1], value, 1);  // Update the environment variable
-                }
-            } else if (strcmp(arglist[0], "unset") == 0 && arglist[1] != NULL) {
-                // "unset name" command
-                unset_var(arglist[1]);
-            } else if (strcmp(arglist[0], "printenv") == 0) {
-                // "printenv" command to list all variables
-                print_vars();
-            }
-
-            while (arglist[i] != NULL) {
-                if (strcmp(arglist[i], "<") == 0) {
-                    infile = arglist[i + 1];
-                    arglist[i] = NULL;
-                } else if (strcmp(arglist[i], ">") == 0) {
-                    outfile = arglist[i + 1];
-                    arglist[i] = NULL;
-                } else if (strcmp(arglist[i], "|") == 0) {
-                    arglist[i] = NULL;
-                    while (arglist[i + 1] != NULL) {
-                        arglist2[j++] = arglist[i + 1];
-                        i++;
-                    }
-                    arglist2[j] = NULL;
-                    execute_pipe(arglist, arglist2, infile, outfile);
-                    mera += 1;
-                    break;
-                }
-                i++;
+        if (tree != NULL) {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            run_tree(tree);
+            clock_gettime(CLOCK_MONOTONIC, &t1);
+            last_duration_ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+            commands_run++;
+        }
+        free(cmdline);
+    }
+
+    flush_outputs();
+    printf("\n");
+    free_history();
+    return 0;
+}
+
+// Parses and runs one command line. Returns the exit status of the command.
+int run_line(char *cmdline) {
+    int incomplete;
+    struct node *tree = parse_cached(cmdline, &incomplete);
+    if (incomplete) {
+        fprintf(stderr, "syntax error: unexpected end of input\n");
+    }
+    return tree != NULL ? run_tree(tree) : 0;
+}
+
+// Runs a tree from the parse cache, holding a reference so the tree cannot be
+// freed by an eviction while it executes.
+int run_tree(struct node *tree) {
+    int procsubs = procsub_count;
+    tree->refs++;
+    int status = exec_node(tree);
+    release_tree(tree);
+    close_procsubs(procsubs);  // Left by words expanded outside a command, e.g. for's
+    return status;
+}
+
+// Returns the syntax tree for a command line, reusing the parse cache when
+// the same text was seen recently. Sets *incomplete when more input is needed.
+struct node* parse_cached(const char *cmdline, int *incomplete) {
+    *incomplete = 0;
+    struct node *tree = cache_lookup(cmdline);
+    if (tree == NULL && (tree = parse_line(cmdline, incomplete)) != NULL) {
+        cache_insert(cmdline, tree);
+    }
+    return tree;
+}
+
+// FNV-1a hash of the command line text
+unsigned int hash_line(const char *s) {
+    unsigned int h = 2166136261u;
+    while (*s) {
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+struct node* cache_lookup(const char *cmdline) {
+    unsigned int hash = hash_line(cmdline);
+    for (int i = 0; i < PARSECACHE; i++) {
+        if (parse_cache[i].line != NULL && parse_cache[i].hash == hash
+                && strcmp(parse_cache[i].line, cmdline) == 0) {
+            parse_cache[i].last_used = ++cache_tick;
+            cache_hits++;
+            return parse_cache[i].tree;
+        }
+    }
+    cache_misses++;
+    return NULL;
+}
+
+// Stores a parsed tree, evicting the least recently used entry when full.
+void cache_insert(const char *cmdline, struct node *tree) {
+    int slot = 0;
+    for (int i = 0; i < PARSECACHE; i++) {
+        if (parse_cache[i].line == NULL) {
+            slot = i;
+            break;
+        }
+        if (parse_cache[i].last_used < parse_cache[slot].last_used) {
+            slot = i;
+        }
+    }
+    if (parse_cache[slot].line != NULL) {
+        free(parse_cache[slot].line);
+        release_tree(parse_cache[slot].tree);
+    }
+    tree->refs = 1;
+    parse_cache[slot].line = strdup(cmdline);
+    parse_cache[slot].hash = hash_line(cmdline);
+    parse_cache[slot].tree = tree;
+    parse_cache[slot].last_used = ++cache_tick;
+}
+
+void cache_clear() {
+    for (int i = 0; i < PARSECACHE; i++) {
+        if (parse_cache[i].line != NULL) {
+            free(parse_cache[i].line);
+            release_tree(parse_cache[i].tree);
+            parse_cache[i].line = NULL;
+        }
+    }
+    cache_hits = cache_misses = 0;
+}
+
+void print_cache_stats() {
+    int entries = 0;
+    for (int i = 0; i < PARSECACHE; i++) {
+        if (parse_cache[i].line != NULL) {
+            entries++;
+        }
+    }
+    printf("Parse cache: %d/%d entries, %lu hits, %lu misses\n",
+           entries, PARSECACHE, cache_hits, cache_misses);
+}
+
+struct token* tokenize(const char* cmdline, int *incomplete) {
+    return tokenize_with(cmdline, incomplete, NULL);
+}
+
+// Splits a command line into tokens. A word in command position that names
+// an alias is replaced by the tokens of its value, unless that alias is in
+// the active chain of expansions already.
+struct token* tokenize_with(const char* cmdline, int *incomplete, const struct alias_chain *active) {
+    int cap = 16, n = 0;
+    struct token *toks = malloc(sizeof(struct token) * cap);
+    const char *cp = cmdline;
+
+    int pending_here = 0;  // << operators waiting for their body
+    int command = 1;       // The next word may be a command name
+    // Inside the braces of a fan-out ',' separates consumers and the closing
+    // '}' ends the fan-out: the brace depth at which each open fan-out began
+    int fanout_depth[16];
+    int fanouts = 0, braces = 0;
+
+    *incomplete = 0;
+    while (1) {
+        while (*cp == ' ' || *cp == '\t') {
+            cp++;
+        }
+        if (*cp == '#') {
+            while (*cp != '\0' && *cp != '\n') {
+                cp++;
             }
+        }
+        if (n == cap) {
+            cap *= 2;
+            toks = realloc(toks, sizeof(struct token) * cap);
+        }
 
-            // Check for built-in commands
-            if (arglist[0] != NULL) {
-                if (strcmp(arglist[0], "cd") == 0) {
-                    if (arglist[1] != NULL) {
-                        if (chdir(arglist[1]) != 0) {
-                            perror("cd failed");
-                        }
+        struct token *t = &toks[n++];
+        t->text = NULL;
+        t->body = NULL;
+        t->start = cp - cmdline;
+        if (*cp == '\0') {
+            t->type = TOK_EOF;
+            t->end = t->start;
+            if (pending_here > 0) {
+                *incomplete = 1;  // The here-document body comes on later lines
+                free_tokens(toks);
+                return NULL;
+            }
+            return toks;
+        }
+
+        int oplen = 1;
+        int digits = 0;
+        while (cp[digits] >= '0' && cp[digits] <= '9') {
+            digits++;
+        }
+        if (digits > 0 && (cp[digits] == '<' || cp[digits] == '>')) {
+            // 2> and the like: the number names the descriptor
+            t->type = TOK_IONUMBER;
+            t->text = strndup(cp, digits);
+            oplen = digits;
+        } else if (*cp == '\n') {
+            t->type = TOK_NEWLINE;
+        } else if (cp[0] == ';' && cp[1] == ';') {
+            t->type = TOK_DSEMI;
+            oplen = 2;
+        } else if (*cp == ';') {
+            t->type = TOK_SEMI;
+        } else if (cp[0] == '&' && cp[1] == '&') {
+            t->type = TOK_AND;
+            oplen = 2;
+        } else if (cp[0] == '&' && cp[1] == '>') {
+            t->type = cp[2] == '>' ? TOK_ANDDGREAT : TOK_ANDGREAT;
+            oplen = cp[2] == '>' ? 3 : 2;
+        } else if (*cp == '&') {
+            t->type = TOK_AMP;
+        } else if (cp[0] == '|' && cp[1] == '|') {
+            t->type = TOK_OR;
+            oplen = 2;
+        } else if (cp[0] == '|' && cp[1] == '>') {
+            // "|> {" is one token, so the brace cannot be taken for a group
+            t->type = TOK_FANOUT;
+            oplen = 2;
+            int brace = 2;
+            while (cp[brace] == ' ' || cp[brace] == '\t') {
+                brace++;
+            }
+            if (cp[brace] == '{' && fanouts < 16) {
+                oplen = brace + 1;
+                fanout_depth[fanouts++] = ++braces;
+            }
+        } else if (*cp == ',' && fanouts > 0) {
+            t->type = TOK_COMMA;
+        } else if (*cp == '|') {
+            t->type = TOK_PIPE;
+        } else if (*cp == '(') {
+            t->type = TOK_LPAREN;
+        } else if (*cp == ')') {
+            t->type = TOK_RPAREN;
+        } else if (cp[0] == '<' && cp[1] == '<' && cp[2] == '<') {
+            t->type = TOK_TLESS;
+            oplen = 3;
+        } else if (cp[0] == '<' && cp[1] == '<' && cp[2] == '-') {
+            t->type = TOK_DLESSDASH;
+            oplen = 3;
+        } else if (cp[0] == '<' && cp[1] == '<') {
+            t->type = TOK_DLESS;
+            oplen = 2;
+        } else if (cp[0] == '<' && (cp[1] == '>' || cp[1] == '&')) {
+            t->type = cp[1] == '>' ? TOK_LESSGREAT : TOK_LESSAND;
+            oplen = 2;
+        } else if (*cp == '<' && cp[1] != '(') {
+            t->type = TOK_LESS;
+        } else if (cp[0] == '>' && (cp[1] == '>' || cp[1] == '&')) {
+            t->type = cp[1] == '>' ? TOK_DGREAT : TOK_GREATAND;
+            oplen = 2;
+        } else if (*cp == '>' && cp[1] != '(') {
+            t->type = TOK_GREAT;
+        } else {
+            // A word runs up to unquoted whitespace or an operator character
+            const char *start = cp;
+            int unterminated = 0;
+            while (*cp != '\0' && !unterminated && (strchr(" \t\n;&|()<>", *cp) == NULL || ((*cp == '<' || *cp == '>') && cp[1] == '('))
+                    && (*cp != ',' || fanouts == 0)) {
+                if ((*cp == '<' || *cp == '>') && cp[1] == '(') {
+                    // <(list) or >(list), kept whole up to the matching ')'
+                    const char *close = procsub_end(cp + 1);
+                    if (close == NULL) {
+                        unterminated = 1;
+                    } else {
+                        cp = close + 1;
+                    }
+                } else if (*cp == '\\') {
+                    if (cp[1] == '\0') {
+                        unterminated = 1;
+                    } else {
+                        cp += 2;
+                    }
+                } else if (*cp == '\'') {
+                    const char *close = strchr(cp + 1, '\'');
+                    if (close == NULL) {
+                        unterminated = 1;
                     } else {
-                        fprintf(stderr, "cd: missing argument\n");
+                        cp = close + 1;
+                    }
+                } else if (*cp == '"') {
+                    cp++;
+                    while (*cp != '\0' && *cp != '"') {
+                        if (*cp == '\\' && cp[1] != '\0') {
+                            cp++;
+                        }
+                        cp++;
                     }
-                } else if (strcmp(arglist[0], "exit") == 0) {
-                    free(cmdline);
-                    free(prompt);
-                    free_history();
-                    exit(0);
-                } else if (strcmp(arglist[0], "jobs") == 0) {
-                    list_jobs();
-                } else if (strcmp(arglist[0], "kill") == 0) {
-                    if (arglist[1] != NULL) {
-                        kill_job(atoi(arglist[1]));
+                    if (*cp == '\0') {
+                        unterminated = 1;
                     } else {
-                        fprintf(stderr, "kill: missing job number\n");
+                        cp++;
                     }
-                } else if (strcmp(arglist[0], "help") == 0) {
-                    help();
-                } else { if (mera == 0){
-                    // Execute the command
-                    execute(arglist, infile, outfile, background);}
+                } else {
+                    cp++;
                 }
             }
-            mera -= 1;
+            if (unterminated) {
+                // Open quote or trailing backslash: the line continues
+                *incomplete = 1;
+                t->type = TOK_EOF;
+                free_tokens(toks);
+                return NULL;
+            }
+            t->type = TOK_WORD;
+            t->text = strndup(start, cp - start);
+            t->end = cp - cmdline;
+            if (fanouts > 0 && strcmp(t->text, "{") == 0) {
+                braces++;
+            } else if (fanouts > 0 && strcmp(t->text, "}") == 0 && braces-- == fanout_depth[fanouts - 1]) {
+                t->type = TOK_FANEND;
+                fanouts--;
+                command = 0;
+                continue;
+            }
+            if (n >= 2 && (toks[n - 2].type == TOK_DLESS || toks[n - 2].type == TOK_DLESSDASH)) {
+                pending_here++;
+            }
+            command = command && expand_alias(&toks, &n, &cap, active);
+            continue;
+        }
+        cp += oplen;
+        t->end = cp - cmdline;
+        command = t->type == TOK_NEWLINE || t->type == TOK_SEMI || t->type == TOK_AMP || t->type == TOK_AND
+                  || t->type == TOK_OR || t->type == TOK_PIPE || t->type == TOK_LPAREN
+                  || t->type == TOK_FANOUT || t->type == TOK_COMMA;
 
-            for (int j = 0; j < MAXARGS + 1; j++) {
-                free(arglist[j]);
+        // Here-document bodies start on the line after the operator
+        if (t->type == TOK_NEWLINE && pending_here > 0) {
+            for (int i = 1; i < n; i++) {
+                if (toks[i].type == TOK_WORD && toks[i].body == NULL
+                        && (toks[i - 1].type == TOK_DLESS || toks[i - 1].type == TOK_DLESSDASH)) {
+                    cp = read_heredoc(cp, &toks[i], toks[i - 1].type == TOK_DLESSDASH);
+                    if (cp == NULL) {
+                        *incomplete = 1;  // No delimiter line yet
+                        toks[n].type = TOK_EOF;
+                        free_tokens(toks);
+                        return NULL;
+                    }
+                }
             }
-            free(arglist);
-            free(cmdline);
+            pending_here = 0;
         }
+    }
+}
 
-        free(prompt);
+// Expands the word just added as toks[*n - 1], which is in command position.
+// Its alias's value is tokenized on its own and spliced in place of the
+// word, so the rest of the line is never copied; the new tokens keep the
+// word's offsets for source_text(). Returns whether the next word is in
+// command position as well: after a reserved word such as "then", or an
+// alias value ending in a blank.
+int expand_alias(struct token **toks, int *n, int *cap, const struct alias_chain *active) {
+    struct token *t = &(*toks)[*n - 1];
+    if (is_reserved_word(t->text)) {
+        return 1;
+    }
+    struct alias *a = alias_count > 0 ? find_alias(t->text) : NULL;
+    for (const struct alias_chain *c = active; a != NULL && c != NULL; c = c->outer) {
+        if (c->alias == a) {
+            a = NULL;  // ls='ls -F' expands once
+        }
+    }
+    if (a == NULL) {
+        return 0;
     }
 
-    printf("\n");
-    free_history();
+    struct alias_chain link = { a, active };
+    int incomplete;
+    struct token *sub = tokenize_with(a->value, &incomplete, &link);
+    if (sub == NULL) {
+        return 0;  // An alias that needs more input is left alone
+    }
+    int m = 0;
+    while (sub[m].type != TOK_EOF) {
+        m++;
+    }
+    int start = t->start, end = t->end;
+    free(t->text);
+    (*n)--;
+    if (*n + m + 1 > *cap) {
+        *cap = *n + m + 16;
+        *toks = realloc(*toks, sizeof(struct token) * *cap);
+    }
+    for (int i = 0; i < m; i++) {
+        sub[i].start = start;
+        sub[i].end = end;
+        (*toks)[(*n)++] = sub[i];
+    }
+    free(sub);
+
+    size_t len = strlen(a->value);
+    return len > 0 && (a->value[len - 1] == ' ' || a->value[len - 1] == '\t');
+}
+
+// Words after which the next word is still a command name
+int is_reserved_word(const char *word) {
+    static const char *words[] = { "if", "then", "else", "elif", "while", "until", "do", "{", "!", NULL };
+    for (int i = 0; words[i] != NULL; i++) {
+        if (strcmp(word, words[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Collects the here-document lines starting at cp up to the delimiter given
+// by the word token into tok->body. Returns the position after the delimiter
+// line, or NULL if the input ends first.
+const char* read_heredoc(const char *cp, struct token *tok, int strip_tabs) {
+    char *delim = heredoc_delimiter(tok->text);
+    size_t dlen = strlen(delim), len = 0, cap = 64;
+    char *body = malloc(cap);
+
+    while (1) {
+        if (strip_tabs) {
+            while (*cp == '\t') {
+                cp++;
+            }
+        }
+        const char *eol = strchr(cp, '\n');
+        size_t llen = eol != NULL ? (size_t)(eol - cp) : strlen(cp);
+        if (llen == dlen && strncmp(cp, delim, dlen) == 0) {
+            cp = eol != NULL ? eol + 1 : cp + llen;
+            break;
+        }
+        if (eol == NULL) {
+            free(delim);
+            free(body);
+            return NULL;
+        }
+        for (const char *c = cp; c <= eol; c++) {
+            append_char(&body, &len, &cap, *c);
+        }
+        cp = eol + 1;
+    }
+    body[len] = '\0';
+    tok->body = body;
+    free(delim);
+    return cp;
+}
+
+// Delimiter of a here-document with quotes and backslashes removed
+char* heredoc_delimiter(const char *word) {
+    char *delim = malloc(strlen(word) + 1), *d = delim;
+    for (; *word != '\0'; word++) {
+        if (*word == '\\' && word[1] != '\0') {
+            *d++ = *++word;
+        } else if (*word != '\'' && *word != '"') {
+            *d++ = *word;
+        }
+    }
+    *d = '\0';
+    return delim;
+}
+
+void free_tokens(struct token *toks) {
+    for (int i = 0; toks[i].type != TOK_EOF; i++) {
+        free(toks[i].text);
+        free(toks[i].body);
+    }
+    free(toks);
+}
+
+struct token* peek(struct parser *p) {
+    return &p->toks[p->pos];
+}
+
+// True when the next token is the unquoted word w
+int next_is_word(struct parser *p, const char *w) {
+    return peek(p)->type == TOK_WORD && strcmp(peek(p)->text, w) == 0;
+}
+
+void skip_newlines(struct parser *p) {
+    while (peek(p)->type == TOK_NEWLINE) {
+        p->pos++;
+    }
+}
+
+// Reports a syntax error at the next token, or marks the input as
+// incomplete if the line simply ended too early.
+void syntax_error(struct parser *p) {
+    struct token *t = peek(p);
+    if (p->error || p->incomplete) {
+        return;
+    }
+    if (t->type != TOK_EOF) {
+        p->error = 1;
+    }
+    if (t->type == TOK_EOF) {
+        p->incomplete = 1;
+    } else if (t->type == TOK_NEWLINE) {
+        fprintf(stderr, "syntax error near unexpected newline\n");
+    } else {
+        fprintf(stderr, "syntax error near '%.*s'\n", t->end - t->start, p->line + t->start);
+    }
+}
+
+struct node* new_node(enum node_type type) {
+    struct node *n = calloc(1, sizeof(struct node));
+    n->type = type;
+    return n;
+}
+
+struct node* new_binary(enum node_type type, struct node *left, struct node *right) {
+    struct node *n = new_node(type);
+    n->left = left;
+    n->right = right;
+    return n;
+}
+
+// Source text from token index first up to the last consumed token
+char* source_text(struct parser *p, int first) {
+    int start = p->toks[first].start;
+    return strndup(p->line + start, p->toks[p->pos - 1].end - start);
+}
+
+// Parses a whole command line into a syntax tree. Returns NULL for an empty
+// line, a syntax error, or input that needs more lines (*incomplete set).
+struct node* parse_line(const char *cmdline, int *incomplete) {
+    struct token *toks = tokenize(cmdline, incomplete);
+    if (toks == NULL) {
+        return NULL;
+    }
+
+    struct parser p = { toks, 0, cmdline, 0, 0 };
+    struct node *tree = parse_list(&p);
+    if (peek(&p)->type != TOK_EOF) {
+        syntax_error(&p);
+        free_node(tree);
+        tree = NULL;
+    }
+    tree = compile_tree(tree);
+    *incomplete = p.incomplete;
+    free_tokens(toks);
+    return tree;
+}
+
+// Reserved words that end the command list before them
+const char *list_enders[] = { "}", "then", "elif", "else", "fi", "do", "done", "esac", NULL };
+
+// True at the end of a command list: end of input, ')', ';;' or a reserved
+// word that closes a group or control structure
+int at_list_end(struct parser *p) {
+    enum token_type type = peek(p)->type;
+    if (type == TOK_EOF || type == TOK_RPAREN || type == TOK_DSEMI) {
+        return 1;
+    }
+    for (int i = 0; list_enders[i] != NULL; i++) {
+        if (next_is_word(p, list_enders[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Parses a list that must not be empty, such as the body of a loop.
+struct node* parse_body(struct parser *p) {
+    struct node *body = parse_list(p);
+    if (body == NULL) {
+        syntax_error(p);
+    }
+    return body;
+}
+
+// Consumes the reserved word w, or reports a syntax error.
+int expect_word(struct parser *p, const char *w) {
+    if (!next_is_word(p, w)) {
+        syntax_error(p);
+        return -1;
+    }
+    p->pos++;
+    return 0;
+}
+
+// if list; then list; [elif list; then list;]... [else list;] fi
+// The 'if' or 'elif' has already been consumed.
+struct node* parse_if(struct parser *p) {
+    struct node *n = new_node(NODE_IF);
+
+    if ((n->left = parse_body(p)) == NULL || expect_word(p, "then") == -1
+            || (n->right = parse_body(p)) == NULL) {
+        free_node(n);
+        return NULL;
+    }
+    if (next_is_word(p, "elif")) {
+        p->pos++;
+        if ((n->alt = parse_if(p)) == NULL) {
+            free_node(n);
+            return NULL;
+        }
+        return n;
+    }
+    if (next_is_word(p, "else")) {
+        p->pos++;
+        if ((n->alt = parse_body(p)) == NULL) {
+            free_node(n);
+            return NULL;
+        }
+    }
+    if (expect_word(p, "fi") == -1) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+// while list; do list; done   (or until)
+struct node* parse_while(struct parser *p, enum node_type type) {
+    struct node *n = new_node(type);
+    p->pos++;
+    if ((n->left = parse_body(p)) == NULL || expect_word(p, "do") == -1
+            || (n->right = parse_body(p)) == NULL || expect_word(p, "done") == -1) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+int is_name(const char *s) {
+    if (!(*s == '_' || (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z'))) {
+        return 0;
+    }
+    while (*++s != '\0') {
+        if (!(*s == '_' || (*s >= 'a' && *s <= 'z') || (*s >= 'A' && *s <= 'Z') || (*s >= '0' && *s <= '9'))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Appends a copy of w to a NULL-terminated argv, growing it by one.
+void push_word(struct node *n, const char *w) {
+    n->argv = realloc(n->argv, sizeof(char*) * (n->argc + 2));
+    n->argv[n->argc++] = strdup(w);
+    n->argv[n->argc] = NULL;
+}
+
+// for name [in word...]; do list; done
+struct node* parse_for(struct parser *p) {
+    struct node *n = new_node(NODE_FOR);
+    p->pos++;
+    if (peek(p)->type != TOK_WORD || !is_name(peek(p)->text)) {
+        syntax_error(p);
+        free_node(n);
+        return NULL;
+    }
+    push_word(n, peek(p)->text);
+    p->pos++;
+
+    skip_newlines(p);
+    if (next_is_word(p, "in")) {
+        p->pos++;
+        while (peek(p)->type == TOK_WORD) {
+            push_word(n, peek(p)->text);
+            p->pos++;
+        }
+    } else {
+        push_word(n, "\"$@\"");  // for name; loops over the positional parameters
+    }
+    if (peek(p)->type == TOK_SEMI) {
+        p->pos++;
+    }
+    skip_newlines(p);
+    if (expect_word(p, "do") == -1 || (n->right = parse_body(p)) == NULL
+            || expect_word(p, "done") == -1) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+// case word in [(]pattern[|pattern]...) list ;; ... esac
+struct node* parse_case(struct parser *p) {
+    struct node *n = new_node(NODE_CASE);
+    p->pos++;
+    if (peek(p)->type != TOK_WORD) {
+        syntax_error(p);
+        free_node(n);
+        return NULL;
+    }
+    push_word(n, peek(p)->text);
+    p->pos++;
+    skip_newlines(p);
+    if (expect_word(p, "in") == -1) {
+        free_node(n);
+        return NULL;
+    }
+
+    skip_newlines(p);
+    while (!next_is_word(p, "esac")) {
+        struct node *item = new_node(NODE_CASE_ITEM);
+        n->stages = realloc(n->stages, sizeof(struct node*) * (n->nstages + 1));
+        n->stages[n->nstages++] = item;
+
+        if (peek(p)->type == TOK_LPAREN) {
+            p->pos++;
+        }
+        while (1) {
+            if (peek(p)->type != TOK_WORD) {
+                syntax_error(p);
+                free_node(n);
+                return NULL;
+            }
+            push_word(item, peek(p)->text);
+            p->pos++;
+            if (peek(p)->type != TOK_PIPE) {
+                break;
+            }
+            p->pos++;
+        }
+        if (peek(p)->type != TOK_RPAREN) {
+            syntax_error(p);
+            free_node(n);
+            return NULL;
+        }
+        p->pos++;
+
+        item->right = parse_list(p);  // An empty body is allowed
+        if (p->error || p->incomplete) {
+            free_node(n);
+            return NULL;
+        }
+        if (peek(p)->type == TOK_DSEMI) {
+            p->pos++;
+            skip_newlines(p);
+        } else if (!next_is_word(p, "esac")) {
+            syntax_error(p);
+            free_node(n);
+            return NULL;
+        }
+    }
+    p->pos++;
+    return n;
+}
+
+// list := and_or ((';' | '&' | newline) and_or)*
+struct node* parse_list(struct parser *p) {
+    struct node *list = NULL;
+
+    while (1) {
+        skip_newlines(p);
+        if (at_list_end(p)) {
+            break;
+        }
+        int first = p->pos;
+        struct node *cmd = parse_and_or(p);
+        if (cmd == NULL) {
+            free_node(list);
+            return NULL;
+        }
+
+        enum token_type type = peek(p)->type;
+        if (type == TOK_AMP) {
+            struct node *bg = new_node(NODE_BG);
+            bg->left = cmd;
+            bg->text = source_text(p, first);
+            p->pos++;
+            cmd = bg;
+        } else if (type == TOK_SEMI || type == TOK_NEWLINE) {
+            p->pos++;
+        } else if (!at_list_end(p)) {
+            syntax_error(p);
+            free_node(cmd);
+            free_node(list);
+            return NULL;
+        }
+        list = list != NULL ? new_binary(NODE_SEQ, list, cmd) : cmd;
+    }
+    return list;
+}
+
+// and_or := pipeline (('&&' | '||') pipeline)*
+struct node* parse_and_or(struct parser *p) {
+    struct node *left = parse_pipeline(p);
+
+    while (left != NULL && (peek(p)->type == TOK_AND || peek(p)->type == TOK_OR)) {
+        enum node_type type = peek(p)->type == TOK_AND ? NODE_AND : NODE_OR;
+        p->pos++;
+        skip_newlines(p);
+        struct node *right = parse_pipeline(p);
+        if (right == NULL) {
+            free_node(left);
+            return NULL;
+        }
+        left = new_binary(type, left, right);
+    }
+    return left;
+}
+
+int is_bench_option(struct token *t) {
+    return t->type == TOK_WORD && (strcmp(t->text, "-n") == 0 || strcmp(t->text, "-w") == 0
+                                   || strcmp(t->text, "-o") == 0);
+}
+
+// pipeline := ['bench' options] command ('|' command)*
+struct node* parse_pipeline(struct parser *p) {
+    if (next_is_word(p, "bench")) {
+        struct node *n = new_node(NODE_BENCH);
+        p->pos++;
+        n->argv = malloc(sizeof(char*));
+        while (peek(p)->type == TOK_WORD && peek(p)->text[0] == '-'
+                && p->toks[p->pos + 1].type == TOK_WORD) {
+            n->argv = realloc(n->argv, sizeof(char*) * (n->argc + 3));
+            n->argv[n->argc++] = strdup(peek(p)->text);
+            n->argv[n->argc++] = strdup(p->toks[p->pos + 1].text);
+            p->pos += 2;
+        }
+        n->argv[n->argc] = NULL;
+        if (is_bench_option(peek(p))) {
+            syntax_error(p);  // An option without its value, as in "bench -n"
+            free_node(n);
+            return NULL;
+        }
+        int first = p->pos;
+        if ((n->left = parse_pipeline(p)) == NULL) {
+            free_node(n);
+            return NULL;
+        }
+        n->text = source_text(p, first);
+        return n;
+    }
+
+    if (next_is_word(p, "timeout")) {
+        return parse_timeout(p);
+    }
+
+    int first = p->pos;
+    struct node *cmd = parse_command(p);
+    if (cmd != NULL && peek(p)->type == TOK_PIPE) {
+        struct node *n = new_node(NODE_PIPE);
+        n->stages = malloc(sizeof(struct node*));
+        n->stages[n->nstages++] = cmd;
+        while (peek(p)->type == TOK_PIPE) {
+            p->pos++;
+            skip_newlines(p);
+            if ((cmd = parse_command(p)) == NULL) {
+                free_node(n);
+                return NULL;
+            }
+            n->stages = realloc(n->stages, sizeof(struct node*) * (n->nstages + 1));
+            n->stages[n->nstages++] = cmd;
+        }
+        n->text = source_text(p, first);
+        cmd = n;
+    }
+    if (cmd != NULL && peek(p)->type == TOK_FANOUT) {
+        return parse_fanout(p, cmd, first);
+    }
+    return cmd;
+}
+
+// fanout := pipeline '|>' '{' and_or (',' and_or)* '}'
+struct node* parse_fanout(struct parser *p, struct node *producer, int first) {
+    struct node *n = new_node(NODE_FANOUT);
+    n->left = producer;
+    n->stages = malloc(sizeof(struct node*));
+    if (p->line[peek(p)->end - 1] != '{') {
+        syntax_error(p);  // |> without its brace
+        free_node(n);
+        return NULL;
+    }
+    p->pos++;
+    while (1) {
+        skip_newlines(p);
+        struct node *consumer = parse_and_or(p);
+        if (consumer == NULL) {
+            free_node(n);
+            return NULL;
+        }
+        n->stages = realloc(n->stages, sizeof(struct node*) * (n->nstages + 1));
+        n->stages[n->nstages++] = consumer;
+        skip_newlines(p);
+        if (peek(p)->type == TOK_FANEND) {
+            p->pos++;
+            break;
+        }
+        if (peek(p)->type != TOK_COMMA) {
+            syntax_error(p);
+            free_node(n);
+            return NULL;
+        }
+        p->pos++;
+    }
+    n->text = source_text(p, first);
+    return n;
+}
+
+// timeout [-s SIG] [-k KILLAFTER] DURATION [-s SIG] [-k KILLAFTER] pipeline
+// Options may come before or after the duration, which is stored as "-d".
+struct node* parse_timeout(struct parser *p) {
+    struct node *n = new_node(NODE_TIMEOUT);
+    int first = p->pos;
+    int have_duration = 0;
+    p->pos++;
+    n->argv = malloc(sizeof(char*));
+    while (peek(p)->type == TOK_WORD && p->toks[p->pos + 1].type == TOK_WORD) {
+        const char *word = peek(p)->text;
+        n->argv = realloc(n->argv, sizeof(char*) * (n->argc + 3));
+        if (word[0] == '-') {
+            n->argv[n->argc++] = strdup(word);
+            n->argv[n->argc++] = strdup(p->toks[p->pos + 1].text);
+            p->pos += 2;
+        } else if (!have_duration) {
+            n->argv[n->argc++] = strdup("-d");
+            n->argv[n->argc++] = strdup(word);
+            have_duration = 1;
+            p->pos++;
+        } else {
+            break;
+        }
+    }
+    n->argv[n->argc] = NULL;
+    if (!have_duration || (n->left = parse_pipeline(p)) == NULL) {
+        if (!p->error && !p->incomplete) {
+            syntax_error(p);
+        }
+        free_node(n);
+        return NULL;
+    }
+    n->text = source_text(p, first);
+    return n;
+}
+
+int is_redir_token(enum token_type type) {
+    return type >= TOK_LESS && type <= TOK_IONUMBER;
+}
+
+// Appends a redirection, keeping them in the order they were written
+void add_redir(struct node *n, enum redir_type type, int fd, const char *target) {
+    struct redir *r = calloc(1, sizeof(struct redir));
+    r->type = type;
+    r->fd = fd;
+    r->target = strdup(target);
+
+    struct redir **tail = &n->redirs;
+    while (*tail != NULL) {
+        tail = &(*tail)->next;
+    }
+    *tail = r;
+}
+
+// Parses one redirection, an optional descriptor number, the operator and
+// its word, onto the node's redirection list.
+int parse_redir(struct parser *p, struct node *n) {
+    int fd = -1;
+    if (peek(p)->type == TOK_IONUMBER) {
+        fd = atoi(peek(p)->text);
+        p->pos++;
+    }
+    enum token_type op = peek(p)->type;
+    p->pos++;
+    if (peek(p)->type != TOK_WORD) {
+        syntax_error(p);
+        return -1;
+    }
+    struct token *word = peek(p);
+    p->pos++;
+
+    int in = op == TOK_LESS || op == TOK_LESSGREAT || op == TOK_LESSAND
+          || op == TOK_DLESS || op == TOK_DLESSDASH || op == TOK_TLESS;
+    if (fd == -1) {
+        fd = in ? STDIN_FILENO : STDOUT_FILENO;
+    }
+    switch (op) {
+        case TOK_LESS:
+            add_redir(n, REDIR_IN, fd, word->text);
+            break;
+        case TOK_GREAT:
+            add_redir(n, REDIR_OUT, fd, word->text);
+            break;
+        case TOK_DGREAT:
+            add_redir(n, REDIR_APPEND, fd, word->text);
+            break;
+        case TOK_LESSGREAT:
+            add_redir(n, REDIR_RDWR, fd, word->text);
+            break;
+        case TOK_GREATAND:
+        case TOK_LESSAND:
+            add_redir(n, REDIR_DUP, fd, word->text);
+            break;
+        case TOK_ANDGREAT:
+        case TOK_ANDDGREAT:
+            // &>file is >file 2>&1
+            add_redir(n, op == TOK_ANDGREAT ? REDIR_OUT : REDIR_APPEND, STDOUT_FILENO, word->text);
+            add_redir(n, REDIR_DUP, STDERR_FILENO, "1");
+            break;
+        case TOK_TLESS:
+            add_redir(n, REDIR_HERESTR, fd, word->text);
+            break;
+        case TOK_DLESS:
+        case TOK_DLESSDASH: {
+            if (word->body == NULL) {
+                syntax_error(p);  // Delimiter with nothing after it on the line
+                return -1;
+            }
+            add_redir(n, REDIR_HEREDOC, fd, word->body);
+            struct redir *r = n->redirs;
+            while (r->next != NULL) {
+                r = r->next;
+            }
+            r->literal = strpbrk(word->text, "'\"\\") != NULL;
+            break;
+        }
+        default:
+            syntax_error(p);
+            return -1;
+    }
+    return 0;
+}
+
+int parse_trailing_redirs(struct parser *p, struct node *n) {
+    while (is_redir_token(peek(p)->type)) {
+        if (parse_redir(p, n) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// name() compound-command
+struct node* parse_funcdef(struct parser *p) {
+    struct node *n = new_node(NODE_FUNCDEF);
+    push_word(n, peek(p)->text);
+    p->pos += 3;
+    skip_newlines(p);
+
+    // The body must be a group, subshell or control structure
+    const char *compound[] = { "{", "if", "while", "until", "for", "case", NULL };
+    int ok = peek(p)->type == TOK_LPAREN;
+    for (int i = 0; !ok && compound[i] != NULL; i++) {
+        ok = next_is_word(p, compound[i]);
+    }
+    if (!ok) {
+        syntax_error(p);
+        free_node(n);
+        return NULL;
+    }
+    if ((n->left = parse_command(p)) == NULL) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+// command := '(' list ')' redirs | '{' list '}' redirs
+//          | if | while | until | for | case (each with redirs) | simple command
+struct node* parse_command(struct parser *p) {
+    struct node *n = NULL;
+
+    if (next_is_word(p, "sched")) {
+        return parse_prefix(p, NODE_SCHED);
+    } else if (next_is_word(p, "limit")) {
+        return parse_prefix(p, NODE_LIMIT);
+    } else if (next_is_word(p, "if")) {
+        p->pos++;
+        n = parse_if(p);
+    } else if (next_is_word(p, "while")) {
+        n = parse_while(p, NODE_WHILE);
+    } else if (next_is_word(p, "until")) {
+        n = parse_while(p, NODE_UNTIL);
+    } else if (next_is_word(p, "for")) {
+        n = parse_for(p);
+    } else if (next_is_word(p, "case")) {
+        n = parse_case(p);
+    } else if (peek(p)->type == TOK_WORD && is_name(peek(p)->text)
+            && p->toks[p->pos + 1].type == TOK_LPAREN && p->toks[p->pos + 2].type == TOK_RPAREN) {
+        return parse_funcdef(p);
+    } else {
+        return parse_group_or_simple(p);
+    }
+    if (n != NULL && parse_trailing_redirs(p, n) == -1) {
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+// sched [-c CPULIST] [-n NICE] [-i CLASS[:LEVEL]] command
+// limit [-v SIZE] [-t SECONDS] [-n FILES] [-u PROCS] [-f SIZE] ... command
+// A prefix of one command, so each stage of a pipeline can have its own.
+struct node* parse_prefix(struct parser *p, enum node_type type) {
+    struct node *n = new_node(type);
+    int first = p->pos;
+    p->pos++;
+    n->argv = malloc(sizeof(char*));
+    while (peek(p)->type == TOK_WORD && peek(p)->text[0] == '-'
+            && p->toks[p->pos + 1].type == TOK_WORD) {
+        n->argv = realloc(n->argv, sizeof(char*) * (n->argc + 3));
+        n->argv[n->argc++] = strdup(peek(p)->text);
+        n->argv[n->argc++] = strdup(p->toks[p->pos + 1].text);
+        p->pos += 2;
+    }
+    n->argv[n->argc] = NULL;
+    if ((n->left = parse_command(p)) == NULL) {
+        if (!p->error && !p->incomplete) {
+            syntax_error(p);
+        }
+        free_node(n);
+        return NULL;
+    }
+    n->text = source_text(p, first);
+    return n;
+}
+
+// '(' list ')' redirs | '{' list '}' redirs | simple command
+struct node* parse_group_or_simple(struct parser *p) {
+    struct node *n;
+
+    if (peek(p)->type == TOK_LPAREN || next_is_word(p, "{")) {
+        int first = p->pos;
+        int subshell = peek(p)->type == TOK_LPAREN;
+        n = new_node(subshell ? NODE_SUBSHELL : NODE_GROUP);
+        p->pos++;
+        if ((n->left = parse_body(p)) == NULL) {
+            free_node(n);
+            return NULL;
+        }
+        if (subshell ? peek(p)->type != TOK_RPAREN : !next_is_word(p, "}")) {
+            syntax_error(p);
+            free_node(n);
+            return NULL;
+        }
+        p->pos++;
+        if (parse_trailing_redirs(p, n) == -1) {
+            free_node(n);
+            return NULL;
+        }
+        n->text = source_text(p, first);
+        return n;
+    }
+
+    n = new_node(NODE_CMD);
+    n->argv = malloc(sizeof(char*));
+    while (1) {
+        struct token *t = peek(p);
+        if (t->type == TOK_WORD) {
+            n->argv = realloc(n->argv, sizeof(char*) * (n->argc + 2));
+            n->argv[n->argc++] = strdup(t->text);
+            p->pos++;
+        } else if (is_redir_token(t->type)) {
+            n->argv[n->argc] = NULL;
+            if (parse_redir(p, n) == -1) {
+                free_node(n);
+                return NULL;
+            }
+        } else {
+            break;
+        }
+    }
+    n->argv[n->argc] = NULL;
+    if (n->argc == 0 && n->redirs == NULL) {
+        syntax_error(p);
+        free_node(n);
+        return NULL;
+    }
+    return n;
+}
+
+void free_node(struct node *n) {
+    if (n == NULL) {
+        return;
+    }
+    if (n->argv != NULL) {
+        free_words(n->argv);
+    }
+    while (n->redirs != NULL) {
+        struct redir *next = n->redirs->next;
+        free(n->redirs->target);
+        free(n->redirs);
+        n->redirs = next;
+    }
+    if (n->type == NODE_FUNCDEF && n->left != NULL) {
+        release_tree(n->left);  // The body may still be in the function table
+        n->left = NULL;
+    }
+    free_node(n->left);
+    free_node(n->right);
+    free_node(n->alt);
+    if (n->prog != NULL) {
+        free_program(n->prog);
+    }
+    for (int i = 0; i < n->nstages; i++) {
+        free_node(n->stages[i]);
+    }
+    free(n->stages);
+    free(n->text);
+    free(n);
+}
+
+void release_tree(struct node *tree) {
+    if (--tree->refs <= 0) {
+        free_node(tree);
+    }
+}
+
+// Walks the syntax tree and returns the exit status of what it ran.
+// Runs a node and records its status as $?
+int exec_node(struct node *n) {
+    int status = exec_node_type(n);
+    last_status = status;
+    return status;
+}
+
+int exec_node_type(struct node *n) {
+    int status;
+
+    switch (n->type) {
+        case NODE_CMD:
+            return exec_simple(n);
+        case NODE_PIPE:
+            return execute_pipe(n);
+        case NODE_FANOUT:
+            return execute_fanout(n);
+        case NODE_AND:
+            status = exec_node(n->left);
+            return status == 0 && !func_returning && !loop_exit ? exec_node(n->right) : status;
+        case NODE_OR:
+            status = exec_node(n->left);
+            return status != 0 && !func_returning && !loop_exit ? exec_node(n->right) : status;
+        case NODE_SEQ:
+            status = exec_node(n->left);
+            return func_returning || loop_exit ? status : exec_node(n->right);
+        case NODE_BG:
+            return run_background(n);
+        case NODE_SUBSHELL:
+            return exec_subshell(n);
+        case NODE_GROUP:
+            return exec_group(n);
+        case NODE_BENCH:
+            return bench(n);
+        case NODE_SCHED:
+        case NODE_LIMIT:
+            return exec_prefixed(n);
+        case NODE_TIMEOUT:
+            return exec_timeout(n);
+        case NODE_PROGRAM:
+            return exec_program(n);
+        case NODE_FUNCDEF:
+            define_function(n->argv[0], n->left);
+            return 0;
+        default:
+            break;  // Control nodes are always compiled into NODE_PROGRAM
+    }
+    return 0;
+}
+
+// Runs a simple command. Builtins run inside the shell with their
+// redirections applied temporarily; everything else is forked.
+int exec_simple(struct node *n) {
+    int status;
+    int procsubs = procsub_count;
+
+    if (n->argc > 0 && is_assignment(n->argv[0])) {
+        return assign_vars(n);
+    }
+    char **argv = expand_words(n->argv);
+    struct function *f = argv[0] != NULL ? find_function(argv[0]) : NULL;
+    struct builtin *b = argv[0] != NULL ? find_builtin(argv[0]) : NULL;
+
+    if (f != NULL) {
+        // Functions run in the shell like builtins, no fork
+        struct saved_fds saved = { .count = 0 };
+        if (apply_redirs(n->redirs, &saved) == -1) {
+            status = 1;
+        } else {
+            status = call_function(f->body, argv);
+        }
+        restore_fds(&saved);
+    } else if (argv[0] == NULL || b != NULL) {
+        struct saved_fds saved = { .count = 0 };
+        unsigned serial = pipe_serial;
+        if (apply_redirs(n->redirs, &saved) == -1) {
+            status = 1;
+        } else {
+            status = b != NULL ? b->func(argv) : 0;
+        }
+        restore_fds(&saved);
+        // Builtins that wait for a job (fg) leave that job's stages
+        if (pipe_serial == serial) {
+            int wstatus = (status & 0xff) << 8;
+            set_pipestatus(1, &wstatus, NULL);
+        }
+    } else {
+        status = execute(argv, n->redirs);
+    }
+    free_words(argv);
+    close_procsubs(procsubs);
+    return status;
+}
+
+// Runs a node in a child that was already forked and never returns. A simple
+// external command is exec'd directly so it costs no further fork.
+void exec_in_child(struct node *n) {
+    while (n->type == NODE_SCHED || n->type == NODE_LIMIT) {
+        if ((n->type == NODE_SCHED ? apply_sched(n) : apply_limit(n)) == -1) {
+            exit_shell(2);
+        }
+        n = n->left;
+    }
+    if (n->type == NODE_CMD) {
+        char **argv = expand_words(n->argv);
+        if (argv[0] != NULL && find_builtin(argv[0]) == NULL && find_function(argv[0]) == NULL) {
+            if (apply_redirs(n->redirs, NULL) == -1) {
+                exit_shell(1);
+            }
+            execvp(argv[0], argv);
+            perror("Command not found...");
+            exit_shell(1);
+        }
+        free_words(argv);
+    }
+    exit_shell(exec_node(n));
+}
+
+int execute(char* arglist[], struct redir *redirs) {
+    int status = 0;
+    struct job j = { .cmd = join_words(arglist), .foreground = 1 };
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    int cpid = zygote_exec(&j, arglist, redirs);
+    if (cpid == 0) {
+        // The redirections failed in the shell, where the error went out
+        // just as it would have from a child
+        int wstatus = 1 << 8;
+        double elapsed = 0;
+        set_pipestatus(1, &wstatus, &elapsed);
+        free_job(&j);
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        if (report_status) {
+            printf("Child exited with status 1\n");
+        }
+        return 1;
+    }
+    if (cpid == -1) {
+        cpid = fork_job(&j, &oldmask);
+    }
+
+    switch (cpid) {
+        case -1:
+            perror("fork failed");
+            exit(1);
+        case 0:
+            if (apply_redirs(redirs, NULL) == -1) {
+                exit_shell(1);
+            }
+            execvp(arglist[0], arglist);
+            perror("Command not found...");
+            exit_shell(1);
+        default:
+            // SIGCHLD stays blocked so the handler cannot reap the child
+            // before wait4() collects its status and resource usage
+            status = wait_job(&j);
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+            if (report_status) {
+                printf("Child exited with status %d\n", status);
+            }
+            return status;
+    }
+}
+
+// Runs every stage of a pipeline in its own child, connected by pipes, and
+// returns the status of the last stage.
+int execute_pipe(struct node *pipeline) {
+    int n = pipeline->nstages;
+    struct job j = { .cmd = strdup(pipeline->text), .foreground = 1 };
+    int prev_read = -1;
+    int status = 0;
+    sigset_t oldmask;
+
+    block_sigchld(&oldmask);
+    for (int i = 0; i < n; i++) {
+        int pipefd[2] = { -1, -1 };
+        if (i < n - 1 && pipe(pipefd) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+
+        pid_t pid = fork_job(&j, &oldmask);
+        if (pid == -1) {
+            perror("fork failed");
+            exit(1);
+        }
+        if (pid == 0) {
+            if (prev_read != -1) {
+                dup2(prev_read, STDIN_FILENO);
+                close(prev_read);
+            }
+            if (pipefd[1] != -1) {
+                dup2(pipefd[1], STDOUT_FILENO);
+                close(pipefd[0]);
+                close(pipefd[1]);
+            }
+            exec_in_child(pipeline->stages[i]);
+        }
+
+        if (prev_read != -1) {
+            close(prev_read);
+        }
+        if (pipefd[1] != -1) {
+            close(pipefd[1]);
+        }
+        prev_read = pipefd[0];
+    }
+
+    status = wait_job(&j);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+// producer |> { c1, c2, ... }: the producer writes into one pipe, a pump
+// child copies that into a pipe per consumer and the shell waits for all of
+// them as one job. The producer is first in PIPESTATUS, then the pump, then
+// the consumers; the status is the last consumer's.
+int execute_fanout(struct node *n) {
+    int nc = n->nstages;
+    struct job j = { .cmd = strdup(n->text), .foreground = 1 };
+    int in[2];
+    int *out = malloc(sizeof(int) * 2 * nc);  // Read and write end per consumer
+    sigset_t oldmask;
+
+    if (pipe2(in, O_CLOEXEC) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    // Larger pipes let each tee() move more at once; the limit may refuse
+    fcntl(in[1], F_SETPIPE_SZ, 1 << 20);
+    for (int i = 0; i < nc; i++) {
+        if (pipe2(out + 2 * i, O_CLOEXEC) == -1) {
+            perror("pipe");
+            exit(1);
+        }
+        fcntl(out[2 * i + 1], F_SETPIPE_SZ, 1 << 20);
+    }
+
+    block_sigchld(&oldmask);
+    for (int s = 0; s < nc + 2; s++) {
+        // k = -1 is the producer, nc the pump, the rest consumers
+        int k = s == 0 ? -1 : s == 1 ? nc : s - 2;
+        pid_t pid = fork_job(&j, &oldmask);
+        if (pid == -1) {
+            perror("fork failed");
+            exit(1);
+        }
+        if (pid != 0) {
+            continue;
+        }
+        if (k == -1) {
+            dup2(in[1], STDOUT_FILENO);
+        } else if (k < nc) {
+            dup2(out[2 * k], STDIN_FILENO);
+        }
+        // Shell code in a child keeps its descriptors across commands, so
+        // every end not needed here is closed for the others to see EOF
+        int pump_in = k == nc ? in[0] : -1;
+        close(in[1]);
+        if (k != nc) {
+            close(in[0]);
+        }
+        for (int i = 0; i < nc; i++) {
+            close(out[2 * i]);
+            if (k != nc) {
+                close(out[2 * i + 1]);
+                out[2 * i + 1] = -1;
+            }
+        }
+        if (k < nc) {
+            exec_in_child(k == -1 ? n->left : n->stages[k]);
+        }
+        for (int i = 0; i < nc; i++) {
+            out[i] = out[2 * i + 1];  // The write ends, in place
+        }
+        fanout_pump(pump_in, out, nc);
+        exit_shell(0);
+    }
+    close(in[0]);
+    close(in[1]);
+    for (int i = 0; i < 2 * nc; i++) {
+        close(out[i]);
+    }
+    free(out);
+
+    int status = wait_job(&j);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+// Copies everything from in to each of out[0..n-1] without moving it
+// through user memory. tee() duplicates the pipe buffers of a chunk into
+// every consumer but the last, then splice() moves them into the last one,
+// which takes them out of the input. A consumer that has gone away (EPIPE)
+// is dropped and the rest carry on.
+void fanout_pump(int in, int *out, int n) {
+    signal(SIGPIPE, SIG_IGN);
+    int spare[2];  // For the rest of a chunk a consumer took only part of
+    if (pipe(spare) == -1) {
+        perror("fanout: pipe");
+        exit_shell(1);
+    }
+    fcntl(spare[1], F_SETPIPE_SZ, fcntl(in, F_GETPIPE_SZ));
+
+    int live = n;
+    while (live > 0) {
+        int first = 0, last = n - 1;
+        while (out[first] == -1) {
+            first++;
+        }
+        while (out[last] == -1) {
+            last--;
+        }
+        // The first consumer's tee() waits for data and sets the chunk size
+        ssize_t len;
+        if (first == last) {
+            len = splice(in, NULL, out[last], NULL, 1 << 20, SPLICE_F_MOVE);
+        } else {
+            len = tee(in, out[first], 1 << 20, 0);
+        }
+        if (len == 0) {
+            break;  // End of input
+        }
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EPIPE) {
+                perror("fanout: tee");
+                break;
+            }
+            close(out[first]);
+            out[first] = -1;
+            live--;
+            continue;
+        }
+        if (first == last) {
+            continue;
+        }
+        for (int i = first + 1; i < last; i++) {
+            if (out[i] != -1 && tee_exact(in, out[i], len, spare) == -1) {
+                close(out[i]);
+                out[i] = -1;
+                live--;
+            }
+        }
+        // The last consumer takes the chunk out of the input
+        size_t moved = 0;
+        while (moved < (size_t)len) {
+            ssize_t m = splice(in, NULL, out[last], NULL, len - moved, SPLICE_F_MOVE);
+            if (m == -1 && errno == EINTR) {
+                continue;
+            }
+            if (m <= 0) {
+                close(out[last]);
+                out[last] = -1;
+                live--;
+                discard_pipe(in, len - moved);
+                break;
+            }
+            moved += m;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        if (out[i] != -1) {
+            close(out[i]);
+        }
+    }
+}
+
+// tee() of exactly len bytes. When the consumer has room for only part of
+// them, the whole chunk is tee'd again into the empty spare pipe, and the
+// part already sent is dropped from there before the rest is spliced on.
+int tee_exact(int in, int out, size_t len, int spare[2]) {
+    ssize_t m;
+    while ((m = tee(in, out, len, 0)) == -1 && errno == EINTR) {
+        continue;
+    }
+    if (m <= 0) {
+        return -1;
+    }
+    if ((size_t)m == len) {
+        return 0;
+    }
+    if (tee(in, spare[1], len, 0) != (ssize_t)len) {
+        return -1;
+    }
+    discard_pipe(spare[0], m);
+    for (size_t done = m; done < len; ) {
+        ssize_t k = splice(spare[0], NULL, out, NULL, len - done, SPLICE_F_MOVE);
+        if (k == -1 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            discard_pipe(spare[0], len - done);
+            return -1;
+        }
+        done += k;
+    }
+    return 0;
+}
+
+// Reads and drops len bytes from a pipe
+void discard_pipe(int fd, size_t len) {
+    char buf[4096];
+    while (len > 0) {
+        ssize_t k = read(fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (k == -1 && errno == EINTR) {
+            continue;
+        }
+        if (k <= 0) {
+            break;
+        }
+        len -= k;
+    }
+}
+
+// ( list ): runs the list in a forked copy of the shell
+int exec_subshell(struct node *n) {
+    int status = 0;
+    struct job j = { .cmd = strdup(n->text), .foreground = 1 };
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    pid_t cpid = fork_job(&j, &oldmask);
+
+    if (cpid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (cpid == 0) {
+        if (apply_redirs(n->redirs, NULL) == -1) {
+            exit_shell(1);
+        }
+        exit_shell(exec_node(n->left));
+    }
+    status = wait_job(&j);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+// { list; }: runs the list in the shell itself, no fork
+int exec_group(struct node *n) {
+    int status = 1;
+    struct saved_fds saved = { .count = 0 };
+
+    if (apply_redirs(n->redirs, &saved) != -1) {
+        status = exec_node(n->left);
+    }
+    restore_fds(&saved);
+    return status;
+}
+
+// Runs compiled control flow, with its redirections applied to the whole
+// structure as in "done > file".
+int exec_program(struct node *n) {
+    int status = 1;
+    struct saved_fds saved = { .count = 0 };
+
+    if (apply_redirs(n->redirs, &saved) != -1) {
+        status = run_program(n->prog);
+    }
+    restore_fds(&saved);
+    return status;
+}
+
+int emit(struct program *pr, enum opcode op, int arg, int count) {
+    pr->code = realloc(pr->code, sizeof(struct instr) * (pr->ncode + 1));
+    pr->code[pr->ncode] = (struct instr){ op, arg, count, 0 };
+    return pr->ncode++;
+}
+
+int add_prog_word(struct program *pr, const char *word) {
+    pr->words = realloc(pr->words, sizeof(char*) * (pr->nwords + 1));
+    pr->words[pr->nwords] = strdup(word);
+    return pr->nwords++;
+}
+
+int add_prog_node(struct program *pr, struct node *n) {
+    pr->nodes = realloc(pr->nodes, sizeof(struct node*) * (pr->nnodes + 1));
+    pr->nodes[pr->nnodes] = n;
+    return pr->nnodes++;
+}
+
+int is_control(struct node *n) {
+    return n->type >= NODE_IF && n->type <= NODE_CASE;
+}
+
+void compile_node(struct program *pr, struct node *n, struct loop_ctx *loop, int depth);
+
+// Replaces each control structure in the tree with a NODE_PROGRAM holding
+// its bytecode. Everything else is left as it is.
+struct node* compile_tree(struct node *n) {
+    if (n == NULL) {
+        return NULL;
+    }
+    if (is_control(n)) {
+        struct node *pn = new_node(NODE_PROGRAM);
+        pn->redirs = n->redirs;
+        n->redirs = NULL;
+        pn->prog = calloc(1, sizeof(struct program));
+        compile_node(pn->prog, n, NULL, 0);
+        return pn;
+    }
+    n->left = compile_tree(n->left);
+    n->right = compile_tree(n->right);
+    for (int i = 0; i < n->nstages; i++) {
+        n->stages[i] = compile_tree(n->stages[i]);
+    }
+    if (n->type == NODE_FUNCDEF) {
+        n->left->refs = 1;  // Reference held by the defining tree
+    }
+    return n;
+}
+
+// Compiles a loop body with its own break/continue targets, then patches
+// every break to jump to the current end of the code. The body is also
+// recorded for break and continue that run as builtins, e.g. in a group.
+void compile_loop_body(struct program *pr, struct node *body, int continue_pc, int depth, int is_for) {
+    struct loop_ctx ctx = { continue_pc, NULL, 0 };
+    int start = pr->ncode;
+    compile_node(pr, body, &ctx, depth);
+    emit(pr, OP_SAVE, 0, 0);
+    int jump = emit(pr, OP_JMP, 0, 0);
+    pr->code[jump].target = continue_pc;
+    for (int i = 0; i < ctx.nbreaks; i++) {
+        pr->code[ctx.breaks[i]].target = pr->ncode;
+    }
+    free(ctx.breaks);
+    pr->loops = realloc(pr->loops, sizeof(struct loop_range) * (pr->nloops + 1));
+    pr->loops[pr->nloops++] = (struct loop_range){ start, pr->ncode, continue_pc, pr->ncode, is_for };
+}
+
+// Appends the code for n to the program. Lists and control structures are
+// flattened into jumps; any other command becomes an OP_RUN of its tree.
+// The control skeleton is freed, the commands are moved into the program.
+void compile_node(struct program *pr, struct node *n, struct loop_ctx *loop, int depth) {
+    int jump, end, top;
+
+    if (n == NULL) {
+        emit(pr, OP_STATUS, 0, 0);
+        return;
+    }
+    if (is_control(n) && n->redirs != NULL) {
+        // Redirected as a whole: keep it as a separate program
+        emit(pr, OP_RUN, add_prog_node(pr, compile_tree(n)), 0);
+        return;
+    }
+
+    switch (n->type) {
+        case NODE_SEQ:
+            compile_node(pr, n->left, loop, depth);
+            compile_node(pr, n->right, loop, depth);
+            break;
+        case NODE_AND:
+        case NODE_OR:
+            compile_node(pr, n->left, loop, depth);
+            jump = emit(pr, n->type == NODE_AND ? OP_JNZ : OP_JZ, 0, 0);
+            compile_node(pr, n->right, loop, depth);
+            pr->code[jump].target = pr->ncode;
+            break;
+        case NODE_IF:
+            compile_node(pr, n->left, loop, depth);
+            jump = emit(pr, OP_JNZ, 0, 0);
+            compile_node(pr, n->right, loop, depth);
+            end = emit(pr, OP_JMP, 0, 0);
+            pr->code[jump].target = pr->ncode;
+            compile_node(pr, n->alt, loop, depth);
+            pr->code[end].target = pr->ncode;
+            break;
+        case NODE_WHILE:
+        case NODE_UNTIL:
+            emit(pr, OP_STATUS, 0, 0);
+            emit(pr, OP_SAVE, 0, 0);
+            top = pr->ncode;
+            compile_node(pr, n->left, loop, depth);
+            jump = emit(pr, n->type == NODE_WHILE ? OP_JNZ : OP_JZ, 0, 0);
+            compile_loop_body(pr, n->right, top, depth, 0);
+            pr->code[jump].target = pr->ncode;
+            emit(pr, OP_RESTORE, 0, 0);
+            break;
+        case NODE_FOR: {
+            int name = add_prog_word(pr, n->argv[0]);
+            int first = pr->nwords;
+            for (int i = 1; i < n->argc; i++) {
+                add_prog_word(pr, n->argv[i]);
+            }
+            emit(pr, OP_STATUS, 0, 0);
+            emit(pr, OP_SAVE, 0, 0);
+            emit(pr, OP_FOR, first, n->argc - 1);
+            top = emit(pr, OP_NEXT, name, 0);
+            if (depth + 1 > pr->max_depth) {
+                pr->max_depth = depth + 1;
+            }
+            compile_loop_body(pr, n->right, top, depth + 1, 1);
+            emit(pr, OP_POP, 0, 0);  // Reached only by break
+            pr->code[top].target = pr->ncode;
+            emit(pr, OP_RESTORE, 0, 0);
+            break;
+        }
+        case NODE_CASE: {
+            int *ends = malloc(sizeof(int) * (n->nstages + 1));
+            int **matches = malloc(sizeof(int*) * (n->nstages + 1));
+            emit(pr, OP_CASE, add_prog_word(pr, n->argv[0]), 0);
+            for (int i = 0; i < n->nstages; i++) {
+                struct node *item = n->stages[i];
+                matches[i] = malloc(sizeof(int) * item->argc);
+                for (int k = 0; k < item->argc; k++) {
+                    matches[i][k] = emit(pr, OP_MATCH, add_prog_word(pr, item->argv[k]), 0);
+                }
+            }
+            emit(pr, OP_STATUS, 0, 0);  // No pattern matched
+            ends[n->nstages] = emit(pr, OP_JMP, 0, 0);
+            for (int i = 0; i < n->nstages; i++) {
+                struct node *item = n->stages[i];
+                for (int k = 0; k < item->argc; k++) {
+                    pr->code[matches[i][k]].target = pr->ncode;
+                }
+                compile_node(pr, item->right, loop, depth);
+                item->right = NULL;
+                ends[i] = emit(pr, OP_JMP, 0, 0);
+                free(matches[i]);
+            }
+            for (int i = 0; i <= n->nstages; i++) {
+                pr->code[ends[i]].target = pr->ncode;
+            }
+            free(ends);
+            free(matches);
+            break;
+        }
+        case NODE_CMD:
+            if (loop != NULL && n->argc == 1 && n->redirs == NULL
+                    && (strcmp(n->argv[0], "break") == 0 || strcmp(n->argv[0], "continue") == 0)) {
+                jump = emit(pr, OP_JMP, 0, 0);
+                if (n->argv[0][0] == 'b') {
+                    loop->breaks = realloc(loop->breaks, sizeof(int) * (loop->nbreaks + 1));
+                    loop->breaks[loop->nbreaks++] = jump;
+                } else {
+                    pr->code[jump].target = loop->continue_pc;
+                }
+                break;
+            }
+            emit(pr, OP_RUN, add_prog_node(pr, n), 0);
+            return;
+        default:
+            emit(pr, OP_RUN, add_prog_node(pr, compile_tree(n)), 0);
+            return;
+    }
+
+    // Children were moved into the program above
+    n->left = n->right = n->alt = NULL;
+    free_node(n);
+}
+
+// The dispatch loop: runs bytecode and returns the last exit status.
+int run_program(struct program *pr) {
+    int status = 0, saved = 0, pc = 0, depth = 0;
+    char *subject = NULL;
+    struct for_iter *iters = malloc(sizeof(struct for_iter) * (pr->max_depth + 1));
+
+    while (pc < pr->ncode) {
+        struct instr *in = &pr->code[pc++];
+        switch (in->op) {
+            case OP_RUN: {
+                int around = loops_around(pr, pc - 1);
+                loops_running += around;
+                status = exec_node(pr->nodes[in->arg]);
+                loops_running -= around;
+                if (func_returning) {
+                    pc = pr->ncode;
+                } else if (loop_exit) {
+                    pc = take_loop_exit(pr, pc - 1, iters, &depth);
+                }
+                break;
+            }
+            case OP_JMP:
+                pc = in->target;
+                break;
+            case OP_JZ:
+                if (status == 0) {
+                    pc = in->target;
+                }
+                break;
+            case OP_JNZ:
+                if (status != 0) {
+                    pc = in->target;
+                }
+                break;
+            case OP_STATUS:
+                status = in->arg;
+                break;
+            case OP_SAVE:
+                saved = status;
+                break;
+            case OP_RESTORE:
+                status = saved;
+                break;
+            case OP_FOR: {
+                char **list = malloc(sizeof(char*) * (in->count + 1));
+                memcpy(list, &pr->words[in->arg], sizeof(char*) * in->count);
+                list[in->count] = NULL;
+                iters[depth].items = expand_words(list);
+                iters[depth].pos = 0;
+                depth++;
+                free(list);
+                break;
+            }
+            case OP_NEXT: {
+                struct for_iter *it = &iters[depth - 1];
+                if (it->items[it->pos] == NULL) {
+                    free_words(it->items);
+                    depth--;
+                    pc = in->target;
+                } else {
+                    assign_var(pr->words[in->arg], it->items[it->pos++]);
+                }
+                break;
+            }
+            case OP_POP:
+                free_words(iters[--depth].items);
+                break;
+            case OP_CASE:
+                free(subject);
+                subject = expand_word(pr->words[in->arg]);
+                break;
+            case OP_MATCH: {
+                char *pattern = expand_word(pr->words[in->arg]);
+                if (fnmatch(pattern, subject, 0) == 0) {
+                    pc = in->target;
+                }
+                free(pattern);
+                break;
+            }
+        }
+    }
+
+    while (depth > 0) {
+        free_words(iters[--depth].items);  // Left early by return or break N
+    }
+    free(iters);
+    free(subject);
+    return status;
+}
+
+// Number of this program's loops whose body contains pc
+int loops_around(struct program *pr, int pc) {
+    int count = 0;
+    for (int i = 0; i < pr->nloops; i++) {
+        count += pr->loops[i].start <= pc && pc < pr->loops[i].end;
+    }
+    return count;
+}
+
+// Leaves the loops around pc for a pending break or continue and returns
+// where to go on. Loops past the outermost one here are left to the caller.
+int take_loop_exit(struct program *pr, int pc, struct for_iter *iters, int *depth) {
+    for (int i = 0; i < pr->nloops; i++) {
+        struct loop_range *l = &pr->loops[i];
+        if (pc < l->start || pc >= l->end) {
+            continue;
+        }
+        if (--loop_exit_count == 0) {
+            int target = loop_exit == 'b' ? l->break_pc : l->continue_pc;
+            loop_exit = 0;
+            return target;  // A for loop's break_pc pops its iterator
+        }
+        if (l->is_for) {
+            free_words(iters[--*depth].items);
+        }
+    }
+    return pr->ncode;
+}
+
+void free_program(struct program *pr) {
+    for (int i = 0; i < pr->nnodes; i++) {
+        free_node(pr->nodes[i]);
+    }
+    for (int i = 0; i < pr->nwords; i++) {
+        free(pr->words[i]);
+    }
+    free(pr->nodes);
+    free(pr->words);
+    free(pr->code);
+    free(pr->loops);
+    free(pr);
+}
+
+// list &: forks one child for the whole and-or list and records it as a job
+int run_background(struct node *n) {
+    struct job j = { .cmd = strdup(n->text), .foreground = 0 };
+    struct node *body = n->left;
+    if (body->type == NODE_TIMEOUT) {
+        // The shell enforces the deadline on the job itself, no waiting child
+        if (set_job_timeout(&j, body) == -1) {
+            free_job(&j);
+            return 125;
+        }
+        body = body->left;
+    }
+    // set -o multiplex: stdout and stderr go to a pipe the shell reads
+    int out[2] = { -1, -1 };
+    if (multiplex && getpid() == shell_pid && pipe2(out, O_CLOEXEC) == -1) {
+        perror("pipe failed");
+        out[0] = out[1] = -1;
+    }
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    pid_t cpid = fork_job(&j, &oldmask);
+
+    if (cpid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (cpid == 0) {
+        if (out[1] != -1) {
+            dup2(out[1], STDOUT_FILENO);
+            dup2(out[1], STDERR_FILENO);
+        }
+        exec_in_child(body);
+    }
+    if (out[1] != -1) {
+        close(out[1]);
+    }
+
+    // Add the job to the jobs list; the handler may only see it once it is there
+    struct job *added = add_job(&j);
+    if (added != NULL) {
+        printf("[%d] %d\n", added->id, cpid);
+        arm_timer();
+    } else {
+        free_job(&j);
+    }
+    if (out[0] != -1 && (added == NULL || start_output(added->id, out[0]) == -1)) {
+        close(out[0]);
+    }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return 0;
+}
+
+// I/O priority classes for ioprio_set(), from linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+
+// Parses a CPU list such as "0-3,8" into set. Returns -1 if malformed.
+int parse_cpulist(const char *list, cpu_set_t *set) {
+    CPU_ZERO(set);
+    while (*list != '\0') {
+        char *end;
+        long first = strtol(list, &end, 10), last = first;
+        if (end == list || first < 0) {
+            return -1;
+        }
+        if (*end == '-') {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list || last < first) {
+                return -1;
+            }
+        }
+        if (last >= CPU_SETSIZE) {
+            return -1;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        list = end;
+    }
+    return 0;
+}
+
+// Applies the options of a sched prefix to the calling process, which is a
+// child that is about to exec the command:
+//   -c CPULIST        sched_setaffinity, e.g. -c 0-3,8
+//   -n NICE           setpriority, the absolute nice value -20..19
+//   -i CLASS[:LEVEL]  ioprio_set, CLASS rt, be or idle, LEVEL 0-7
+// Returns -1 after reporting an error.
+int apply_sched(struct node *n) {
+    char **argv = expand_words(n->argv);
+    int status = 0;
+
+    for (int i = 0; argv[i] != NULL && status == 0; i += 2) {
+        const char *value = argv[i + 1];
+        if (value == NULL) {
+            fprintf(stderr, "sched: %s: missing value\n", argv[i]);
+            status = -1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            cpu_set_t set;
+            if (parse_cpulist(value, &set) == -1) {
+                fprintf(stderr, "sched: %s: invalid CPU list\n", value);
+                status = -1;
+            } else if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+                perror("sched: sched_setaffinity");
+                status = -1;
+            }
+        } else if (strcmp(argv[i], "-n") == 0) {
+            if (setpriority(PRIO_PROCESS, 0, atoi(value)) == -1) {
+                perror("sched: setpriority");
+                status = -1;
+            }
+        } else if (strcmp(argv[i], "-i") == 0) {
+            const char *classes[] = { "none", "rt", "be", "idle", NULL };
+            const char *colon = strchr(value, ':');
+            size_t len = colon != NULL ? (size_t)(colon - value) : strlen(value);
+            int ioclass = 0, level = colon != NULL ? atoi(colon + 1) : 4;
+            while (classes[ioclass] != NULL && (strlen(classes[ioclass]) != len
+                    || strncmp(classes[ioclass], value, len) != 0)) {
+                ioclass++;
+            }
+            if (classes[ioclass] == NULL || level < 0 || level > 7) {
+                fprintf(stderr, "sched: %s: invalid I/O class\n", value);
+                status = -1;
+            } else if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                               (ioclass << IOPRIO_CLASS_SHIFT) | level) == -1) {
+                perror("sched: ioprio_set");
+                status = -1;
+            }
+        } else {
+            fprintf(stderr, "sched: %s: unknown option\n", argv[i]);
+            status = -1;
+        }
+    }
+    free_words(argv);
+    return status;
+}
+
+// sched or limit [options] command: forks like any external command and
+// applies the options in the child, before it execs, so no wrapper process
+// is needed and the shell itself is unaffected.
+int exec_prefixed(struct node *n) {
+    struct job j = { .cmd = strdup(n->text), .foreground = 1 };
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    pid_t cpid = fork_job(&j, &oldmask);
+
+    if (cpid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (cpid == 0) {
+        exec_in_child(n);
+    }
+    int status = wait_job(&j);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+// Resource limits known to ulimit and limit. Plain numbers are in units of
+// scale bytes (or seconds, or a count); K, M, G and T suffixes give bytes.
+struct rlimit_name {
+    char flag;
+    int resource;
+    const char *name;
+    rlim_t scale;
+    const char *unit;
+};
+
+struct rlimit_name rlimit_names[] = {
+    { 'c', RLIMIT_CORE, "core file size", 1024, "kbytes" },
+    { 'd', RLIMIT_DATA, "data seg size", 1024, "kbytes" },
+    { 'f', RLIMIT_FSIZE, "file size", 1024, "kbytes" },
+    { 'n', RLIMIT_NOFILE, "open files", 1, NULL },
+    { 's', RLIMIT_STACK, "stack size", 1024, "kbytes" },
+    { 't', RLIMIT_CPU, "cpu time", 1, "seconds" },
+    { 'u', RLIMIT_NPROC, "max user processes", 1, NULL },
+    { 'v', RLIMIT_AS, "virtual memory", 1024, "kbytes" },
+    { 0, 0, NULL, 0, NULL }
+};
+
+struct rlimit_name* find_rlimit(char flag) {
+    for (int i = 0; rlimit_names[i].name != NULL; i++) {
+        if (rlimit_names[i].flag == flag) {
+            return &rlimit_names[i];
+        }
+    }
+    return NULL;
+}
+
+// Parses "unlimited", "60", "512" or "2G". Returns -1 if malformed or too
+// large for rlim_t.
+int parse_rlimit(const char *value, struct rlimit_name *rl, rlim_t *limit) {
+    if (strcmp(value, "unlimited") == 0) {
+        *limit = RLIM_INFINITY;
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(value, &end, 10);
+    if (end == value || value[0] == '-' || errno == ERANGE) {
+        return -1;
+    }
+    const char *suffixes = "KMGT";
+    const char *s = *end != '\0' ? strchr(suffixes, *end & ~0x20) : NULL;
+    rlim_t scale;
+    if (*end == '\0') {
+        scale = rl->scale;
+    } else if (s != NULL && end[1] == '\0') {
+        scale = (rlim_t)1 << (10 * (s - suffixes + 1));
+    } else {
+        return -1;
+    }
+    // The largest value must stay below RLIM_INFINITY, which means unlimited
+    if (n > (RLIM_INFINITY - 1) / scale) {
+        return -1;
+    }
+    *limit = n * scale;
+    return 0;
+}
+
+// Sets the soft limit, the hard limit or both
+int set_rlimit(struct rlimit_name *rl, rlim_t limit, int soft, int hard) {
+    struct rlimit r;
+    getrlimit(rl->resource, &r);
+    if (soft) {
+        r.rlim_cur = limit;
+    }
+    if (hard) {
+        r.rlim_max = limit;
+    }
+    if (setrlimit(rl->resource, &r) == -1) {
+        fprintf(stderr, "%s: ", rl->name);
+        perror("setrlimit");
+        return -1;
+    }
+    return 0;
+}
+
+void print_rlimit(struct rlimit_name *rl, int hard, int verbose) {
+    struct rlimit r;
+    getrlimit(rl->resource, &r);
+    rlim_t limit = hard ? r.rlim_max : r.rlim_cur;
+    if (verbose) {
+        char label[64];
+        snprintf(label, sizeof(label), "%s%s%s%s", rl->name, rl->unit != NULL ? " (" : "",
+                 rl->unit != NULL ? rl->unit : "", rl->unit != NULL ? ")" : "");
+        printf("%-32s(-%c) ", label, rl->flag);
+    }
+    if (limit == RLIM_INFINITY) {
+        printf("unlimited\n");
+    } else {
+        printf("%llu\n", (unsigned long long)(limit / rl->scale));
+    }
+}
+
+// ulimit [-H|-S] [-a] [-cdfnstuv] [limit]: shows or sets the shell's own
+// limits, inherited by every command it starts. -f is the default.
+int builtin_ulimit(char **argv) {
+    int soft = 0, hard = 0, all = 0;
+    struct rlimit_name *rl = NULL;
+    int i = 1;
+
+    for (; argv[i] != NULL && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        for (const char *c = argv[i] + 1; *c != '\0'; c++) {
+            if (*c == 'H') {
+                hard = 1;
+            } else if (*c == 'S') {
+                soft = 1;
+            } else if (*c == 'a') {
+                all = 1;
+            } else if ((rl = find_rlimit(*c)) == NULL) {
+                fprintf(stderr, "ulimit: -%c: invalid option\n", *c);
+                return 2;
+            }
+        }
+    }
+    if (all) {
+        for (int k = 0; rlimit_names[k].name != NULL; k++) {
+            print_rlimit(&rlimit_names[k], hard, 1);
+        }
+        return 0;
+    }
+    if (rl == NULL) {
+        rl = find_rlimit('f');
+    }
+    if (argv[i] == NULL) {
+        print_rlimit(rl, hard, 0);
+        return 0;
+    }
+
+    rlim_t limit;
+    if (parse_rlimit(argv[i], rl, &limit) == -1) {
+        fprintf(stderr, "ulimit: %s: invalid limit\n", argv[i]);
+        return 1;
+    }
+    if (!soft && !hard) {
+        soft = hard = 1;
+    }
+    return set_rlimit(rl, limit, soft, hard) == -1 ? 1 : 0;
+}
+
+// Applies the options of a limit prefix, e.g. limit -v 2G -t 60, to the
+// child about to exec the command. Soft and hard limits are both set, so the
+// command cannot raise them again; the shell's own limits are untouched.
+int apply_limit(struct node *n) {
+    char **argv = expand_words(n->argv);
+    int status = 0;
+
+    for (int i = 0; argv[i] != NULL && status == 0; i += 2) {
+        struct rlimit_name *rl = argv[i][0] == '-' && argv[i][1] != '\0' && argv[i][2] == '\0'
+                ? find_rlimit(argv[i][1]) : NULL;
+        rlim_t limit;
+        if (rl == NULL) {
+            fprintf(stderr, "limit: %s: unknown option\n", argv[i]);
+            status = -1;
+        } else if (argv[i + 1] == NULL || parse_rlimit(argv[i + 1], rl, &limit) == -1) {
+            fprintf(stderr, "limit: %s: invalid limit\n", argv[i + 1] != NULL ? argv[i + 1] : argv[i]);
+            status = -1;
+        } else {
+            status = set_rlimit(rl, limit, 1, 1);
+        }
+    }
+    free_words(argv);
+    return status;
+}
+
+// Parses a duration such as 10, 1.5, 500ms, 2m, 1h or 1d into seconds.
+// Returns -1 if malformed.
+double parse_duration(const char *text) {
+    char *end;
+    double value = strtod(text, &end);
+    if (end == text || value < 0) {
+        return -1;
+    }
+    if (strcmp(end, "") == 0 || strcmp(end, "s") == 0) {
+        return value;
+    } else if (strcmp(end, "ms") == 0) {
+        return value / 1000;
+    } else if (strcmp(end, "m") == 0) {
+        return value * 60;
+    } else if (strcmp(end, "h") == 0) {
+        return value * 3600;
+    } else if (strcmp(end, "d") == 0) {
+        return value * 86400;
+    }
+    return -1;
+}
+
+// Sets a job's timeout from the options of a timeout node:
+//   timeout DURATION [-s SIG] [-k KILLAFTER] pipeline
+// Returns -1 after reporting an error.
+int set_job_timeout(struct job *j, struct node *n) {
+    char **argv = expand_words(n->argv);
+    double duration = -1;
+    int status = 0;
+
+    j->timeout_sig = SIGTERM;
+    j->kill_after = 0;
+    for (int i = 0; argv[i] != NULL && status == 0; i += 2) {
+        const char *value = argv[i + 1];
+        if (value == NULL) {
+            status = -1;
+        } else if (strcmp(argv[i], "-d") == 0) {
+            if ((duration = parse_duration(value)) < 0) {
+                fprintf(stderr, "timeout: %s: invalid duration\n", value);
+                status = -1;
+            }
+        } else if (strcmp(argv[i], "-s") == 0) {
+            if ((j->timeout_sig = parse_signal(value)) == 0) {
+                fprintf(stderr, "timeout: %s: invalid signal\n", value);
+                status = -1;
+            }
+        } else if (strcmp(argv[i], "-k") == 0) {
+            if ((j->kill_after = parse_duration(value)) <= 0) {
+                fprintf(stderr, "timeout: %s: invalid duration\n", value);
+                status = -1;
+            }
+        } else {
+            fprintf(stderr, "timeout: %s: unknown option\n", argv[i]);
+            status = -1;
+        }
+    }
+    if (status == 0 && duration < 0) {
+        fprintf(stderr, "timeout: usage: timeout DURATION [-s SIG] [-k KILLAFTER] pipeline\n");
+        status = -1;
+    }
+    free_words(argv);
+    if (status == 0 && duration > 0) {  // 0 disables the timeout, as in timeout(1)
+        clock_gettime(CLOCK_MONOTONIC, &j->deadline);
+        add_seconds(&j->deadline, duration);
+    }
+    return status;
+}
+
+void add_seconds(struct timespec *ts, double seconds) {
+    long long ns = ts->tv_nsec + (long long)((seconds - (long long)seconds) * 1e9);
+    ts->tv_sec += (time_t)seconds + ns / 1000000000;
+    ts->tv_nsec = ns % 1000000000;
+}
+
+// Checks one job's deadline: on expiry its process group gets the timeout
+// signal and, when -k was given, SIGKILL once the grace period is over.
+void check_deadline(struct job *j, const struct timespec *now) {
+    if (j->deadline.tv_sec == 0 || j->pgid == 0) {
+        return;
+    }
+    if (now->tv_sec < j->deadline.tv_sec
+            || (now->tv_sec == j->deadline.tv_sec && now->tv_nsec < j->deadline.tv_nsec)) {
+        return;
+    }
+    if (!j->timed_out) {
+        j->timed_out = 1;
+        kill(-j->pgid, j->timeout_sig);
+        kill(-j->pgid, SIGCONT);  // A stopped job must run to act on it
+        j->deadline.tv_sec = 0;
+        if (j->kill_after > 0) {
+            j->deadline = *now;
+            add_seconds(&j->deadline, j->kill_after);
+        }
+    } else {
+        kill(-j->pgid, SIGKILL);
+        j->deadline.tv_sec = 0;
+    }
+}
+
+// Points the interval timer at the earliest job deadline, or stops it.
+void arm_timer() {
+    struct timespec now, *first = NULL;
+    // Background deadlines belong to the interactive shell, not its children
+    for (int i = 0; i < job_count && getpid() == shell_pid; i++) {
+        struct timespec *d = &jobs[i].deadline;
+        if (jobs[i].id != 0 && d->tv_sec != 0 && job_state(&jobs[i]) != JOB_DONE && (first == NULL || d->tv_sec < first->tv_sec
+                || (d->tv_sec == first->tv_sec && d->tv_nsec < first->tv_nsec))) {
+            first = d;
+        }
+    }
+    if (fg_job != NULL && fg_job->deadline.tv_sec != 0 && (first == NULL
+            || fg_job->deadline.tv_sec < first->tv_sec
+            || (fg_job->deadline.tv_sec == first->tv_sec && fg_job->deadline.tv_nsec < first->tv_nsec))) {
+        first = &fg_job->deadline;
+    }
+
+    struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+    if (first != NULL) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long us = (first->tv_sec - now.tv_sec) * 1000000LL + (first->tv_nsec - now.tv_nsec) / 1000;
+        if (us < 1) {
+            us = 1;  // Already due: fire right away
+        }
+        timer.it_value.tv_sec = us / 1000000;
+        timer.it_value.tv_usec = us % 1000000;
+    }
+    setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+// SIGALRM: enforces the deadlines of the foreground job and of background
+// jobs, so a timeout also fires while the shell waits at the prompt.
+void sigalrm_handler(int signum) {
+    int saved_errno = errno;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < job_count && getpid() == shell_pid; i++) {
+        if (jobs[i].id != 0) {
+            check_deadline(&jobs[i], &now);
+        }
+    }
+    if (fg_job != NULL) {
+        check_deadline(fg_job, &now);
+    }
+    arm_timer();
+    errno = saved_errno;
+}
+
+// timeout DURATION [-s SIG] [-k KILLAFTER] pipeline: runs the pipeline in a
+// child leading its own process group, which is signalled on expiry.
+// Returns 124 if the timeout fired, like timeout(1).
+int exec_timeout(struct node *n) {
+    struct job j = { .cmd = strdup(n->text), .foreground = 1 };
+    if (set_job_timeout(&j, n) == -1) {
+        free_job(&j);
+        return 125;
+    }
+
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    pid_t cpid = fork_job(&j, &oldmask);
+    if (cpid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (cpid == 0) {
+        exec_in_child(n->left);
+    }
+    int status = wait_job(&j);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+// Opens and installs the redirections. When saved is not NULL (the shell
+// itself, not a child) the original descriptors are kept for restore_fds().
+int apply_redirs(struct redir *r, struct saved_fds *saved) {
+    fflush(stdout);
+    for (; r != NULL; r = r->next) {
+        char *target;
+        int fd;
+        if (r->type == REDIR_HEREDOC) {
+            target = r->literal ? strdup(r->target) : expand_heredoc(r->target);
+        } else {
+            target = expand_word(r->target);
+        }
+        save_fd(saved, r->fd);  // Before opening, which may reuse the same number
+        switch (r->type) {
+            case REDIR_IN:
+                fd = open_redir(target, O_RDONLY);
+                break;
+            case REDIR_OUT:
+                fd = open_redir(target, O_WRONLY | O_CREAT | O_TRUNC);
+                break;
+            case REDIR_APPEND:
+                fd = open_redir(target, O_WRONLY | O_CREAT | O_APPEND);
+                break;
+            case REDIR_RDWR:
+                fd = open_redir(target, O_RDWR | O_CREAT);
+                break;
+            case REDIR_HERESTR:
+                target = realloc(target, strlen(target) + 2);
+                strcat(target, "\n");
+                fd = here_fd(target, strlen(target));
+                break;
+            case REDIR_HEREDOC:
+                fd = here_fd(target, strlen(target));
+                break;
+            case REDIR_DUP:
+            default:
+                fd = -1;
+                break;
+        }
+        if (r->type == REDIR_DUP) {
+            // n>&m duplicates m, n>&- closes n
+            char *end;
+            long src = strtol(target, &end, 10);
+            if (strcmp(target, "-") != 0 && (*end != '\0' || end == target || fcntl(src, F_GETFD) == -1)) {
+                fprintf(stderr, "%s: bad file descriptor\n", target);
+                free(target);
+                return -1;
+            }
+            if (strcmp(target, "-") == 0) {
+                close(r->fd);
+            } else if (src != r->fd) {
+                dup2(src, r->fd);
+            }
+            free(target);
+            continue;
+        }
+        if (fd == -1) {
+            fprintf(stderr, "%s: ", r->type == REDIR_HEREDOC ? "here-document" : target);
+            perror(r->type == REDIR_IN ? "Failed to open input file" : "Failed to open output file");
+            free(target);
+            return -1;
+        }
+        free(target);
+        if (saved != NULL && r->type != REDIR_HERESTR && r->type != REDIR_HEREDOC) {
+            saved->opened[saved->count - 1] = 1;  // The entry save_fd() made for r->fd
+        }
+
+        if (fd != r->fd) {
+            dup2(fd, r->fd);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+// Opens a redirection target under the redirect policy. O_DIRECT and
+// O_NOATIME are dropped again when the file system or file owner refuses
+// them; the fadvise hints are applied to the descriptor before it is dup2'd.
+// DONTNEED here only drops what was cached before; restore_fds() drops the
+// pages the command itself brought in.
+int open_redir(const char *target, int flags) {
+    int extra = 0;
+    if (redirect_policy & RP_DIRECT) {
+        extra |= O_DIRECT;
+    }
+    if ((redirect_policy & RP_NOATIME) && (flags & O_ACCMODE) == O_RDONLY) {
+        extra |= O_NOATIME;
+    }
+
+    int fd = open(target, flags | extra, 0644);
+    if (fd == -1 && extra != 0 && (errno == EINVAL || errno == EPERM)) {
+        fd = open(target, flags, 0644);
+    }
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (redirect_policy & RP_SEQUENTIAL) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (redirect_policy & RP_NOREUSE) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+    }
+    if (redirect_policy & RP_DONTNEED) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    }
+    return fd;
+}
+
+// Writes back a regular file's dirty pages and drops its cached ones, once
+// the command that streamed through it has finished
+void drop_cached(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        return;
+    }
+    if (fcntl(fd, F_GETFL) & O_ACCMODE) {
+        // Dirty pages are not dropped, so wait for them to be written
+        sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE
+                        | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// Remembers the current value of fd for restore_fds()
+void save_fd(struct saved_fds *saved, int fd) {
+    if (saved != NULL) {
+        if (saved->count == saved->size) {
+            saved->size = saved->size > 0 ? saved->size * 2 : 4;
+            saved->fd = realloc(saved->fd, sizeof(int) * saved->size);
+            saved->copy = realloc(saved->copy, sizeof(int) * saved->size);
+            saved->opened = realloc(saved->opened, sizeof(int) * saved->size);
+        }
+        saved->fd[saved->count] = fd;
+        saved->opened[saved->count] = 0;
+        saved->copy[saved->count] = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        saved->count++;
+    }
+}
+
+// Returns a descriptor reading the given text from the start. Small texts go
+// through a pipe, which holds them without blocking; larger ones through an
+// anonymous memory file. Neither touches the filesystem.
+int here_fd(const char *text, size_t len) {
+    int fd;
+    if (len <= HEREPIPE) {
+        int pipefd[2];
+        if (pipe(pipefd) == -1) {
+            return -1;
+        }
+        if (write(pipefd[1], text, len) != (ssize_t)len) {
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return -1;
+        }
+        close(pipefd[1]);
+        return pipefd[0];
+    }
+
+    if ((fd = memfd_create("here-document", MFD_CLOEXEC)) == -1) {
+        return -1;
+    }
+    for (size_t done = 0; done < len; ) {
+        ssize_t w = write(fd, text + done, len - done);
+        if (w <= 0) {
+            close(fd);
+            return -1;
+        }
+        done += w;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+void restore_fds(struct saved_fds *saved) {
+    fflush(stdout);
+    // Undo in reverse so a descriptor redirected twice gets its first value
+    while (saved->count > 0) {
+        saved->count--;
+        int fd = saved->fd[saved->count];
+        int copy = saved->copy[saved->count];
+        // Only files the redirection opened, not duplicates or inherited ones
+        if ((redirect_policy & RP_DONTNEED) && saved->opened[saved->count]) {
+            drop_cached(fd);
+        }
+        if (copy == -1) {
+            close(fd);
+        } else {
+            dup2(copy, fd);
+            close(copy);
+        }
+    }
+    free(saved->fd);
+    free(saved->copy);
+    free(saved->opened);
+    saved->fd = saved->copy = saved->opened = NULL;
+    saved->size = 0;
+}
+
+int is_name_char(char c) {
+    return c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+// True for a NAME=value word
+int is_assignment(const char *word) {
+    const char *eq = strchr(word, '=');
+    if (eq == NULL || eq == word || (word[0] >= '0' && word[0] <= '9')) {
+        return 0;
+    }
+    for (const char *cp = word; cp < eq; cp++) {
+        if (!is_name_char(*cp)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A command made only of NAME=value words sets shell variables.
+int assign_vars(struct node *n) {
+    for (int i = 0; i < n->argc; i++) {
+        if (!is_assignment(n->argv[i])) {
+            fprintf(stderr, "%s: command not found\n", n->argv[i]);
+            return 1;
+        }
+    }
+    for (int i = 0; i < n->argc; i++) {
+        char *eq = strchr(n->argv[i], '=');
+        char *name = strndup(n->argv[i], eq - n->argv[i]);
+        char *value = expand_word(eq + 1);
+        assign_var(name, value);
+        free(name);
+        free(value);
+    }
+    return 0;
+}
+
+int is_param_start(char c) {
+    return c == '{' || is_name_char(c) || c == '#' || c == '@' || c == '*' || c == '?';
+}
+
+// Expands the parameter at *cpp, which points at its '$', and advances past
+// it. Returns NULL, leaving *cpp alone, for a '${' without its '}'.
+char* expand_param(const char **cpp) {
+    const char *cp = *cpp, *start;
+    size_t nlen = 0;
+    if (cp[1] == '{') {
+        const char *close = strchr(cp + 2, '}');
+        if (close == NULL) {
+            return NULL;
+        }
+        start = cp + 2;
+        nlen = close - start;
+        cp = close + 1;
+    } else if (!is_name_char(cp[1]) || (cp[1] >= '0' && cp[1] <= '9')) {
+        start = cp + 1;  // $1 ... $9, $#, $@, $*, $?
+        nlen = 1;
+        cp += 2;
+    } else {
+        start = cp + 1;
+        while (is_name_char(start[nlen])) {
+            nlen++;
+        }
+        cp = start + nlen;
+    }
+    char *name = strndup(start, nlen);
+    char *value = param_value(name);
+    free(name);
+    *cpp = cp;
+    return value;
+}
+
+// Expands a here-document body: parameters are replaced and a backslash
+// quotes only $, ` and \. Quotes and blanks are kept as they are.
+char* expand_heredoc(const char *cp) {
+    size_t cap = strlen(cp) + 16, len = 0;
+    char *out = malloc(cap);
+
+    while (*cp != '\0') {
+        if (*cp == '\\' && cp[1] != '\0' && strchr("$`\\", cp[1]) != NULL) {
+            append_char(&out, &len, &cap, cp[1]);
+            cp += 2;
+        } else if (*cp == '$' && is_param_start(cp[1])) {
+            char *param = expand_param(&cp);
+            if (param == NULL) {
+                append_char(&out, &len, &cap, *cp++);
+                continue;
+            }
+            for (const char *value = param; *value != '\0'; value++) {
+                append_char(&out, &len, &cap, *value);
+            }
+            free(param);
+        } else {
+            append_char(&out, &len, &cap, *cp++);
+        }
+    }
+    out[len] = '\0';
+    return out;
+}
+
+// PIPESTATUS, PIPESIGNAL and PIPETIME: the whole list for $NAME, ${NAME[@]}
+// or ${NAME[*]}, one stage for ${NAME[i]}. NULL for other names.
+char* pipe_param(const char *name) {
+    const char *arrays[] = { "PIPESTATUS", "PIPESIGNAL", "PIPETIME", NULL };
+    int which = 0;
+    size_t len = 0;
+    while (arrays[which] != NULL) {
+        len = strlen(arrays[which]);
+        if (strncmp(name, arrays[which], len) == 0 && (name[len] == '\0' || name[len] == '[')) {
+            break;
+        }
+        which++;
+    }
+    if (arrays[which] == NULL) {
+        return NULL;
+    }
+
+    int first = 0, last = pipe_count - 1;
+    if (name[len] == '[' && name[len + 1] != '@' && name[len + 1] != '*') {
+        first = last = atoi(name + len + 1);
+    }
+    size_t cap = 32, out_len = 0;
+    char *out = malloc(cap);
+    out[0] = '\0';
+    for (int i = first; i <= last && i >= 0 && i < pipe_count; i++) {
+        char item[32];
+        if (which == 0) {
+            snprintf(item, sizeof(item), "%d", pipe_status[i]);
+        } else if (which == 1) {
+            snprintf(item, sizeof(item), "%s", pipe_signal[i] != 0 ? signal_name(pipe_signal[i]) : "-");
+        } else {
+            snprintf(item, sizeof(item), "%.3f", pipe_time[i]);
+        }
+        if (i > first) {
+            append_char(&out, &out_len, &cap, ' ');
+        }
+        for (const char *c = item; *c != '\0'; c++) {
+            append_char(&out, &out_len, &cap, *c);
+        }
+        out[out_len] = '\0';
+    }
+    return out;
+}
+
+// Value of $name, ${name} or a positional parameter as a new string
+char* param_value(const char *name) {
+    struct frame *fr = frame_depth > 0 ? &frames[frame_depth - 1] : NULL;
+    int nargs = fr != NULL ? fr->nargs : 0;
+
+    if (strcmp(name, "?") == 0) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d", last_status);
+        return strdup(buf);
+    }
+    char *pipe_value = pipe_param(name);
+    if (pipe_value != NULL) {
+        return pipe_value;
+    }
+    if (strcmp(name, "#") == 0) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "%d", nargs);
+        return strdup(buf);
+    }
+    if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0) {
+        size_t size = 1;
+        for (int i = 0; i < nargs; i++) {
+            size += strlen(fr->args[i]) + 1;
+        }
+        char *joined = calloc(1, size);
+        for (int i = 0; i < nargs; i++) {
+            if (i > 0) {
+                strcat(joined, " ");
+            }
+            strcat(joined, fr->args[i]);
+        }
+        return joined;
+    }
+    if (name[0] >= '0' && name[0] <= '9') {
+        int index = atoi(name);
+        return strdup(index >= 1 && index <= nargs ? fr->args[index - 1] : "");
+    }
+    return strdup(lookup_var(name));
+}
+
+// Value of a shell variable, falling back to the environment
+const char* lookup_var(const char *name) {
+    char *value = get_var((char *)name);
+    if (value == NULL) {
+        value = getenv(name);
+    }
+    return value != NULL ? value : "";
+}
+
+void wordlist_add(struct wordlist *wl, char *word) {
+    if (wl->count + 2 > wl->cap) {
+        wl->cap = wl->cap > 0 ? wl->cap * 2 : 8;
+        wl->words = realloc(wl->words, sizeof(char*) * wl->cap);
+    }
+    wl->words[wl->count++] = word;
+    wl->words[wl->count] = NULL;
+}
+
+void append_char(char **buf, size_t *len, size_t *cap, char c) {
+    if (*len + 2 > *cap) {
+        *cap *= 2;
+        *buf = realloc(*buf, *cap);
+    }
+    (*buf)[(*len)++] = c;
+}
+
+// Adds one character of a word being expanded. With split set the word may
+// be a glob pattern: quoted wildcards are escaped with a backslash and an
+// unquoted one sets *glob.
+void append_word_char(char **buf, size_t *len, size_t *cap, char c, int split, int quoted, int *glob) {
+    if (split && quoted && strchr("\\*?[", c) != NULL) {
+        append_char(buf, len, cap, '\\');
+    } else if (split && !quoted && strchr("*?[", c) != NULL) {
+        *glob = 1;
+    } else if (split && c == '\\') {
+        append_char(buf, len, cap, '\\');
+    }
+    append_char(buf, len, cap, c);
+}
+
+// Adds a finished word to wl: its glob matches when it has unquoted
+// wildcards that match something, else the word without glob escapes.
+void finish_word(char *word, int split, int glob, struct wordlist *wl) {
+    if (glob && glob_expand(word, wl) > 0) {
+        free(word);
+        return;
+    }
+    if (split) {
+        char *out = word;
+        for (const char *c = word; *c != '\0'; c++) {
+            if (*c == '\\' && c[1] != '\0') {
+                c++;
+            }
+            *out++ = *c;
+        }
+        *out = '\0';
+    }
+    wordlist_add(wl, word);
+}
+
+// Expands one word into wl. $name and ${name} are replaced by their values
+// and quotes and backslashes are removed. When split is set, the unquoted
+// result of an expansion is broken into separate words at blanks and words
+// with unquoted *, ? or [...] are replaced by the sorted paths they match.
+void expand_into(const char *cp, int split, struct wordlist *wl) {
+    size_t cap = strlen(cp) + 16, len = 0;
+    char *out = malloc(cap);
+    int have = 0;  // A word has started, even an empty quoted one
+    int glob = 0;  // The word has an unquoted wildcard
+    char quote = 0;
+
+    while (*cp != '\0') {
+        if (quote == 0 && (*cp == '\'' || *cp == '"')) {
+            quote = *cp++;
+            have = 1;
+        } else if (quote != 0 && *cp == quote) {
+            quote = 0;
+            cp++;
+        } else if (*cp == '\\' && quote != '\'' && cp[1] != '\0') {
+            if (cp[1] == '\n') {
+                cp += 2;  // Line continuation
+            } else if (quote == '"' && strchr("\\\"$`", cp[1]) == NULL) {
+                append_word_char(&out, &len, &cap, *cp++, split, 1, &glob);  // Backslash is literal inside "..."
+            } else {
+                cp++;
+                append_word_char(&out, &len, &cap, *cp++, split, 1, &glob);
+            }
+            have = 1;
+        } else if (*cp == '$' && quote != '\'' && is_param_start(cp[1])) {
+            char *param = expand_param(&cp);
+            if (param == NULL) {
+                append_word_char(&out, &len, &cap, *cp++, split, quote != 0, &glob);
+                have = 1;
+                continue;
+            }
+            for (const char *value = param; *value != '\0'; value++) {
+                if (split && quote == 0 && (*value == ' ' || *value == '\t' || *value == '\n')) {
+                    if (have || len > 0) {
+                        out[len] = '\0';
+                        finish_word(strdup(out), split, glob, wl);
+                        len = 0;
+                        have = 0;
+                        glob = 0;
+                    }
+                } else {
+                    append_word_char(&out, &len, &cap, *value, split, quote != 0, &glob);
+                    have = 1;
+                }
+            }
+            free(param);
+        } else if (quote == 0 && (*cp == '<' || *cp == '>') && cp[1] == '(' && procsub_end(cp + 1) != NULL) {
+            const char *close = procsub_end(cp + 1);
+            char *text = strndup(cp + 2, close - cp - 2);
+            char *path = start_procsub(text, *cp == '>');
+            for (const char *c = path != NULL ? path : ""; *c != '\0'; c++) {
+                append_word_char(&out, &len, &cap, *c, split, 1, &glob);
+            }
+            free(text);
+            free(path);
+            cp = close + 1;
+            have = 1;
+        } else {
+            append_word_char(&out, &len, &cap, *cp++, split, quote != 0, &glob);
+            have = 1;
+        }
+    }
+
+    if (have || len > 0) {
+        out[len] = '\0';
+        finish_word(out, split, glob, wl);
+    } else {
+        free(out);
+    }
+}
+
+// The ')' closing the '(' at open, past quotes and nested parentheses, or
+// NULL if the line ends first
+const char* procsub_end(const char *open) {
+    int depth = 0;
+    for (const char *cp = open; *cp != '\0'; cp++) {
+        if (*cp == '\\' && cp[1] != '\0') {
+            cp++;
+        } else if (*cp == '\'' || *cp == '"') {
+            const char *close = strchr(cp + 1, *cp);
+            if (close == NULL) {
+                return NULL;
+            }
+            cp = close;
+        } else if (*cp == '(') {
+            depth++;
+        } else if (*cp == ')' && --depth == 0) {
+            return cp;
+        }
+    }
+    return NULL;
+}
+
+// <(list) and >(list): runs the list as a job reading or writing a pipe and
+// returns /dev/fd/N for the shell's end, which the command being expanded
+// inherits. The job is in the table while it runs but, as a part of that
+// command, gets no Done line.
+char* start_procsub(const char *text, int output) {
+    int incomplete;
+    struct node *tree = parse_line(text, &incomplete);
+    if (tree == NULL || procsub_count == MAXPROCSUB) {
+        if (tree != NULL || incomplete) {
+            fprintf(stderr, "%s: cannot substitute %s(%s)\n", tree != NULL ? "too many" : "syntax error",
+                    output ? ">" : "<", text);
+        }
+        free_node(tree);
+        return NULL;
+    }
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        free_node(tree);
+        return NULL;
+    }
+    int keep = output ? fds[1] : fds[0];
+    int child_end = output ? fds[0] : fds[1];
+
+    size_t size = strlen(text) + 4;
+    struct job j = { .cmd = malloc(size), .foreground = 0 };
+    snprintf(j.cmd, size, "%s(%s)", output ? ">" : "<", text);
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    pid_t pid = fork_job(&j, &oldmask);
+    if (pid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        dup2(child_end, output ? STDIN_FILENO : STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        // Earlier substitutions' ends would hold off their EOF
+        close_procsubs(0);
+        exec_in_child(tree);
+    }
+    close(child_end);
+    free_node(tree);
+    int current = current_job;  // %+ stays the user's last job
+    struct job *added = add_job(&j);
+    if (added != NULL) {
+        added->notified = 1;
+        current_job = current;
+    } else {
+        free_job(&j);
+    }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+
+    procsub_fds[procsub_count++] = keep;
+    char *path = malloc(32);
+    snprintf(path, 32, "/dev/fd/%d", keep);
+    return path;
+}
+
+// Closes the substitutions opened since procsub_count was keep
+void close_procsubs(int keep) {
+    while (procsub_count > keep) {
+        close(procsub_fds[--procsub_count]);
+    }
+}
+
+// Expands each word with field splitting. Returns a new NULL-terminated
+// array for free_words(); words that expand to nothing are dropped.
+char** expand_words(char **words) {
+    struct wordlist wl = { NULL, 0, 0 };
+    wordlist_add(&wl, NULL);
+    wl.count = 0;
+    for (int i = 0; words[i] != NULL; i++) {
+        if (strcmp(words[i], "\"$@\"") == 0) {
+            // "$@" keeps every positional parameter a separate word
+            struct frame *fr = frame_depth > 0 ? &frames[frame_depth - 1] : NULL;
+            for (int k = 0; fr != NULL && k < fr->nargs; k++) {
+                wordlist_add(&wl, strdup(fr->args[k]));
+            }
+        } else {
+            expand_into(words[i], 1, &wl);
+        }
+    }
+    return wl.words;
+}
+
+// Expands a single word without field splitting, as for a redirection target
+// or the value of an assignment.
+char* expand_word(const char *word) {
+    struct wordlist wl = { NULL, 0, 0 };
+    expand_into(word, 0, &wl);
+    char *result = wl.count > 0 ? wl.words[0] : strdup("");
+    free(wl.words);
+    return result;
+}
+
+void free_words(char **words) {
+    for (int i = 0; words[i] != NULL; i++) {
+        free(words[i]);
+    }
+    free(words);
+}
+
+// Words joined with single spaces, as a new string
+char* join_words(char **words) {
+    size_t size = 1;
+    for (int i = 0; words[i] != NULL; i++) {
+        size += strlen(words[i]) + 1;
+    }
+    char *text = calloc(1, size);
+    for (int i = 0; words[i] != NULL; i++) {
+        if (i > 0) {
+            strcat(text, " ");
+        }
+        strcat(text, words[i]);
+    }
+    return text;
+}
+
+// Glob expansion. A pattern is split at '/' into parts, each compiled once
+// into atoms; directories are read with getdents64() into a large buffer and
+// only the names that match are kept. A part that is exactly ** matches any
+// number of directories (never following symlinks), and the results of one
+// pattern are sorted.
+#define DENTBUF (1 << 20)  // Bytes read per getdents64() call
+
+// Directory entry as returned by getdents64()
+struct linux_dirent64 {
+    unsigned long long d_ino;
+    long long d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int compare_strings(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+// Compiles one part of a glob pattern. Backslash quotes the next character,
+// and a '[' without a closing ']' is literal.
+void glob_compile(const char *text, size_t n, struct glob_part *part) {
+    part->atoms = malloc(sizeof(struct glob_atom) * (n + 1));
+    part->natoms = 0;
+    part->literal = malloc(n + 1);
+    part->dot = n > 0 && text[0] == '.';
+    part->globstar = n == 2 && text[0] == '*' && text[1] == '*';
+    int meta = 0;
+    size_t lit = 0;
+
+    for (size_t i = 0; i < n; i++) {
+        struct glob_atom *a = &part->atoms[part->natoms];
+        memset(a, 0, sizeof(*a));
+        if (text[i] == '\\' && i + 1 < n) {
+            a->op = GLOB_CHAR;
+            a->c = text[++i];
+        } else if (text[i] == '*') {
+            meta = 1;
+            if (part->natoms > 0 && a[-1].op == GLOB_STAR) {
+                continue;  // ** inside a part is the same as *
+            }
+            a->op = GLOB_STAR;
+        } else if (text[i] == '?') {
+            meta = 1;
+            a->op = GLOB_ANY;
+        } else if (text[i] == '[') {
+            size_t k = i + 1;
+            int negate = k < n && (text[k] == '!' || text[k] == '^');
+            k += negate;
+            size_t first = k;
+            while (k < n && (text[k] != ']' || k == first)) {
+                k += text[k] == '\\' && k + 1 < n ? 2 : 1;
+            }
+            if (k >= n) {
+                a->op = GLOB_CHAR;  // No closing ']'
+                a->c = '[';
+            } else {
+                meta = 1;
+                a->op = GLOB_CLASS;
+                for (size_t c = first; c < k; c++) {
+                    unsigned char lo = text[c] == '\\' ? text[++c] : text[c], hi = lo;
+                    if (c + 2 < k && text[c + 1] == '-') {
+                        hi = text[c + 2] == '\\' && c + 3 < k ? text[c + 3] : text[c + 2];
+                        c += text[c + 2] == '\\' ? 3 : 2;
+                    }
+                    for (unsigned v = lo; v <= hi; v++) {
+                        a->set[v >> 3] |= 1 << (v & 7);
+                    }
+                }
+                if (negate) {
+                    for (int b = 0; b < 32; b++) {
+                        a->set[b] = ~a->set[b];
+                    }
+                }
+                i = k;
+            }
+        } else {
+            a->op = GLOB_CHAR;
+            a->c = text[i];
+        }
+        if (a->op == GLOB_CHAR) {
+            part->literal[lit++] = a->c;
+        }
+        part->natoms++;
+    }
+    part->literal[lit] = '\0';
+    part->is_literal = !meta;
+}
+
+// Matches a name against a compiled part, backtracking only to the last *
+int glob_match(const struct glob_part *part, const char *name) {
+    const struct glob_atom *atoms = part->atoms;
+    int n = part->natoms, ai = 0, star = -1;
+    const char *s = name, *star_s = NULL;
+
+    if (name[0] == '.' && !part->dot) {
+        return 0;  // Hidden names need an explicit leading '.'
+    }
+    while (*s != '\0') {
+        unsigned char c = *s;
+        if (ai < n && atoms[ai].op == GLOB_STAR) {
+            star = ai++;
+            star_s = s;
+        } else if (ai < n && (atoms[ai].op == GLOB_ANY ||
+                              (atoms[ai].op == GLOB_CHAR && atoms[ai].c == c) ||
+                              (atoms[ai].op == GLOB_CLASS && (atoms[ai].set[c >> 3] & (1 << (c & 7)))))) {
+            ai++;
+            s++;
+        } else if (star >= 0) {
+            ai = star + 1;
+            s = ++star_s;
+        } else {
+            return 0;
+        }
+    }
+    while (ai < n && atoms[ai].op == GLOB_STAR) {
+        ai++;
+    }
+    return ai == n;
+}
+
+// Reads the directory at path and keeps the names accepted by part (every
+// name but . and .. when part is NULL, hidden ones only with show_hidden).
+// Names are packed into one buffer; each kept entry's offset and whether it is
+// a directory are returned. Returns the number of entries, or -1.
+int glob_scan(const char *path, const struct glob_part *part, int show_hidden,
+              char **names, size_t **offsets, unsigned char **is_dir) {
+    static char *dents = NULL;
+    int fd = open(path[0] != '\0' ? path : ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (dents == NULL) {
+        dents = malloc(DENTBUF);
+    }
+
+    size_t used = 0, cap = 4096;
+    int count = 0, slots = 64;
+    *names = malloc(cap);
+    *offsets = malloc(sizeof(size_t) * slots);
+    *is_dir = malloc(slots);
+    long got;
+    while ((got = syscall(SYS_getdents64, fd, dents, DENTBUF)) > 0) {
+        for (long pos = 0; pos < got; ) {
+            struct linux_dirent64 *d = (struct linux_dirent64 *)(dents + pos);
+            pos += d->d_reclen;
+            const char *name = d->d_name;
+            if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+                continue;
+            }
+            if (part != NULL ? !glob_match(part, name) : (name[0] == '.' && !show_hidden)) {
+                continue;
+            }
+            size_t len = strlen(name) + 1;
+            if (used + len > cap) {
+                while (used + len > cap) {
+                    cap *= 2;
+                }
+                *names = realloc(*names, cap);
+            }
+            if (count == slots) {
+                slots *= 2;
+                *offsets = realloc(*offsets, sizeof(size_t) * slots);
+                *is_dir = realloc(*is_dir, slots);
+            }
+            memcpy(*names + used, name, len);
+            (*offsets)[count] = used;
+            if (d->d_type == DT_UNKNOWN) {
+                struct stat st;
+                (*is_dir)[count] = fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+            } else {
+                (*is_dir)[count] = d->d_type == DT_DIR;
+            }
+            used += len;
+            count++;
+        }
+    }
+    close(fd);
+    return count;
+}
+
+// Appends one name to the path buffer, returning the old length to restore
+size_t glob_push(char **path, size_t *len, size_t *cap, const char *name) {
+    size_t old = *len, n = strlen(name);
+    while (*len + n + 2 > *cap) {
+        *cap *= 2;
+        *path = realloc(*path, *cap);
+    }
+    if (*len > 0 && (*path)[*len - 1] != '/') {
+        (*path)[(*len)++] = '/';
+    }
+    memcpy(*path + *len, name, n + 1);
+    *len += n;
+    return old;
+}
+
+// Matches parts[i...] below the directory in path, adding full matches to wl
+void glob_walk(struct glob_part *parts, int nparts, int i,
+               char **path, size_t *len, size_t *cap, struct wordlist *wl) {
+    struct glob_part *part = &parts[i];
+    int last = i == nparts - 1;
+
+    if (part->is_literal) {
+        // No directory read needed: just extend the path
+        struct stat st;
+        if (last && part->literal[0] == '\0') {
+            // Trailing '/': the path so far must be a directory
+            if (*len > 0 && stat(*path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                char *dir = malloc(*len + 2);
+                snprintf(dir, *len + 2, "%s/", *path);
+                wordlist_add(wl, dir);
+            }
+            return;
+        }
+        size_t old = glob_push(path, len, cap, part->literal);
+        if (!last) {
+            glob_walk(parts, nparts, i + 1, path, len, cap, wl);
+        } else if (lstat(*path, &st) == 0) {
+            wordlist_add(wl, strdup(*path));
+        }
+        *len = old;
+        (*path)[old] = '\0';
+        return;
+    }
+
+    if (part->globstar && !last) {
+        glob_walk(parts, nparts, i + 1, path, len, cap, wl);  // Zero directories
+    }
+    char *names;
+    size_t *offsets;
+    unsigned char *is_dir;
+    int count = glob_scan(*path, part->globstar ? NULL : part, 0, &names, &offsets, &is_dir);
+    for (int k = 0; k < count; k++) {
+        size_t old = glob_push(path, len, cap, names + offsets[k]);
+        if (part->globstar) {
+            if (last) {
+                wordlist_add(wl, strdup(*path));
+            }
+            if (is_dir[k]) {
+                glob_walk(parts, nparts, i, path, len, cap, wl);
+            }
+        } else if (last) {
+            wordlist_add(wl, strdup(*path));
+        } else {
+            struct stat st;
+            if (is_dir[k] || stat(*path, &st) == 0) {  // Symlinks to directories too
+                glob_walk(parts, nparts, i + 1, path, len, cap, wl);
+            }
+        }
+        *len = old;
+        (*path)[old] = '\0';
+    }
+    if (count >= 0) {
+        free(names);
+        free(offsets);
+        free(is_dir);
+    }
+}
+
+// Expands a glob pattern into wl in sorted order. Returns the number of
+// matches; wl is unchanged when nothing matches.
+int glob_expand(const char *pattern, struct wordlist *wl) {
+    int nparts = 1;
+    for (const char *c = pattern; *c != '\0'; c++) {
+        nparts += *c == '/';
+    }
+    struct glob_part *parts = malloc(sizeof(struct glob_part) * nparts);
+    size_t cap = PATH_MAX, len = 0;
+    char *path = malloc(cap);
+    path[0] = '\0';
+
+    const char *start = pattern;
+    if (*start == '/') {
+        path[len++] = '/';
+        path[len] = '\0';
+        while (*start == '/') {
+            start++;
+        }
+    }
+    nparts = 0;
+    while (1) {
+        const char *end = strchr(start, '/');
+        size_t n = end != NULL ? (size_t)(end - start) : strlen(start);
+        glob_compile(start, n, &parts[nparts++]);
+        if (end == NULL) {
+            break;
+        }
+        start = end + 1;
+        while (*start == '/') {
+            start++;  // a//b is a/b
+        }
+    }
+
+    int first = wl->count;
+    glob_walk(parts, nparts, 0, &path, &len, &cap, wl);
+    if (wl->count > first) {
+        qsort(wl->words + first, wl->count - first, sizeof(char*), compare_strings);
+    }
+
+    for (int i = 0; i < nparts; i++) {
+        free(parts[i].atoms);
+        free(parts[i].literal);
+    }
+    free(parts);
+    free(path);
+    return wl->count - first;
+}
+
+// Forks after flushing stdout so buffered output is not written twice. The
+// child gets the default SIGCHLD action and the signal mask saved by
+// block_sigchld(), so it can wait for children of its own.
+pid_t fork_child(sigset_t *oldmask) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        if (job_control) {
+            signal(SIGINT, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGTTIN, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            job_control = 0;  // Only the interactive shell hands out the terminal
+        }
+        fg_job = NULL;  // The job table stays readable, e.g. for jobs | wc -l
+        sigprocmask(SIG_SETMASK, oldmask, NULL);
+    }
+    return pid;
+}
+
+// Exits the shell, or a forked child running shell code. Children use _exit()
+// because exit() would move the shared stdin offset back to where the child's
+// copy of the stdin buffer stopped, making the parent re-read script input.
+void exit_shell(int status) {
+    fflush(stdout);
+    fflush(stderr);
+    if (getpid() != shell_pid) {
+        _exit(status);
+    }
+    if (server_conn != -1) {
+        // "exit" in a server session still answers the client
+        if (write(server_conn, &status, sizeof(status)) != sizeof(status)) {
+            status = 1;
+        }
+    }
+    flush_outputs();
+    free_history();
+    exit(status);
+}
+
+// Blocks SIGCHLD, saving the previous mask to restore once the foreground
+// children have been waited for. SIGALRM is blocked too, as its handler
+// reads the job table as well.
+void block_sigchld(sigset_t *oldmask) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGALRM);
+    sigprocmask(SIG_BLOCK, &mask, oldmask);
+}
+
+// Shell status of a wait status: the exit code, or 128 + the signal number
+// for a child killed by a signal.
+int status_code(int wstatus) {
+    if (WIFSIGNALED(wstatus)) {
+        return 128 + WTERMSIG(wstatus);
+    }
+    return WEXITSTATUS(wstatus);
+}
+
+// Records the per-stage results of the last foreground pipeline
+void set_pipestatus(int count, const int *wstatus, const double *elapsed_ms) {
+    if (count > pipe_count) {
+        pipe_status = realloc(pipe_status, sizeof(int) * count);
+        pipe_signal = realloc(pipe_signal, sizeof(int) * count);
+        pipe_time = realloc(pipe_time, sizeof(double) * count);
+    }
+    for (int i = 0; i < count; i++) {
+        pipe_status[i] = status_code(wstatus[i]);
+        pipe_signal[i] = WIFSIGNALED(wstatus[i]) ? WTERMSIG(wstatus[i]) : 0;
+        pipe_time[i] = elapsed_ms != NULL ? elapsed_ms[i] : 0;
+    }
+    pipe_count = count;
+    pipe_serial++;
+}
+
+// Adds the CPU times of b to a and keeps the larger peak RSS.
+void add_usage(struct rusage *a, const struct rusage *b) {
+    timeradd(&a->ru_utime, &b->ru_utime, &a->ru_utime);
+    timeradd(&a->ru_stime, &b->ru_stime, &a->ru_stime);
+    if (b->ru_maxrss > a->ru_maxrss) {
+        a->ru_maxrss = b->ru_maxrss;
+    }
+}
+
+int builtin_cd(char **argv) {
+    if (argv[1] == NULL) {
+        fprintf(stderr, "cd: missing argument\n");
+        return 1;
+    }
+    if (chdir(argv[1]) != 0) {
+        perror("cd failed");
+        return 1;
+    }
+    return 0;
+}
+
+int builtin_exit(char **argv) {
+    exit_shell(argv[1] != NULL ? atoi(argv[1]) : 0);
+    return 0;
+}
+
+// jobs, or jobs -o n for the output kept from job n under set -o multiplex
+int builtin_jobs(char **argv) {
+    drain_outputs();
+    if (argv[1] == NULL) {
+        list_jobs();
+        return 0;
+    }
+    if (strcmp(argv[1], "-o") != 0 || argv[2] == NULL) {
+        fprintf(stderr, "jobs: usage: jobs [-o n]\n");
+        return 2;
+    }
+    struct job_output *o = find_output(atoi(argv[2] + (argv[2][0] == '%')));
+    if (o == NULL) {
+        fprintf(stderr, "jobs: %s: no output kept\n", argv[2]);
+        return 1;
+    }
+    size_t first = o->total > o->cap ? o->total - o->cap : 0;
+    if (first > 0) {
+        fprintf(stderr, "jobs: [%d] first %zu bytes no longer kept\n", o->id, first);
+    }
+    for (size_t k = first; k < o->total; ) {
+        size_t off = k % o->cap;
+        size_t n = o->total - k < o->cap - off ? o->total - k : o->cap - off;
+        fwrite(o->ring + off, 1, n, stdout);
+        k += n;
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// kill [-SIG] %n: signals the whole process group of a job, SIGKILL by
+// default. A plain number is also taken as a job number.
+int builtin_kill(char **argv) {
+    int sig = SIGKILL, i = 1;
+    if (argv[1] != NULL && argv[1][0] == '-') {
+        if ((sig = parse_signal(argv[1] + 1)) == 0) {
+            fprintf(stderr, "kill: %s: invalid signal\n", argv[1] + 1);
+            return 1;
+        }
+        i++;
+    }
+    if (argv[i] == NULL) {
+        fprintf(stderr, "kill: missing job number\n");
+        return 1;
+    }
+
+    int status = 0;
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    for (; argv[i] != NULL; i++) {
+        int k = find_job(argv[i]);
+        if (k == -1) {
+            fprintf(stderr, "kill: %s: no such job\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        struct job *j = &jobs[k];
+        if (kill(-j->pgid, sig) == -1) {
+            perror("kill failed");
+            status = 1;
+            continue;
+        }
+        if (job_state(j) == JOB_STOPPED && sig != SIGKILL && sig != SIGCONT) {
+            continue_job(j);  // A stopped job only acts on the signal once running
+        }
+        if (sig == SIGKILL) {
+            printf("Killed job [%d] %d\n", j->id, j->pgid);
+        }
+    }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+// fg [%n]: continues a job in the foreground and waits for it
+int builtin_fg(char **argv) {
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    int k = find_job(argv[1]);
+    if (k == -1) {
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        fprintf(stderr, "fg: %s: no such job\n", argv[1] != NULL ? argv[1] : "current");
+        return 1;
+    }
+
+    // Take the job out of the table; wait_job() puts it back if it stops again
+    struct job j = jobs[k];
+    j.procs = malloc(sizeof(struct proc) * j.nprocs);
+    memcpy(j.procs, jobs[k].procs, sizeof(struct proc) * j.nprocs);
+    j.cmd = strdup(jobs[k].cmd);
+    int was_stopped = job_state(&j) == JOB_STOPPED;
+    remove_job(k);
+    j.foreground = 1;
+
+    printf("%s\n", j.cmd);
+    fflush(stdout);
+    if (job_control) {
+        tcsetpgrp(STDIN_FILENO, j.pgid);
+        if (was_stopped) {
+            tcsetattr(STDIN_FILENO, TCSADRAIN, &j.tmodes);
+        }
+    }
+    continue_job(&j);
+    int status = wait_job(&j);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+// bg [%n]: continues a stopped job in the background
+int builtin_bg(char **argv) {
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    int k = find_job(argv[1]);
+    if (k == -1) {
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
+        fprintf(stderr, "bg: %s: no such job\n", argv[1] != NULL ? argv[1] : "current");
+        return 1;
+    }
+    continue_job(&jobs[k]);
+    printf("[%d]+ %s &\n", jobs[k].id, jobs[k].cmd);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return 0;
+}
+
+// "set name value" command, "set -o option" / "set +o option" for shell options
+int builtin_set(char **argv) {
+    if (argv[1] != NULL && (strcmp(argv[1], "-b") == 0 || strcmp(argv[1], "+b") == 0)) {
+        return set_option("notify", argv[1][0] == '-');
+    }
+    if (argv[1] != NULL && (strcmp(argv[1], "-o") == 0 || strcmp(argv[1], "+o") == 0)) {
+        if (argv[2] == NULL) {
+            print_options();
+            return 0;
+        }
+        return set_option(argv[2], argv[1][0] == '-');
+    }
+    if (argv[1] == NULL || argv[2] == NULL) {
+        fprintf(stderr, "set: usage: set name value | set -o|+o option\n");
+        return 1;
+    }
+    set_var(argv[1], argv[2], 0);  // 0 indicates local variable
+    return 0;
+}
+
+// "export name" command
+int builtin_export(char **argv) {
+    if (argv[1] == NULL) {
+        fprintf(stderr, "export: missing variable name\n");
+        return 1;
+    }
+    char *value = get_var(argv[1]);
+    if (value != NULL) {
+        setenv(argv[1], value, 1);  // Update the environment variable, before set_var() frees value
+        set_var(argv[1], value, 1);  // Set as global
+    }
+    return 0;
+}
+
+// alias [name[=value] ...]: defines aliases, or prints the named ones or all
+int builtin_alias(char **argv) {
+    int status = 0;
+    if (argv[1] == NULL) {
+        struct alias **all = malloc(sizeof(struct alias*) * (alias_count + 1));
+        int n = 0;
+        for (int i = 0; i < ALIASHASH; i++) {
+            for (struct alias *a = alias_table[i]; a != NULL; a = a->next) {
+                all[n++] = a;
+            }
+        }
+        qsort(all, n, sizeof(struct alias*), compare_aliases);
+        for (int i = 0; i < n; i++) {
+            print_alias(all[i]);
+        }
+        free(all);
+        return 0;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        char *eq = strchr(argv[i], '=');
+        if (eq != NULL && eq > argv[i]) {
+            *eq = '\0';
+            set_alias(argv[i], eq + 1);
+            *eq = '=';
+        } else if (find_alias(argv[i]) != NULL) {
+            print_alias(find_alias(argv[i]));
+        } else {
+            fprintf(stderr, "alias: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// unalias name ... | unalias -a
+int builtin_unalias(char **argv) {
+    if (argv[1] == NULL) {
+        fprintf(stderr, "unalias: usage: unalias [-a] name ...\n");
+        return 2;
+    }
+    int status = 0;
+    if (strcmp(argv[1], "-a") == 0) {
+        for (int i = 0; i < ALIASHASH; i++) {
+            while (alias_table[i] != NULL) {
+                unset_alias(alias_table[i]->name);
+            }
+        }
+        return 0;
+    }
+    for (int i = 1; argv[i] != NULL; i++) {
+        if (unset_alias(argv[i]) != 0) {
+            fprintf(stderr, "unalias: %s: not found\n", argv[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// "unset name" command, "unset -f name" for functions
+int builtin_unset(char **argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-f") == 0) {
+        if (argv[2] == NULL) {
+            fprintf(stderr, "unset: missing function name\n");
+            return 1;
+        }
+        unset_function(argv[2]);
+        return 0;
+    }
+    if (argv[1] == NULL) {
+        fprintf(stderr, "unset: missing variable name\n");
+        return 1;
+    }
+    unset_var(argv[1]);
+    return 0;
+}
+
+// "printenv" command to list all variables
+int builtin_printenv(char **argv) {
+    print_vars();
+    return 0;
+}
+
+int builtin_parsecache(char **argv) {
+    if (argv[1] != NULL && strcmp(argv[1], "-c") == 0) {
+        cache_clear();
+    }
+    print_cache_stats();
+    return 0;
+}
+
+// break [n] and continue [n] where the loop could not compile them to a
+// jump, e.g. inside a group, after a redirection or in a called function
+int builtin_break(char **argv) {
+    int count = argv[1] != NULL ? atoi(argv[1]) : 1;
+    if (count < 1) {
+        fprintf(stderr, "%s: loop count out of range\n", argv[0]);
+        return 1;
+    }
+    if (loops_running == 0) {
+        fprintf(stderr, "%s: only meaningful in a loop\n", argv[0]);
+        return 0;
+    }
+    loop_exit = argv[0][0];
+    loop_exit_count = count < loops_running ? count : loops_running;
+    return 0;
+}
+
+int builtin_return(char **argv) {
+    if (frame_depth == 0) {
+        fprintf(stderr, "return: can only be used in a function\n");
+        return 1;
+    }
+    func_returning = 1;
+    return argv[1] != NULL ? atoi(argv[1]) : 0;
+}
+
+// local name[=value]...: saves each variable in the current call frame, so
+// the function's changes are undone when it returns
+int builtin_local(char **argv) {
+    if (frame_depth == 0) {
+        fprintf(stderr, "local: can only be used in a function\n");
+        return 1;
+    }
+    struct frame *fr = &frames[frame_depth - 1];
+    for (int i = 1; argv[i] != NULL; i++) {
+        char *eq = strchr(argv[i], '=');
+        char *name = eq != NULL ? strndup(argv[i], eq - argv[i]) : strdup(argv[i]);
+        char *old = get_var(name);
+
+        fr->locals = realloc(fr->locals, sizeof(struct saved_var) * (fr->nlocals + 1));
+        struct saved_var *sv = &fr->locals[fr->nlocals++];
+        sv->name = name;
+        sv->value = old != NULL ? strdup(old) : NULL;
+        sv->global = 0;
+        for (int k = 0; k < var_count; k++) {
+            if (strncmp(var_table[k].str, name, strlen(name)) == 0 && var_table[k].str[strlen(name)] == '=') {
+                sv->global = var_table[k].global;
+            }
+        }
+        sv->env = getenv(name) != NULL ? strdup(getenv(name)) : NULL;
+        // A local copy of an exported variable is what commands run in the
+        // function see
+        int exported = sv->global || sv->env != NULL;
+        set_var(name, eq != NULL ? eq + 1 : "", exported);
+        if (exported) {
+            setenv(name, eq != NULL ? eq + 1 : "", 1);
+        }
+    }
+    return 0;
+}
+
+int builtin_true(char **argv) {
+    return 0;
+}
+
+int builtin_false(char **argv) {
+    return 1;
+}
+
+// memo: output cache for deterministic commands. The key is a hash of the
+// command's words, the working directory, some environment variables and the
+// inode, size and mtime of the executable and of every dependency file. A key
+// names the exit status and the content hash of the output, which is stored
+// once under objects/ however many keys produced it. The hashes only name
+// files: a key file keeps the whole key and an object is compared byte for
+// byte before it is shared. Objects are evicted least recently used first,
+// and a hit counts as a use.
+
+// FNV-1a, continuing from h
+unsigned long long memo_hash(unsigned long long h, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ p[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+void memo_key_add(struct memo_key *key, const void *data, size_t len) {
+    if (key->len + len > key->cap) {
+        while (key->len + len > key->cap) {
+            key->cap = key->cap > 0 ? key->cap * 2 : 256;
+        }
+        key->data = realloc(key->data, key->cap);
+    }
+    memcpy(key->data + key->len, data, len);
+    key->len += len;
+}
+
+void memo_key_file(struct memo_key *key, const char *path) {
+    struct memo_stamp stamp;
+    struct stat st;
+    memset(&stamp, 0, sizeof(stamp));
+    if (stat(path, &st) == 0) {
+        stamp.dev = st.st_dev;
+        stamp.ino = st.st_ino;
+        stamp.size = st.st_size;
+        stamp.mtime = st.st_mtim;
+    }
+    memo_key_add(key, path, strlen(path) + 1);
+    memo_key_add(key, &stamp, sizeof(stamp));
+}
+
+// Finds the program argv[0] runs the way execvp() would. Returns -1 for a
+// builtin, a function or a command that is not found.
+int find_program(const char *name, char *path, size_t size) {
+    if (strchr(name, '/') != NULL) {
+        snprintf(path, size, "%s", name);
+        return 0;
+    }
+    if (find_builtin(name) != NULL || find_function(name) != NULL) {
+        return -1;
+    }
+    const char *dirs = lookup_var("PATH");
+    while (*dirs != '\0') {
+        int len = strcspn(dirs, ":");
+        snprintf(path, size, "%.*s/%s", len > 0 ? len : 1, len > 0 ? dirs : ".", name);
+        if (access(path, X_OK) == 0) {
+            return 0;
+        }
+        dirs += dirs[len] == ':' ? len + 1 : len;
+    }
+    return -1;
+}
+
+void memo_key(struct memo_key *key, char **argv, char **deps, int ndeps, char **envs, int nenvs) {
+    char path[PATH_MAX];
+    for (int i = 0; argv[i] != NULL; i++) {
+        memo_key_add(key, argv[i], strlen(argv[i]) + 1);
+    }
+    memo_key_add(key, "", 1);
+    if (getcwd(path, sizeof(path)) != NULL) {
+        memo_key_add(key, path, strlen(path) + 1);
+    }
+    memo_key_add(key, "", 1);
+    for (int i = 0; memo_env[i] != NULL; i++) {
+        memo_key_add(key, memo_env[i], strlen(memo_env[i]) + 1);
+        memo_key_add(key, lookup_var(memo_env[i]), strlen(lookup_var(memo_env[i])) + 1);
+    }
+    for (int i = 0; i < nenvs; i++) {
+        memo_key_add(key, envs[i], strlen(envs[i]) + 1);
+        memo_key_add(key, lookup_var(envs[i]), strlen(lookup_var(envs[i])) + 1);
+    }
+    memo_key_add(key, "", 1);
+    if (find_program(argv[0], path, sizeof(path)) == 0) {
+        memo_key_file(key, path);
+    }
+    for (int i = 0; i < ndeps; i++) {
+        memo_key_file(key, deps[i]);
+    }
+    key->hash = memo_hash(14695981039346656037ULL, key->data, key->len);
+}
+
+// Path of name in the cache's sub directory, or of the directory itself when
+// name is NULL. The cache is $MEMODIR, else ~/.shellv6.memo.
+int memo_path(char *buf, size_t size, const char *sub, const char *name) {
+    const char *dir = lookup_var("MEMODIR");
+    const char *home = getenv("HOME");
+    int len;
+    if (*dir != '\0') {
+        len = snprintf(buf, size, "%s/%s%s%s", dir, sub, name != NULL ? "/" : "", name != NULL ? name : "");
+    } else if (home != NULL) {
+        len = snprintf(buf, size, "%s/.shellv6.memo/%s%s%s", home, sub, name != NULL ? "/" : "", name != NULL ? name : "");
+    } else {
+        return -1;
+    }
+    return len < (int)size ? 0 : -1;
+}
+
+// Size bound of the cache from $MEMOSIZE, in bytes with an optional K, M or
+// G suffix
+off_t memo_limit() {
+    const char *value = lookup_var("MEMOSIZE");
+    char *end;
+    double size = strtod(value, &end);
+    if (end == value || size < 0) {
+        return MEMOSIZE;
+    }
+    switch (*end) {
+        case 'G': case 'g': size *= 1024;  // fall through
+        case 'M': case 'm': size *= 1024;  // fall through
+        case 'K': case 'k': size *= 1024;
+    }
+    return (off_t)size;
+}
+
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Copies the cached output for key to stdout. Returns -1 on a miss.
+int memo_serve(const struct memo_key *key, int *status) {
+    char name[32], object[64], keypath[PATH_MAX], path[PATH_MAX];
+    snprintf(name, sizeof(name), "%016llx", key->hash);
+    if (memo_path(keypath, sizeof(keypath), "keys", name) == -1) {
+        return -1;
+    }
+    // "status object\n" and then the key it was recorded for
+    int fd = open(keypath, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    }
+    char *data = NULL;
+    int found = 0;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size > key->len && st.st_size - key->len <= 96) {
+        data = malloc(st.st_size + 1);
+        if (read(fd, data, st.st_size) == st.st_size) {
+            data[st.st_size] = '\0';
+            size_t head = st.st_size - key->len;
+            found = data[head - 1] == '\n' && memcmp(data + head, key->data, key->len) == 0
+                    && sscanf(data, "%d %63s", status, object) == 2;
+        }
+    }
+    free(data);
+    close(fd);
+    if (!found) {
+        return -1;  // Another key with the same hash, or a damaged file
+    }
+    fd = -1;
+    if (memo_path(path, sizeof(path), "objects", object) == 0) {
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd == -1) {
+        unlink(keypath);  // Its output was evicted
+        return -1;
+    }
+    fflush(stdout);
+    // sendfile() copies in the kernel to a file, pipe or terminal alike
+    ssize_t n;
+    while ((n = sendfile(STDOUT_FILENO, fd, NULL, 1 << 30)) > 0) {
+        continue;
+    }
+    if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        char buf[65536];
+        while ((n = read(fd, buf, sizeof(buf))) > 0 && write_all(STDOUT_FILENO, buf, n) == 0) {
+            continue;
+        }
+    }
+    futimens(fd, NULL);  // Most recently used
+    close(fd);
+    return 0;
+}
+
+// Compares two files byte for byte
+int same_contents(const char *a, const char *b) {
+    FILE *fa = fopen(a, "re"), *fb = fopen(b, "re");
+    int same = fa != NULL && fb != NULL;
+    char ba[65536], bb[65536];
+    while (same) {
+        size_t na = fread(ba, 1, sizeof(ba), fa), nb = fread(bb, 1, sizeof(bb), fb);
+        same = na == nb && memcmp(ba, bb, na) == 0;
+        if (na < sizeof(ba)) {
+            same = same && !ferror(fa) && !ferror(fb);
+            break;
+        }
+    }
+    if (fa != NULL) {
+        fclose(fa);
+    }
+    if (fb != NULL) {
+        fclose(fb);
+    }
+    return same;
+}
+
+// Files the output in tmp under its content hash and points key at it. An
+// object of that name is shared only if it holds the same bytes; otherwise
+// the output goes under the next free name with a suffix.
+void memo_store(const struct memo_key *key, const char *tmp, unsigned long long hash, off_t size, int status) {
+    char name[64], path[PATH_MAX], keytmp[PATH_MAX], keypath[PATH_MAX];
+    for (int n = 0; ; n++) {
+        if (n > 0) {
+            snprintf(name, sizeof(name), "%016llx-%lld-%d", hash, (long long)size, n);
+        } else {
+            snprintf(name, sizeof(name), "%016llx-%lld", hash, (long long)size);
+        }
+        if (memo_path(path, sizeof(path), "objects", name) == -1) {
+            unlink(tmp);
+            return;
+        }
+        if (access(path, F_OK) != 0) {
+            if (rename(tmp, path) == -1) {
+                perror("memo: failed to store output");
+                unlink(tmp);
+                return;
+            }
+            break;
+        }
+        if (same_contents(tmp, path)) {
+            unlink(tmp);  // The same output is there already
+            utimensat(AT_FDCWD, path, NULL, 0);
+            break;
+        }
+    }
+
+    char keyname[32], tmpname[32];
+    snprintf(keyname, sizeof(keyname), "%016llx", key->hash);
+    snprintf(tmpname, sizeof(tmpname), ".tmp.%d", getpid());
+    if (memo_path(keytmp, sizeof(keytmp), "keys", tmpname) == -1 || memo_path(keypath, sizeof(keypath), "keys", keyname) == -1) {
+        return;
+    }
+    FILE *fp = fopen(keytmp, "we");
+    if (fp == NULL) {
+        return;
+    }
+    fprintf(fp, "%d %s\n", status, name);
+    fwrite(key->data, 1, key->len, fp);
+    if (fclose(fp) != 0 || rename(keytmp, keypath) == -1) {
+        unlink(keytmp);
+    }
+}
+
+// In the job started by memo_run(): runs the command with stdout on a pipe,
+// passes the output on as it arrives while writing it to a new object, and
+// records the key once the command has exited
+int memo_record(char **argv, const struct memo_key *key) {
+    int fds[2];
+    if (pipe(fds) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execvp(argv[0], argv);
+        perror("Command not found...");
+        exit_shell(1);
+    }
+    close(fds[1]);
+
+    char dir[PATH_MAX], tmp[PATH_MAX], name[32];
+    int out = -1;
+    snprintf(name, sizeof(name), ".tmp.%d", getpid());
+    if (memo_path(dir, sizeof(dir), "", NULL) == 0 && memo_path(tmp, sizeof(tmp), "objects", name) == 0) {
+        mkdir(dir, 0700);
+        memo_path(dir, sizeof(dir), "objects", NULL);
+        mkdir(dir, 0700);
+        memo_path(dir, sizeof(dir), "keys", NULL);
+        mkdir(dir, 0700);
+        out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    }
+
+    unsigned long long hash = 14695981039346656037ULL;
+    off_t size = 0;
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fds[0], buf, sizeof(buf))) != 0) {
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        write_all(STDOUT_FILENO, buf, n);
+        if (out != -1 && write_all(out, buf, n) == -1) {
+            close(out);
+            unlink(tmp);
+            out = -1;  // Still passed on, just not cached
+        }
+        hash = memo_hash(hash, buf, n);
+        size += n;
+    }
+    close(fds[0]);
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) == -1 && errno == EINTR) {
+        continue;
+    }
+    int status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    if (out != -1) {
+        // A command killed by a signal may not have printed everything
+        if (close(out) == 0 && WIFEXITED(wstatus)) {
+            memo_store(key, tmp, hash, size, status);
+        } else {
+            unlink(tmp);
+        }
+    }
+    return status;
+}
+
+// Runs the command as a foreground job that records its output under key
+int memo_run(char **argv, const struct memo_key *key) {
+    struct job j = { .cmd = join_words(argv), .foreground = 1 };
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    pid_t pid = fork_job(&j, &oldmask);
+    if (pid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        exit_shell(memo_record(argv, key));
+    }
+    int status = wait_job(&j);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+int compare_memo_object(const void *a, const void *b) {
+    const struct memo_object *x = a, *y = b;
+    if (x->used.tv_sec != y->used.tv_sec) {
+        return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+    }
+    return (x->used.tv_nsec > y->used.tv_nsec) - (x->used.tv_nsec < y->used.tv_nsec);
+}
+
+// Lists the files in the cache's sub directory. Returns the count, with
+// their total size in *total.
+int memo_scan(const char *sub, struct memo_object **objects, off_t *total) {
+    char dir[PATH_MAX];
+    int count = 0, cap = 0;
+    *objects = NULL;
+    *total = 0;
+    if (memo_path(dir, sizeof(dir), sub, NULL) == -1) {
+        return 0;
+    }
+    DIR *d = opendir(dir);
+    if (d == NULL) {
+        return 0;
+    }
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        struct stat st;
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) {
+            continue;
+        }
+        if (fstatat(dirfd(d), e->d_name, &st, 0) == -1) {
+            continue;
+        }
+        if (count == cap) {
+            cap = cap > 0 ? cap * 2 : 64;
+            *objects = realloc(*objects, sizeof(struct memo_object) * cap);
+        }
+        (*objects)[count++] = (struct memo_object){ strdup(e->d_name), st.st_size, st.st_mtim };
+        *total += st.st_size;
+    }
+    closedir(d);
+    return count;
+}
+
+void free_memo_objects(struct memo_object *objects, int count) {
+    for (int i = 0; i < count; i++) {
+        free(objects[i].name);
+    }
+    free(objects);
+}
+
+// Deletes the least recently used objects until the cache fits $MEMOSIZE,
+// then the keys that pointed at them. Partial outputs left by a memo that
+// was killed go first.
+void memo_evict() {
+    struct memo_object *objects;
+    off_t total, limit = memo_limit();
+    char path[PATH_MAX];
+    int count = memo_scan("objects", &objects, &total);
+    for (int i = 0; i < count; i++) {
+        int pid;
+        if (sscanf(objects[i].name, ".tmp.%d", &pid) == 1 && kill(pid, 0) == -1 && errno == ESRCH
+                && memo_path(path, sizeof(path), "objects", objects[i].name) == 0 && unlink(path) == 0) {
+            total -= objects[i].size;
+            objects[i].used.tv_sec = 0;  // Gone, skipped below
+        }
+    }
+    if (total <= limit) {
+        free_memo_objects(objects, count);
+        return;
+    }
+    qsort(objects, count, sizeof(struct memo_object), compare_memo_object);
+    for (int i = 0; i < count && total > limit; i++) {
+        if (objects[i].used.tv_sec != 0 && memo_path(path, sizeof(path), "objects", objects[i].name) == 0
+                && unlink(path) == 0) {
+            total -= objects[i].size;
+        }
+    }
+    free_memo_objects(objects, count);
+
+    struct memo_object *keys;
+    count = memo_scan("keys", &keys, &total);
+    for (int i = 0; i < count; i++) {
+        char object[64], objpath[PATH_MAX];
+        int status;
+        memo_path(path, sizeof(path), "keys", keys[i].name);
+        FILE *fp = fopen(path, "re");
+        if (fp == NULL) {
+            continue;
+        }
+        int ok = fscanf(fp, "%d %63s", &status, object) == 2;
+        fclose(fp);
+        if (!ok || memo_path(objpath, sizeof(objpath), "objects", object) == -1 || access(objpath, F_OK) == -1) {
+            unlink(path);
+        }
+    }
+    free_memo_objects(keys, count);
+}
+
+// memo [-d file]... [--deps file... --] [-e name]... command [args...]
+// memo -s shows what the cache holds
+int builtin_memo(char **argv) {
+    int argc = 0;
+    while (argv[argc] != NULL) {
+        argc++;
+    }
+    char **deps = malloc(sizeof(char*) * argc), **envs = malloc(sizeof(char*) * argc);
+    int ndeps = 0, nenvs = 0, stats = 0, i = 1;
+    while (argv[i] != NULL && argv[i][0] == '-') {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            stats = 1;
+            i++;
+        } else if (strcmp(argv[i], "--deps") == 0) {
+            for (i++; argv[i] != NULL && strcmp(argv[i], "--") != 0; i++) {
+                deps[ndeps++] = argv[i];
+            }
+            i += argv[i] != NULL;
+        } else if ((strcmp(argv[i], "-d") == 0 || strcmp(argv[i], "-e") == 0) && argv[i + 1] != NULL) {
+            if (argv[i][1] == 'd') {
+                deps[ndeps++] = argv[i + 1];
+            } else {
+                envs[nenvs++] = argv[i + 1];
+            }
+            i += 2;
+        } else {
+            break;
+        }
+    }
+    int status = 0;
+    if (argv[i] == NULL && stats) {
+        struct memo_object *objects, *keys;
+        off_t total, keybytes;
+        int nobjects = memo_scan("objects", &objects, &total);
+        int nkeys = memo_scan("keys", &keys, &keybytes);
+        printf("memo: %d keys, %d outputs, %lld of %lld bytes; %d hits and %d misses in this shell\n",
+               nkeys, nobjects, (long long)total, (long long)memo_limit(), memo_hits, memo_misses);
+        free_memo_objects(objects, nobjects);
+        free_memo_objects(keys, nkeys);
+    } else if (argv[i] == NULL || argv[i][0] == '-') {
+        fprintf(stderr, "memo: usage: memo [-d file]... [--deps file... --] [-e name]... command [args...]\n");
+        status = 2;
+    } else if (strchr(argv[i], '/') == NULL && (find_builtin(argv[i]) != NULL || find_function(argv[i]) != NULL)) {
+        // Their code and the shell state they read are not in the key
+        fprintf(stderr, "memo: %s: not an external command\n", argv[i]);
+        status = 2;
+    } else {
+        struct memo_key key = { NULL, 0, 0, 0 };
+        memo_key(&key, argv + i, deps, ndeps, envs, nenvs);
+        if (memo_serve(&key, &status) == 0) {
+            memo_hits++;
+        } else {
+            memo_misses++;
+            status = memo_run(argv + i, &key);
+            memo_evict();
+        }
+        free(key.data);
+    }
+    free(deps);
+    free(envs);
+    return status;
+}
+
+// Bytes of argument strings and pointers that one execve() of path with the
+// fixed words still accepts, counted as fs/exec.c does: the file name, the
+// environment and the arguments share a quarter of the stack limit, capped
+// at 6 MB and at least 128 KB, less one pointer per variable and argument.
+long exec_budget(const char *path, char **fixed) {
+    extern char **environ;
+    struct rlimit rl;
+    long limit = 6 << 20;
+    if (getrlimit(RLIMIT_STACK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur / 4 < (rlim_t)limit) {
+        limit = rl.rlim_cur / 4;
+    }
+    if (limit < 128 * 1024) {
+        limit = 128 * 1024;
+    }
+    limit -= strlen(path) + 1;
+    for (char **e = environ; *e != NULL; e++) {
+        limit -= strlen(*e) + 1 + sizeof(char*);
+    }
+    for (int i = 0; fixed[i] != NULL; i++) {
+        limit -= strlen(fixed[i]) + 1 + sizeof(char*);
+    }
+
+    // A #! script gets the interpreter, its option and the script's path in
+    // place of argv[0]
+    char head[256];
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t n = fd != -1 ? read(fd, head, sizeof(head) - 1) : -1;
+    if (fd != -1) {
+        close(fd);
+    }
+    if (n > 2 && head[0] == '#' && head[1] == '!') {
+        head[n] = '\0';
+        head[strcspn(head, "\n")] = '\0';
+        limit -= strlen(head + 2) + 1 + strlen(path) + 1 - (strlen(fixed[0]) + 1);
+    }
+    return limit;
+}
+
+// Runs one batch, waiting first for a running one if parallel are running.
+// The items are freed.
+void start_batch(const char *path, char **argv, int nfixed, int nitems, int parallel, int *running, int *status) {
+    extern char **environ;
+    while (*running >= parallel) {
+        reap_batch(running, status);
+    }
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        // Like xargs: stdin is the item list, not for the command
+        int devnull = open("/dev/null", O_RDONLY);
+        if (devnull != -1) {
+            dup2(devnull, STDIN_FILENO);
+            close(devnull);
+        }
+        argv[nfixed + nitems] = NULL;
+        execve(path, argv, environ);
+        perror(path);
+        _exit(errno == ENOENT ? 127 : 126);
+    }
+    (*running)++;
+    for (int k = nfixed; k < nfixed + nitems; k++) {
+        free(argv[k]);
+    }
+}
+
+// Waits for one batch and folds its status in the way xargs reports it:
+// 123 if a batch failed, 125 if one was killed, 126 or 127 if the command
+// could not be run
+void reap_batch(int *running, int *status) {
+    int wstatus;
+    pid_t pid;
+    while ((pid = wait(&wstatus)) == -1 && errno == EINTR) {
+        continue;
+    }
+    if (pid == -1) {
+        *running = 0;
+        return;
+    }
+    (*running)--;
+    int code = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 0;
+    if (WIFSIGNALED(wstatus)) {
+        *status = 125;
+    } else if ((code == 126 || code == 127) && *status != 125) {
+        *status = code;
+    } else if (code != 0 && *status == 0) {
+        *status = 123;
+    }
+}
+
+// In the job started by builtin_argbatch(): reads the items and runs the
+// command with as many of them as fit each execve()
+int run_batches(const char *path, char **fixed, int delim, int maxitems, int parallel, int stats) {
+    int nfixed = 0;
+    while (fixed[nfixed] != NULL) {
+        nfixed++;
+    }
+    long budget = exec_budget(path, fixed), used = 0, largest = 0;
+    long maxstr = sysconf(_SC_PAGESIZE) * 32;  // MAX_ARG_STRLEN
+    int cap = nfixed + 1024, nitems = 0, running = 0, status = 0, execs = 0;
+    long items = 0;
+    char **argv = malloc(sizeof(char*) * cap);
+    memcpy(argv, fixed, sizeof(char*) * nfixed);
+
+    // A fresh stream: stdin's buffer may hold script input read by the shell
+    FILE *in = fdopen(dup(STDIN_FILENO), "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    while (in != NULL && (len = getdelim(&line, &size, delim, in)) != -1) {
+        if (len > 0 && line[len - 1] == delim) {
+            line[--len] = '\0';
+        }
+        if (len == 0 && delim == '\n') {
+            continue;
+        }
+        long cost = len + 1 + sizeof(char*);
+        if (len + 1 > maxstr || cost > budget) {
+            fprintf(stderr, "argbatch: item too long for one command: %.40s...\n", line);
+            status = 1;
+            continue;
+        }
+        if (nitems > 0 && (used + cost > budget || nitems == maxitems)) {
+            start_batch(path, argv, nfixed, nitems, parallel, &running, &status);
+            largest = used > largest ? used : largest;
+            execs++;
+            nitems = 0;
+            used = 0;
+        }
+        if (nfixed + nitems + 1 == cap) {
+            cap *= 2;
+            argv = realloc(argv, sizeof(char*) * cap);
+        }
+        argv[nfixed + nitems++] = strndup(line, len);
+        used += cost;
+        items++;
+    }
+    if (nitems > 0) {
+        start_batch(path, argv, nfixed, nitems, parallel, &running, &status);
+        largest = used > largest ? used : largest;
+        execs++;
+    }
+    while (running > 0) {
+        reap_batch(&running, &status);
+    }
+    if (stats) {
+        fprintf(stderr, "argbatch: %ld items in %d execs, %ld saved; largest batch %ld of %ld bytes\n",
+                items, execs, items - execs > 0 ? items - execs : 0, largest, budget);
+    }
+    if (in != NULL) {
+        fclose(in);
+    }
+    free(line);
+    free(argv);
+    return status;
+}
+
+// argbatch [-0] [-n MAX] [-P N] [-s] command [args...]
+// Reads items from stdin, one per line or NUL-terminated with -0, and runs
+// the command with as many of them after args as one execve() takes, at most
+// MAX, with up to N commands at a time. -s reports the execs saved.
+int builtin_argbatch(char **argv) {
+    int delim = '\n', maxitems = 0, parallel = 1, stats = 0, i = 1;
+    while (argv[i] != NULL && argv[i][0] == '-') {
+        if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else if (strcmp(argv[i], "-0") == 0) {
+            delim = '\0';
+            i++;
+        } else if (strcmp(argv[i], "-s") == 0) {
+            stats = 1;
+            i++;
+        } else if ((strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "-P") == 0) && argv[i + 1] != NULL) {
+            *(argv[i][1] == 'n' ? &maxitems : &parallel) = atoi(argv[i + 1]);
+            i += 2;
+        } else {
+            break;
+        }
+    }
+    if (argv[i] == NULL || argv[i][0] == '-' || maxitems < 0 || parallel < 1) {
+        fprintf(stderr, "argbatch: usage: argbatch [-0] [-n MAX] [-P N] [-s] command [args...]\n");
+        return 2;
+    }
+    char path[PATH_MAX];
+    if (find_program(argv[i], path, sizeof(path)) == -1) {
+        fprintf(stderr, "argbatch: %s: not an external command\n", argv[i]);
+        return 127;
+    }
+    if (exec_budget(path, argv + i) <= 0) {
+        fprintf(stderr, "argbatch: no room for arguments\n");
+        return 1;
+    }
+
+    struct job j = { .cmd = join_words(argv), .foreground = 1 };
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    pid_t pid = fork_job(&j, &oldmask);
+    if (pid == -1) {
+        perror("fork failed");
+        exit(1);
+    }
+    if (pid == 0) {
+        exit_shell(run_batches(path, argv + i, delim, maxitems, parallel, stats));
+    }
+    int status = wait_job(&j);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    return status;
+}
+
+int builtin_help(char **argv) {
+    help();
+    return 0;
+}
+
+struct builtin builtins[] = {
+    { "cd", builtin_cd },
+    { "exit", builtin_exit },
+    { "jobs", builtin_jobs },
+    { "kill", builtin_kill },
+    { "ulimit", builtin_ulimit },
+    { "fg", builtin_fg },
+    { "bg", builtin_bg },
+    { "set", builtin_set },
+    { "export", builtin_export },
+    { "unset", builtin_unset },
+    { "alias", builtin_alias },
+    { "unalias", builtin_unalias },
+    { "printenv", builtin_printenv },
+    { "parsecache", builtin_parsecache },
+    { "memo", builtin_memo },
+    { "argbatch", builtin_argbatch },
+    { "help", builtin_help },
+    { "return", builtin_return },
+    { "break", builtin_break },
+    { "continue", builtin_break },
+    { "local", builtin_local },
+    { "true", builtin_true },
+    { ":", builtin_true },
+    { "false", builtin_false },
+    { NULL, NULL }
+};
+
+struct builtin* find_builtin(const char *name) {
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        if (strcmp(builtins[i].name, name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+struct prompt_segment prompt_segments[] = {
+    { 'g', { "git", "--no-optional-locks", "status", "--porcelain=v2", "--branch", "--untracked-files=no", NULL },
+      parse_git_status },
+    { '\0', { NULL }, NULL }
+};
+
+// Builds the prompt from $PS1, or user@cwd$ when it is unset. Escapes:
+// \u user, \h host, \w directory (~ for $HOME), \W its last part, \$ # for
+// root else $, \\ a backslash, \D how long the last command took and the
+// asynchronous segments in prompt_segments, such as \g. Those show the last
+// value computed for this directory while a worker computes a fresh one;
+// edit_line() repaints the prompt when it arrives. The prompt is kept until
+// the next call.
+const char* build_prompt() {
+    struct passwd *pw = getpwuid(getuid());
+    const char *username = pw ? pw->pw_name : "unknown";
+    const char *ps1 = lookup_var("PS1");
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "?");
+    }
+    free(prompt_text);
+    if (*ps1 == '\0') {
+        size_t size = strlen(username) + strlen(cwd) + 4;
+        prompt_text = malloc(size);
+        snprintf(prompt_text, size, "%s@%s$ ", username, cwd);
+        return prompt_text;
+    }
+
+    size_t len = 0, cap = 64;
+    char *out = malloc(cap);
+    for (const char *cp = ps1; *cp != '\0'; cp++) {
+        char text[PATH_MAX];
+        const char *piece = text;
+        text[0] = '\0';
+        if (*cp != '\\' || cp[1] == '\0') {
+            append_char(&out, &len, &cap, *cp);
+            continue;
+        }
+        cp++;
+        int segment = find_segment(*cp);
+        if (segment != -1) {
+            struct segment_result *r = segment_result(segment, cwd);
+            piece = r != NULL ? r->value : "";
+        } else if (*cp == 'u') {
+            piece = username;
+        } else if (*cp == 'h') {
+            gethostname(text, sizeof(text));
+            text[sizeof(text) - 1] = '\0';
+            text[strcspn(text, ".")] = '\0';
+        } else if (*cp == 'w' || *cp == 'W') {
+            const char *home = getenv("HOME");
+            size_t n = home != NULL ? strlen(home) : 0;
+            if (*cp == 'W') {
+                piece = strrchr(cwd, '/') != NULL && cwd[1] != '\0' ? strrchr(cwd, '/') + 1 : cwd;
+            } else if (n > 1 && strncmp(cwd, home, n) == 0 && (cwd[n] == '/' || cwd[n] == '\0')) {
+                snprintf(text, sizeof(text), "~%s", cwd + n);
+            } else {
+                piece = cwd;
+            }
+        } else if (*cp == '$') {
+            piece = getuid() == 0 ? "#" : "$";
+        } else if (*cp == 'D') {
+            format_duration(last_duration_ms, text, sizeof(text));
+        } else {
+            snprintf(text, sizeof(text), *cp == '\\' ? "\\" : "\\%c", *cp);  // Unknown escapes stay
+        }
+        for (const char *c = piece; *c != '\0'; c++) {
+            append_char(&out, &len, &cap, *c);
+        }
+    }
+    out[len] = '\0';
+    prompt_text = out;
+    return prompt_text;
+}
+
+// How long the last command took: 12ms, 1.52s or 2m03s; nothing before the
+// first command
+void format_duration(double ms, char *buf, size_t size) {
+    if (ms < 0) {
+        buf[0] = '\0';
+    } else if (ms < 1000) {
+        snprintf(buf, size, "%.0fms", ms);
+    } else if (ms < 60000) {
+        snprintf(buf, size, "%.2fs", ms / 1000);
+    } else {
+        long s = (long)(ms / 1000);
+        snprintf(buf, size, "%ldm%02lds", s / 60, s % 60);
+    }
+}
+
+int find_segment(char escape) {
+    for (int i = 0; prompt_segments[i].escape != '\0'; i++) {
+        if (prompt_segments[i].escape == escape) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The cached result of segment for dir, creating it in the least recently
+// used free slot. Starts a worker unless the value is from after the last
+// command or one is running. NULL if every slot has a worker.
+struct segment_result* segment_result(int segment, const char *dir) {
+    struct segment_result *r = NULL, *lru = NULL;
+    for (int i = 0; i < PROMPTCACHE; i++) {
+        struct segment_result *e = &segment_cache[i];
+        if (e->dir != NULL && e->segment == segment && strcmp(e->dir, dir) == 0) {
+            r = e;
+            break;
+        }
+        if (!e->running && (lru == NULL || e->used < lru->used)) {
+            lru = e;
+        }
+    }
+    if (r == NULL) {
+        if (lru == NULL) {
+            return NULL;
+        }
+        r = lru;
+        free(r->dir);
+        r->dir = strdup(dir);
+        r->segment = segment;
+        r->value[0] = '\0';
+        r->serial = (unsigned long)-1;
+    }
+    r->used = ++segment_clock;
+    if (r->serial != commands_run && !r->running && job_control) {
+        start_segment(r);
+    }
+    return r;
+}
+
+// Runs the segment's command in the background with its output on a pipe
+// read by read_segments()
+void start_segment(struct segment_result *r) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        return;
+    }
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    pid_t pid = fork_child(&oldmask);
+    if (pid == 0) {
+        // Out of the terminal's way: no signals from it, no reading it
+        setpgid(0, 0);
+        int devnull = open("/dev/null", O_RDWR);
+        dup2(devnull, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(devnull, STDERR_FILENO);
+        if (chdir(r->dir) == 0) {
+            execvp(prompt_segments[r->segment].argv[0], prompt_segments[r->segment].argv);
+        }
+        _exit(127);
+    }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+    close(fds[1]);
+    if (pid == -1) {
+        close(fds[0]);
+        return;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    r->fd = fds[0];
+    r->running = 1;
+    r->started = commands_run;
+    r->len = 0;
+    r->truncated = 0;
+}
+
+// Adds the pipes of running segment workers to fds. Returns how many.
+int segment_fds(struct pollfd *fds) {
+    int n = 0;
+    for (int i = 0; i < PROMPTCACHE; i++) {
+        if (segment_cache[i].running) {
+            fds[n++] = (struct pollfd){ segment_cache[i].fd, POLLIN, 0 };
+        }
+    }
+    return n;
+}
+
+// Reads what the workers have written. When one finishes, its output is
+// parsed into the segment's value. Returns how many values changed.
+int read_segments() {
+    int changed = 0;
+    for (int i = 0; i < PROMPTCACHE; i++) {
+        struct segment_result *r = &segment_cache[i];
+        char buf[4096];
+        ssize_t n = -1;
+        while (r->running && (n = read(r->fd, buf, sizeof(buf))) != 0) {
+            if (n == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;  // EAGAIN, more later
+            }
+            size_t keep = (size_t)n < sizeof(r->out) - r->len ? (size_t)n : sizeof(r->out) - r->len;
+            memcpy(r->out + r->len, buf, keep);
+            r->len += keep;
+            r->truncated |= keep < (size_t)n;
+        }
+        if (!r->running || n != 0) {
+            continue;
+        }
+        close(r->fd);
+        r->running = 0;
+        char value[sizeof(r->value)];
+        prompt_segments[r->segment].parse(r->out, r->len, r->truncated, value, sizeof(value));
+        if (strcmp(value, r->value) != 0) {
+            strcpy(r->value, value);
+            changed++;
+        }
+        r->serial = r->started;
+        if (r->serial != commands_run) {
+            start_segment(r);  // A command ran meanwhile; this may be stale
+        }
+    }
+    return changed;
+}
+
+// \g: "branch" or "branch*" with uncommitted changes to tracked files, from
+// git status --porcelain=v2 --branch. Empty outside a repository.
+void parse_git_status(const char *out, size_t len, int truncated, char *value, size_t size) {
+    char head[128] = "", oid[16] = "";
+    int dirty = truncated;
+    const char *end = out + len;
+    for (const char *line = out; line < end; ) {
+        const char *nl = memchr(line, '\n', end - line);
+        int n = (nl != NULL ? nl : end) - line;
+        if (n > 14 && strncmp(line, "# branch.head ", 14) == 0) {
+            snprintf(head, sizeof(head), "%.*s", n - 14, line + 14);
+        } else if (n > 13 && strncmp(line, "# branch.oid ", 13) == 0) {
+            snprintf(oid, sizeof(oid), "%.*s", n - 13 < 7 ? n - 13 : 7, line + 13);
+        } else if (n > 0 && line[0] != '#') {
+            dirty = 1;
+        }
+        line += n + 1;
+    }
+    if (strcmp(head, "(detached)") == 0) {
+        snprintf(head, sizeof(head), "%s", oid);
+    }
+    snprintf(value, size, "%s%s", head, head[0] != '\0' && dirty ? "*" : "");
+}
+
+char* read_cmd(const char *prompt) {
+    if (job_control && isatty(STDOUT_FILENO)) {
+        return edit_line(prompt);
+    }
+    printf("%s", prompt);
+    fflush(stdout);
+    char* cmdline = NULL;
+    size_t size = 0;
+    if (getline(&cmdline, &size, stdin) == -1) {
+        free(cmdline);
+        return NULL;
+    }
+
+    // Remove the newline character at the end, if present
+    int length = strlen(cmdline);
+    if (length > 0 && cmdline[length - 1] == '\n') {
+        cmdline[length - 1] = '\0';
+    }
+
+    return cmdline;
+}
+
+// Reads a line from the terminal in raw mode with simple editing: left and
+// right arrows, Home/End or Ctrl-A/Ctrl-E, backspace, Delete, Ctrl-U to clear,
+// Ctrl-C to drop the line, Ctrl-D on an empty line for end of input and Tab
+// to complete. Returns NULL at end of input.
+char* edit_line(const char *prompt) {
+    struct termios saved, raw;
+    tcgetattr(STDIN_FILENO, &saved);
+    raw = saved;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &raw);
+
+    struct line_edit ed = { malloc(64), 0, 64, 0 };
+    ed.buf[0] = '\0';
+    int tabs = 0;  // Tabs in a row: the second lists the matches
+    printf("%s", prompt);
+    fflush(stdout);
+
+    while (1) {
+        // Background job output shows up above the line being edited, and
+        // the prompt is repainted as its segments come in
+        while (1) {
+            struct pollfd fds[2 + PROMPTCACHE] = { { STDIN_FILENO, POLLIN, 0 } };
+            int nfds = 1, mux = outputs_active();
+            if (mux) {
+                fds[nfds++] = (struct pollfd){ output_epoll, POLLIN, 0 };
+            }
+            if (prompt == prompt_text) {
+                nfds += segment_fds(fds + nfds);
+            }
+            if (nfds == 1 || (poll(fds, nfds, -1) == -1 && errno != EINTR) || fds[0].revents != 0) {
+                break;
+            }
+            if (mux && (fds[1].revents & POLLIN)) {
+                output_clear_line = 1;
+                if (drain_outputs() > 0) {
+                    refresh_line(&ed, prompt);
+                }
+                output_clear_line = 0;
+            }
+            if (prompt == prompt_text && read_segments() > 0) {
+                prompt = build_prompt();
+                refresh_line(&ed, prompt);
+            }
+        }
+        unsigned char c;
+        ssize_t n = read(STDIN_FILENO, &c, 1);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0 || (c == 4 && ed.len == 0)) {  // Ctrl-D
+            free(ed.buf);
+            ed.buf = NULL;
+            break;
+        }
+        tabs = c == '\t' ? tabs + 1 : 0;
+        if (c == '\r' || c == '\n') {
+            printf("\n");
+            break;
+        } else if (c == 3) {  // Ctrl-C
+            printf("^C\n");
+            ed.len = ed.pos = 0;
+            break;
+        } else if (c == '\t') {
+            complete_line(&ed, tabs);
+        } else if (c == 127 || c == 8) {
+            if (ed.pos > 0) {
+                memmove(ed.buf + ed.pos - 1, ed.buf + ed.pos, ed.len - ed.pos);
+                ed.pos--;
+                ed.len--;
+            }
+        } else if (c == 4) {  // Ctrl-D inside a line deletes
+            if (ed.pos < ed.len) {
+                memmove(ed.buf + ed.pos, ed.buf + ed.pos + 1, ed.len - ed.pos - 1);
+                ed.len--;
+            }
+        } else if (c == 1) {
+            ed.pos = 0;
+        } else if (c == 5) {
+            ed.pos = ed.len;
+        } else if (c == 21) {  // Ctrl-U
+            ed.len = ed.pos = 0;
+        } else if (c == 27) {
+            // Escape sequences: ESC [ C/D/H/F and ESC [ 3 ~
+            unsigned char seq[3];
+            if (read(STDIN_FILENO, seq, 1) != 1 || seq[0] != '[' || read(STDIN_FILENO, seq + 1, 1) != 1) {
+                continue;
+            }
+            if (seq[1] == 'C' && ed.pos < ed.len) {
+                ed.pos++;
+            } else if (seq[1] == 'D' && ed.pos > 0) {
+                ed.pos--;
+            } else if (seq[1] == 'H') {
+                ed.pos = 0;
+            } else if (seq[1] == 'F') {
+                ed.pos = ed.len;
+            } else if (seq[1] == '3' && read(STDIN_FILENO, seq + 2, 1) == 1 && seq[2] == '~' && ed.pos < ed.len) {
+                memmove(ed.buf + ed.pos, ed.buf + ed.pos + 1, ed.len - ed.pos - 1);
+                ed.len--;
+            }
+        } else if (c >= 32) {
+            char s[2] = { c, '\0' };
+            line_insert(&ed, s);
+            if (ed.pos == ed.len) {
+                fwrite(s, 1, 1, stdout);  // Typing at the end needs no redraw
+                fflush(stdout);
+                continue;
+            }
+        }
+        refresh_line(&ed, prompt);
+    }
+
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &saved);
+    fflush(stdout);
+    if (ed.buf != NULL) {
+        ed.buf[ed.len] = '\0';
+    }
+    return ed.buf;
+}
+
+// Redraws the prompt and the line and puts the cursor back in place
+void refresh_line(struct line_edit *ed, const char *prompt) {
+    printf("\r%s", prompt);
+    fwrite(ed->buf, 1, ed->len, stdout);
+    printf("\x1b[K");
+    if (ed->pos < ed->len) {
+        printf("\x1b[%zuD", ed->len - ed->pos);
+    }
+    fflush(stdout);
+}
+
+// Inserts text at the cursor
+void line_insert(struct line_edit *ed, const char *text) {
+    size_t n = strlen(text);
+    if (ed->len + n + 1 > ed->cap) {
+        while (ed->len + n + 1 > ed->cap) {
+            ed->cap *= 2;
+        }
+        ed->buf = realloc(ed->buf, ed->cap);
+    }
+    memmove(ed->buf + ed->pos + n, ed->buf + ed->pos, ed->len - ed->pos);
+    memcpy(ed->buf + ed->pos, text, n);
+    ed->pos += n;
+    ed->len += n;
+}
+
+// Completes the word before the cursor: a command name in command position,
+// a variable after '$', otherwise a path. A unique match is inserted whole,
+// several are extended to their common prefix and listed on a second Tab.
+void complete_line(struct line_edit *ed, int tabs) {
+    size_t start = ed->pos;
+    while (start > 0 && strchr(" \t|;&<>()", ed->buf[start - 1]) == NULL) {
+        start--;
+    }
+    size_t k = start;
+    while (k > 0 && (ed->buf[k - 1] == ' ' || ed->buf[k - 1] == '\t')) {
+        k--;
+    }
+    int command = k == 0 || strchr("|;&({", ed->buf[k - 1]) != NULL;
+    char *word = strndup(ed->buf + start, ed->pos - start);
+
+    struct wordlist wl = { NULL, 0, 0 };
+    wordlist_add(&wl, NULL);
+    wl.count = 0;
+    if (word[0] == '$') {
+        complete_variables(word + 1, &wl);
+    } else if (command && strchr(word, '/') == NULL) {
+        complete_commands(word, &wl);
+    } else {
+        complete_files(word, command, &wl);
+    }
+
+    // Sorted and without duplicates, e.g. a builtin that is also on PATH
+    int count = 0;
+    if (wl.count > 0) {
+        qsort(wl.words, wl.count, sizeof(char*), compare_strings);
+        for (int i = 0; i < wl.count; i++) {
+            if (count > 0 && strcmp(wl.words[count - 1], wl.words[i]) == 0) {
+                free(wl.words[i]);
+            } else {
+                wl.words[count++] = wl.words[i];
+            }
+        }
+    }
+
+    size_t wlen = strlen(word);
+    if (count == 0) {
+        printf("\a");
+    } else if (count == 1) {
+        const char *match = wl.words[0];
+        size_t mlen = strlen(match);
+        char *rest = complete_quote(match + wlen);
+        line_insert(ed, rest);
+        if (match[mlen - 1] != '/') {
+            line_insert(ed, " ");
+        }
+        free(rest);
+    } else {
+        size_t common = strlen(wl.words[0]);
+        for (int i = 1; i < count; i++) {
+            size_t m = 0;
+            while (m < common && wl.words[i][m] == wl.words[0][m]) {
+                m++;
+            }
+            common = m;
+        }
+        if (common > wlen) {
+            char *prefix = strndup(wl.words[0] + wlen, common - wlen);
+            char *rest = complete_quote(prefix);
+            line_insert(ed, rest);
+            free(prefix);
+            free(rest);
+        } else if (tabs >= 2) {
+            // List the names without the directory part typed so far
+            const char *slash = strrchr(word, '/');
+            size_t skip = slash != NULL && word[0] != '$' ? (size_t)(slash - word + 1) : 0;
+            printf("\n");
+            for (int i = 0; i < count; i++) {
+                printf("%s%s", wl.words[i] + skip, i + 1 < count ? "  " : "\n");
+            }
+        } else {
+            printf("\a");
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        free(wl.words[i]);
+    }
+    free(wl.words);
+    free(word);
+}
+
+// Completed text with the characters the tokenizer treats specially escaped
+char* complete_quote(const char *text) {
+    char *out = malloc(strlen(text) * 2 + 1), *o = out;
+    for (const char *c = text; *c != '\0'; c++) {
+        if (strchr(" \t\\'\"|;&<>()$*?[`", *c) != NULL) {
+            *o++ = '\\';
+        }
+        *o++ = *c;
+    }
+    *o = '\0';
+    return out;
+}
+
+void complete_variables(const char *prefix, struct wordlist *wl) {
+    size_t n = strlen(prefix);
+    extern char **environ;
+    for (int i = 0; i < var_count; i++) {
+        const char *eq = strchr(var_table[i].str, '=');
+        if (eq != NULL && strncmp(var_table[i].str, prefix, n) == 0 && (size_t)(eq - var_table[i].str) >= n) {
+            char *name = malloc(eq - var_table[i].str + 2);
+            snprintf(name, eq - var_table[i].str + 2, "$%s", var_table[i].str);
+            wordlist_add(wl, name);
+        }
+    }
+    for (char **env = environ; *env != NULL; env++) {
+        const char *eq = strchr(*env, '=');
+        if (eq != NULL && strncmp(*env, prefix, n) == 0 && (size_t)(eq - *env) >= n) {
+            char *name = malloc(eq - *env + 2);
+            snprintf(name, eq - *env + 2, "$%s", *env);
+            wordlist_add(wl, name);
+        }
+    }
+}
+
+void complete_commands(const char *prefix, struct wordlist *wl) {
+    size_t n = strlen(prefix);
+    for (int i = 0; builtins[i].name != NULL; i++) {
+        if (strncmp(builtins[i].name, prefix, n) == 0) {
+            wordlist_add(wl, strdup(builtins[i].name));
+        }
+    }
+    for (int i = 0; i < func_count; i++) {
+        if (strncmp(func_table[i].name, prefix, n) == 0) {
+            wordlist_add(wl, strdup(func_table[i].name));
+        }
+    }
+    for (int i = 0; i < ALIASHASH; i++) {
+        for (struct alias *a = alias_table[i]; a != NULL; a = a->next) {
+            if (strncmp(a->name, prefix, n) == 0) {
+                wordlist_add(wl, strdup(a->name));
+            }
+        }
+    }
+    load_command_index();
+    for (int i = index_lookup(prefix); i < exe_count && strncmp(exe_index[i].name, prefix, n) == 0; i++) {
+        wordlist_add(wl, strdup(exe_index[i].name));
+    }
+}
+
+// Paths starting with word; directories get a trailing '/'. In command
+// position only directories and executables are offered.
+void complete_files(const char *word, int command, struct wordlist *wl) {
+    const char *slash = strrchr(word, '/');
+    size_t dirlen = slash != NULL ? (size_t)(slash - word + 1) : 0;
+    char *dir = dirlen > 0 ? strndup(word, dirlen) : strdup(".");
+    const char *base = word + dirlen;
+    size_t n = strlen(base);
+
+    DIR *d = opendir(dir);
+    struct dirent *e;
+    while (d != NULL && (e = readdir(d)) != NULL) {
+        if (strncmp(e->d_name, base, n) != 0 || strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0
+                || (e->d_name[0] == '.' && base[0] != '.')) {
+            continue;
+        }
+        struct stat st;
+        int is_dir = fstatat(dirfd(d), e->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode);
+        if (command && !is_dir && faccessat(dirfd(d), e->d_name, X_OK, 0) != 0) {
+            continue;
+        }
+        size_t size = dirlen + strlen(e->d_name) + 2;
+        char *path = malloc(size);
+        snprintf(path, size, "%.*s%s%s", (int)dirlen, word, e->d_name, is_dir ? "/" : "");
+        wordlist_add(wl, path);
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    free(dir);
+}
+
+// Command index. A child process started at launch lists the executables
+// of every PATH directory into a pipe while the shell goes on; the list is
+// read, sorted and merged the first time it is needed. inotify watches on
+// the directories then keep it current: pending events are applied before
+// each lookup, and the index is rebuilt if PATH changes or events are lost.
+void start_command_index() {
+    for (int i = 0; i < exe_count; i++) {
+        free(exe_index[i].name);
+    }
+    exe_count = 0;
+    if (index_pipe != -1) {
+        close(index_pipe);
+        index_pipe = -1;
+    }
+    if (inotify_fd != -1) {
+        close(inotify_fd);  // Drops its watches
+    }
+    for (int i = 0; i < path_ndirs; i++) {
+        free(path_dirs[i]);
+    }
+    path_ndirs = 0;
+    free(index_path);
+    index_path = strdup(lookup_var("PATH"));
+
+    // Watches go in before the scan so no change falls between the two
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    char *copy = strdup(index_path), *save;
+    for (char *dir = strtok_r(copy, ":", &save); dir != NULL && path_ndirs < MAXPATHDIRS; dir = strtok_r(NULL, ":", &save)) {
+        path_dirs[path_ndirs] = strdup(dir);
+        path_watch[path_ndirs] = inotify_fd == -1 ? -1 : inotify_add_watch(inotify_fd, dir,
+                IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR);
+        path_ndirs++;
+    }
+    free(copy);
+    if (adopt_snap_index()) {
+        return;
+    }
+
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        index_pipe = -1;
+        return;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        FILE *out = fdopen(fds[1], "w");
+        for (int i = 0; i < path_ndirs; i++) {
+            DIR *d = opendir(path_dirs[i]);
+            struct dirent *e;
+            while (d != NULL && (e = readdir(d)) != NULL) {
+                if (e->d_name[0] != '.' && is_executable(dirfd(d), e->d_name)) {
+                    fprintf(out, "%d %s\n", i, e->d_name);
+                }
+            }
+            if (d != NULL) {
+                closedir(d);
+            }
+        }
+        fclose(out);
+        _exit(0);
+    }
+    close(fds[1]);
+    index_pipe = pid == -1 ? (close(fds[0]), -1) : fds[0];
+}
+
+// Regular file (or symlink to one) the user may execute
+int is_executable(int dirfd, const char *name) {
+    struct stat st;
+    return fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode) && faccessat(dirfd, name, X_OK, 0) == 0;
+}
+
+// Collects the background scan if it is still pending, then applies the
+// inotify events queued since the last lookup.
+void load_command_index() {
+    if (index_path == NULL || strcmp(index_path, lookup_var("PATH")) != 0) {
+        start_command_index();
+    }
+    if (index_pipe != -1) {
+        FILE *in = fdopen(index_pipe, "r");
+        char *line = NULL;
+        size_t size = 0;
+        ssize_t n;
+        while ((n = getline(&line, &size, in)) > 0) {
+            char *name = strchr(line, ' ');
+            if (name == NULL) {
+                continue;
+            }
+            line[n - 1] = '\0';
+            if (exe_count == exe_cap) {
+                exe_cap = exe_cap > 0 ? exe_cap * 2 : 1024;
+                exe_index = realloc(exe_index, sizeof(struct exe_entry) * exe_cap);
+            }
+            exe_index[exe_count++] = (struct exe_entry){ strdup(name + 1), 1ULL << atoi(line) };
+        }
+        free(line);
+        fclose(in);
+        index_pipe = -1;
+
+        qsort(exe_index, exe_count, sizeof(struct exe_entry), compare_exe);
+        int merged = 0;
+        for (int i = 0; i < exe_count; i++) {
+            if (merged > 0 && strcmp(exe_index[merged - 1].name, exe_index[i].name) == 0) {
+                exe_index[merged - 1].dirs |= exe_index[i].dirs;
+                free(exe_index[i].name);
+            } else {
+                exe_index[merged++] = exe_index[i];
+            }
+        }
+        exe_count = merged;
+    }
+
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t got;
+    while (inotify_fd != -1 && (got = read(inotify_fd, events, sizeof(events))) > 0) {
+        for (char *p = events; p < events + got; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            struct inotify_event *ev = (struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                start_command_index();
+                load_command_index();
+                return;
+            }
+            int dir = 0;
+            while (dir < path_ndirs && path_watch[dir] != ev->wd) {
+                dir++;
+            }
+            if (dir == path_ndirs || ev->len == 0 || ev->name[0] == '.') {
+                continue;
+            }
+            int exists = 0;
+            if (ev->mask & (IN_CREATE | IN_MOVED_TO | IN_ATTRIB)) {
+                int fd = open(path_dirs[dir], O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                exists = fd != -1 && is_executable(fd, ev->name);
+                if (fd != -1) {
+                    close(fd);
+                }
+            }
+            index_update(ev->name, dir, exists);
+        }
+    }
+}
+
+int compare_exe(const void *a, const void *b) {
+    return strcmp(((const struct exe_entry *)a)->name, ((const struct exe_entry *)b)->name);
+}
+
+// First entry not less than prefix, by binary search
+int index_lookup(const char *prefix) {
+    int lo = 0, hi = exe_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (strcmp(exe_index[mid].name, prefix) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+// Records that PATH directory dir now has, or no longer has, executable name
+void index_update(const char *name, int dir, int exists) {
+    int i = index_lookup(name);
+    int found = i < exe_count && strcmp(exe_index[i].name, name) == 0;
+    if (exists && !found) {
+        if (exe_count == exe_cap) {
+            exe_cap = exe_cap > 0 ? exe_cap * 2 : 1024;
+            exe_index = realloc(exe_index, sizeof(struct exe_entry) * exe_cap);
+        }
+        memmove(exe_index + i + 1, exe_index + i, sizeof(struct exe_entry) * (exe_count - i));
+        exe_index[i] = (struct exe_entry){ strdup(name), 1ULL << dir };
+        exe_count++;
+    } else if (exists) {
+        exe_index[i].dirs |= 1ULL << dir;
+    } else if (found && (exe_index[i].dirs &= ~(1ULL << dir)) == 0) {
+        free(exe_index[i].name);
+        memmove(exe_index + i, exe_index + i + 1, sizeof(struct exe_entry) * (exe_count - i - 1));
+        exe_count--;
+    }
+}
+
+// Startup files. /etc/shellv6rc and then ~/.shellv6rc are run when the shell
+// starts. The state they leave behind (variables, functions, aliases and the
+// PATH command index) is saved to ~/.shellv6.snap; later shells map that file and
+// load the state from it instead of parsing and running the rc files again.
+// The snapshot is rebuilt when an rc file is added, removed or changes size
+// or mtime, and it is ignored if it was written by a different build.
+void load_rc_files() {
+    const char *home = getenv("HOME");
+    char user_rc[PATH_MAX], snap[PATH_MAX];
+    struct rc_file rcs[2];
+    int nrc = 0;
+
+    rcs[nrc++].path = "/etc/shellv6rc";
+    if (home != NULL) {
+        snprintf(user_rc, sizeof(user_rc), "%s/.shellv6rc", home);
+        snprintf(snap, sizeof(snap), "%s/.shellv6.snap", home);
+        rcs[nrc++].path = user_rc;
+    }
+    int found = 0;
+    for (int i = 0; i < nrc; i++) {
+        rcs[i].exists = stat(rcs[i].path, &rcs[i].st) == 0;
+        found |= rcs[i].exists;
+    }
+    if (!found) {
+        return;
+    }
+    if (home != NULL && load_snapshot(snap, rcs, nrc) == 0) {
+        // The state is still exactly what the rc files left, so an
+        // interactive shell can replace a PATH index that went stale
+        if (job_control && !snap_index_current()) {
+            save_snapshot(snap, rcs, nrc);
+        }
+        return;
+    }
+
+    for (int i = 0; i < nrc; i++) {
+        if (rcs[i].exists) {
+            source_file(rcs[i].path);
+        }
+    }
+    if (home != NULL) {
+        save_snapshot(snap, rcs, nrc);
+    }
+}
+
+// Parses a whole file as one command list and runs it
+int source_file(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        if (fd != -1) {
+            close(fd);
+        }
+        return 1;
+    }
+    char *text = malloc(st.st_size + 1);
+    ssize_t n = read(fd, text, st.st_size);
+    close(fd);
+    text[n > 0 ? n : 0] = '\0';
+
+    int incomplete, status = 0;
+    struct node *tree = parse_line(text, &incomplete);
+    if (incomplete) {
+        fprintf(stderr, "%s: syntax error: unexpected end of file\n", path);
+    } else if (tree != NULL) {
+        status = run_tree(tree);
+    }
+    free(text);
+    return status;
+}
+
+// Snapshot writer: a growing buffer of native-endian fields
+void snap_put(struct snap_buf *b, const void *data, size_t n) {
+    if (b->len + n > b->cap) {
+        while (b->len + n > b->cap) {
+            b->cap = b->cap > 0 ? b->cap * 2 : 4096;
+        }
+        b->data = realloc(b->data, b->cap);
+    }
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+void snap_put_int(struct snap_buf *b, long long v) {
+    snap_put(b, &v, sizeof(v));
+}
+
+// A string as its length and bytes; -1 for NULL
+void snap_put_str(struct snap_buf *b, const char *s) {
+    snap_put_int(b, s != NULL ? (long long)strlen(s) : -1);
+    if (s != NULL) {
+        snap_put(b, s, strlen(s));
+    }
+}
+
+void snap_put_words(struct snap_buf *b, char **words, int count) {
+    snap_put_int(b, words != NULL ? count : -1);
+    for (int i = 0; words != NULL && i < count; i++) {
+        snap_put_str(b, words[i]);
+    }
+}
+
+// A syntax tree, depth first. Reference counts are not kept: a loaded
+// function body starts unshared.
+void snap_put_node(struct snap_buf *b, struct node *n) {
+    snap_put_int(b, n != NULL);
+    if (n == NULL) {
+        return;
+    }
+    snap_put_int(b, n->type);
+    snap_put_int(b, n->argc);
+    int nwords = 0;
+    while (n->argv != NULL && n->argv[nwords] != NULL) {
+        nwords++;
+    }
+    snap_put_words(b, n->argv, nwords);
+    int nredirs = 0;
+    for (struct redir *r = n->redirs; r != NULL; r = r->next) {
+        nredirs++;
+    }
+    snap_put_int(b, nredirs);
+    for (struct redir *r = n->redirs; r != NULL; r = r->next) {
+        snap_put_int(b, r->type);
+        snap_put_int(b, r->fd);
+        snap_put_str(b, r->target);
+        snap_put_int(b, r->literal);
+    }
+    snap_put_node(b, n->left);
+    snap_put_node(b, n->right);
+    snap_put_node(b, n->alt);
+    snap_put_int(b, n->nstages);
+    for (int i = 0; i < n->nstages; i++) {
+        snap_put_node(b, n->stages[i]);
+    }
+    snap_put_str(b, n->text);
+    snap_put_int(b, n->prog != NULL);
+    if (n->prog != NULL) {
+        struct program *pr = n->prog;
+        snap_put_int(b, pr->ncode);
+        for (int i = 0; i < pr->ncode; i++) {
+            snap_put_int(b, pr->code[i].op);
+            snap_put_int(b, pr->code[i].arg);
+            snap_put_int(b, pr->code[i].count);
+            snap_put_int(b, pr->code[i].target);
+        }
+        snap_put_int(b, pr->nnodes);
+        for (int i = 0; i < pr->nnodes; i++) {
+            snap_put_node(b, pr->nodes[i]);
+        }
+        snap_put_words(b, pr->words, pr->nwords);
+        snap_put_int(b, pr->max_depth);
+    }
+}
+
+// Snapshot reader over the mapped file. Any read past the end marks the
+// snapshot bad and returns zeroes, so a damaged file is simply rejected.
+long long snap_get_int(struct snap_reader *r) {
+    long long v = 0;
+    if (r->end - r->pos < (ptrdiff_t)sizeof(v)) {
+        r->bad = 1;
+        return 0;
+    }
+    memcpy(&v, r->pos, sizeof(v));
+    r->pos += sizeof(v);
+    return v;
+}
+
+// Reads a count and rejects ones that cannot fit in the rest of the file
+int snap_get_count(struct snap_reader *r) {
+    long long n = snap_get_int(r);
+    if (n < -1 || n > r->end - r->pos) {
+        r->bad = 1;
+        return 0;
+    }
+    return n;
+}
+
+char* snap_get_str(struct snap_reader *r) {
+    long long n = snap_get_count(r);
+    if (r->bad || n < 0) {
+        return NULL;
+    }
+    char *s = strndup(r->pos, n);
+    r->pos += n;
+    return s;
+}
+
+char** snap_get_words(struct snap_reader *r, int *count) {
+    int n = snap_get_count(r);
+    *count = n > 0 ? n : 0;
+    if (r->bad || n < 0) {
+        return NULL;
+    }
+    char **words = calloc(n + 1, sizeof(char*));
+    for (int i = 0; i < n; i++) {
+        words[i] = snap_get_str(r);
+        if (words[i] == NULL) {
+            words[i] = strdup("");
+        }
+    }
+    return words;
+}
+
+struct node* snap_get_node(struct snap_reader *r) {
+    if (!snap_get_int(r) || r->bad) {
+        return NULL;
+    }
+    struct node *n = new_node(snap_get_int(r));
+    n->argc = snap_get_int(r);
+    int nwords;
+    n->argv = snap_get_words(r, &nwords);
+    int nredirs = snap_get_count(r);
+    struct redir **tail = &n->redirs;
+    for (int i = 0; i < nredirs && !r->bad; i++) {
+        struct redir *rd = calloc(1, sizeof(struct redir));
+        rd->type = snap_get_int(r);
+        rd->fd = snap_get_int(r);
+        rd->target = snap_get_str(r);
+        rd->literal = snap_get_int(r);
+        *tail = rd;
+        tail = &rd->next;
+    }
+    n->left = snap_get_node(r);
+    n->right = snap_get_node(r);
+    n->alt = snap_get_node(r);
+    n->nstages = snap_get_count(r);
+    n->stages = n->nstages > 0 ? calloc(n->nstages, sizeof(struct node*)) : NULL;
+    for (int i = 0; i < n->nstages; i++) {
+        n->stages[i] = snap_get_node(r);
+    }
+    n->text = snap_get_str(r);
+    if (snap_get_int(r)) {
+        struct program *pr = calloc(1, sizeof(struct program));
+        pr->ncode = snap_get_count(r);
+        pr->code = calloc(pr->ncode + 1, sizeof(struct instr));
+        for (int i = 0; i < pr->ncode; i++) {
+            pr->code[i].op = snap_get_int(r);
+            pr->code[i].arg = snap_get_int(r);
+            pr->code[i].count = snap_get_int(r);
+            pr->code[i].target = snap_get_int(r);
+        }
+        pr->nnodes = snap_get_count(r);
+        pr->nodes = calloc(pr->nnodes + 1, sizeof(struct node*));
+        for (int i = 0; i < pr->nnodes; i++) {
+            pr->nodes[i] = snap_get_node(r);
+        }
+        pr->words = snap_get_words(r, &pr->nwords);
+        pr->max_depth = snap_get_int(r);
+        n->prog = pr;
+    }
+    if (n->type == NODE_FUNCDEF && n->left != NULL) {
+        n->left->refs = 1;  // Held by the defining tree, as compile_tree() sets
+    }
+    return n;
+}
+
+// Identifies the build that wrote a snapshot, since it holds raw syntax trees
+const char* snap_build_id() {
+    static char id[64];
+    snprintf(id, sizeof(id), "shellv6-snap %d %s %s", SNAPVERSION, __DATE__, __TIME__);
+    return id;
+}
+
+// Writes the current state to path through a temporary file and rename(),
+// so a concurrent shell never maps a half-written snapshot.
+void save_snapshot(const char *path, struct rc_file *rcs, int nrc) {
+    struct snap_buf b = { NULL, 0, 0 };
+    snap_put_int(&b, nrc);
+    for (int i = 0; i < nrc; i++) {
+        snap_put_str(&b, rcs[i].path);
+        snap_put_int(&b, rcs[i].exists);
+        snap_put_int(&b, rcs[i].exists ? rcs[i].st.st_size : 0);
+        snap_put_int(&b, rcs[i].exists ? rcs[i].st.st_mtim.tv_sec : 0);
+        snap_put_int(&b, rcs[i].exists ? rcs[i].st.st_mtim.tv_nsec : 0);
+    }
+    snap_put_int(&b, var_count);
+    for (int i = 0; i < var_count; i++) {
+        snap_put_str(&b, var_table[i].str);
+        snap_put_int(&b, var_table[i].global);
+    }
+    snap_put_int(&b, func_count);
+    for (int i = 0; i < func_count; i++) {
+        snap_put_str(&b, func_table[i].name);
+        snap_put_node(&b, func_table[i].body);
+    }
+    snap_put_int(&b, alias_count);
+    for (int i = 0; i < ALIASHASH; i++) {
+        for (struct alias *a = alias_table[i]; a != NULL; a = a->next) {
+            snap_put_str(&b, a->name);
+            snap_put_str(&b, a->value);
+        }
+    }
+
+    // The PATH command index, valid while no PATH directory's mtime changes
+    load_command_index();
+    snap_put_str(&b, index_path);
+    snap_put_int(&b, path_ndirs);
+    for (int i = 0; i < path_ndirs; i++) {
+        struct stat st;
+        int ok = stat(path_dirs[i], &st) == 0;
+        snap_put_str(&b, path_dirs[i]);
+        snap_put_int(&b, ok ? st.st_mtim.tv_sec : -1);
+        snap_put_int(&b, ok ? st.st_mtim.tv_nsec : -1);
+    }
+    snap_put_int(&b, exe_count);
+    for (int i = 0; i < exe_count; i++) {
+        snap_put_str(&b, exe_index[i].name);
+        snap_put_int(&b, exe_index[i].dirs);
+    }
+
+    struct snap_header h;
+    memset(&h, 0, sizeof(h));
+    snprintf(h.build, sizeof(h.build), "%s", snap_build_id());
+    h.size = b.len;
+    h.checksum = snap_checksum(b.data, b.len);
+
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || write(fd, &h, sizeof(h)) != (ssize_t)sizeof(h)
+            || write(fd, b.data, b.len) != (ssize_t)b.len || rename(tmp, path) == -1) {
+        perror("snapshot: failed to write");
+        unlink(tmp);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    free(b.data);
+}
+
+// FNV-1a over the snapshot body
+unsigned long long snap_checksum(const char *data, size_t len) {
+    unsigned long long h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)data[i]) * 1099511628211ULL;
+    }
+    return h;
+}
+
+// Maps the snapshot and loads it if it was written by this build for the
+// same rc files as they are now. Returns 0 when the state was loaded.
+int load_snapshot(const char *path, struct rc_file *rcs, int nrc) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct snap_header)) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    struct snap_header *h = (struct snap_header *)map;
+    struct snap_reader r = { map + sizeof(*h), map + st.st_size, 0 };
+    int ok = strncmp(h->build, snap_build_id(), sizeof(h->build)) == 0
+             && h->size == (unsigned long long)(r.end - r.pos)
+             && h->checksum == snap_checksum(r.pos, h->size)
+             && snap_get_int(&r) == nrc;
+    for (int i = 0; ok && i < nrc; i++) {
+        char *rc = snap_get_str(&r);
+        int exists = snap_get_int(&r);
+        long long size = snap_get_int(&r), sec = snap_get_int(&r), nsec = snap_get_int(&r);
+        ok = rc != NULL && strcmp(rc, rcs[i].path) == 0 && exists == rcs[i].exists
+             && (!exists || (size == rcs[i].st.st_size && sec == rcs[i].st.st_mtim.tv_sec
+                             && nsec == rcs[i].st.st_mtim.tv_nsec));
+        free(rc);
+    }
+    if (!ok || r.bad) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    int nvars = snap_get_count(&r);
+    for (int i = 0; i < nvars && !r.bad; i++) {
+        char *str = snap_get_str(&r);
+        int global = snap_get_int(&r);
+        char *eq = str != NULL ? strchr(str, '=') : NULL;
+        if (eq != NULL) {
+            *eq = '\0';
+            set_var(str, eq + 1, global);
+            if (global) {
+                setenv(str, eq + 1, 1);
+            }
+        }
+        free(str);
+    }
+    int nfuncs = snap_get_count(&r);
+    for (int i = 0; i < nfuncs && !r.bad; i++) {
+        char *name = snap_get_str(&r);
+        struct node *body = snap_get_node(&r);
+        if (name != NULL && body != NULL) {
+            define_function(name, body);
+        }
+        free(name);
+    }
+    int naliases = snap_get_count(&r);
+    for (int i = 0; i < naliases && !r.bad; i++) {
+        char *name = snap_get_str(&r), *value = snap_get_str(&r);
+        if (name != NULL && value != NULL) {
+            set_alias(name, value);
+        }
+        free(name);
+        free(value);
+    }
+
+    // Kept aside until start_command_index() checks it against PATH
+    snap_index.path = snap_get_str(&r);
+    snap_index.ndirs = snap_get_count(&r);
+    snap_index.dirs = calloc(snap_index.ndirs + 1, sizeof(char*));
+    snap_index.mtimes = calloc(snap_index.ndirs + 1, sizeof(struct timespec));
+    for (int i = 0; i < snap_index.ndirs; i++) {
+        snap_index.dirs[i] = snap_get_str(&r);
+        snap_index.mtimes[i].tv_sec = snap_get_int(&r);
+        snap_index.mtimes[i].tv_nsec = snap_get_int(&r);
+    }
+    snap_index.count = snap_get_count(&r);
+    snap_index.entries = calloc(snap_index.count + 1, sizeof(struct exe_entry));
+    for (int i = 0; i < snap_index.count; i++) {
+        snap_index.entries[i].name = snap_get_str(&r);
+        snap_index.entries[i].dirs = snap_get_int(&r);
+    }
+    if (r.bad) {
+        fprintf(stderr, "snapshot: %s is damaged\n", path);
+        free_snap_index();
+    }
+    munmap(map, st.st_size);
+    return 0;
+}
+
+// The PATH index from the snapshot was built for the current PATH and no
+// directory on it has changed since
+int snap_index_current() {
+    int ok = snap_index.path != NULL && strcmp(snap_index.path, lookup_var("PATH")) == 0;
+    for (int i = 0; ok && i < snap_index.ndirs; i++) {
+        struct stat st;
+        int exists = snap_index.dirs[i] != NULL && stat(snap_index.dirs[i], &st) == 0;
+        ok = exists ? st.st_mtim.tv_sec == snap_index.mtimes[i].tv_sec
+                      && st.st_mtim.tv_nsec == snap_index.mtimes[i].tv_nsec
+                    : snap_index.mtimes[i].tv_sec == -1;
+    }
+    for (int i = 0; ok && i < snap_index.count; i++) {
+        ok = snap_index.entries[i].name != NULL;
+    }
+    return ok;
+}
+
+// Moves the PATH index loaded from the snapshot into the command index if it
+// is current. Called with the inotify watches already in place.
+int adopt_snap_index() {
+    int ok = snap_index_current();
+    if (ok) {
+        free(exe_index);
+        exe_index = snap_index.entries;
+        exe_count = exe_cap = snap_index.count;
+        snap_index.entries = NULL;
+        snap_index.count = 0;
+    }
+    free_snap_index();
+    return ok;
+}
+
+void free_snap_index() {
+    for (int i = 0; i < snap_index.ndirs; i++) {
+        free(snap_index.dirs[i]);
+    }
+    for (int i = 0; i < snap_index.count; i++) {
+        free(snap_index.entries[i].name);
+    }
+    free(snap_index.path);
+    free(snap_index.dirs);
+    free(snap_index.mtimes);
+    free(snap_index.entries);
+    memset(&snap_index, 0, sizeof(snap_index));
+}
+
+// Command server (--server path). The shell loads its rc files once, then
+// listens on a UNIX socket. Each connection gets its own session: a fork of
+// the server that runs requests one after another. A request carries the
+// client's stdin, stdout and stderr as SCM_RIGHTS descriptors, its working
+// directory and a command line; the reply is the exit status. At most
+// max_sessions sessions run at once, further clients wait in the backlog.
+int run_server(const char *path, int max_sessions) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "server: socket path too long: %s\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) {
+        perror("server: socket failed");
+        return 1;
+    }
+    // Only a socket left by an earlier server is replaced, never a file
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "server: %s exists and is not a socket\n", path);
+            close(sock);
+            return 1;
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int live = probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe != -1) {
+            close(probe);
+        }
+        if (live) {
+            fprintf(stderr, "server: %s: a server is already listening\n", path);
+            close(sock);
+            return 1;
+        }
+        unlink(path);
+    }
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1 || listen(sock, 128) == -1) {
+        perror("server: failed to listen");
+        close(sock);
+        return 1;
+    }
+
+    // Sessions are reaped here, not by the SIGCHLD handler, to keep count
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    report_status = 0;  // The status goes back in the reply
+
+    int active = 0;
+    while (1) {
+        int status;
+        while (waitpid(-1, &status, active >= max_sessions ? 0 : WNOHANG) > 0) {
+            active--;
+        }
+        if (active >= max_sessions) {
+            continue;
+        }
+        int conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+        if (conn == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                perror("server: accept failed");
+            }
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(sock);
+            sigprocmask(SIG_SETMASK, &oldmask, NULL);
+            shell_pid = getpid();  // The session is a shell of its own
+            serve_session(conn);
+            exit_shell(0);
+        }
+        if (pid == -1) {
+            perror("server: fork failed");
+        } else {
+            active++;
+        }
+        close(conn);
+    }
+}
+
+// Runs the requests of one client until it disconnects
+void serve_session(int conn) {
+    server_conn = conn;
+    while (1) {
+        struct server_request req;
+        int fds[3];
+        if (recv_request(conn, &req, fds) == -1) {
+            break;
+        }
+        char *cwd = malloc(req.cwd_len + 1), *cmd = malloc(req.cmd_len + 1);
+        if (read_full(conn, cwd, req.cwd_len) == -1 || read_full(conn, cmd, req.cmd_len) == -1) {
+            free(cwd);
+            free(cmd);
+            break;
+        }
+        cwd[req.cwd_len] = '\0';
+        cmd[req.cmd_len] = '\0';
+        for (int i = 0; i < 3; i++) {
+            dup2(fds[i], i);
+            close(fds[i]);
+        }
+        if (chdir(cwd) == -1) {
+            perror(cwd);
+        }
+
+        int status = run_line(cmd);
+        fflush(stdout);
+        fflush(stderr);
+        free(cwd);
+        free(cmd);
+        if (write(conn, &status, sizeof(status)) != sizeof(status)) {
+            break;
+        }
+    }
+    close(conn);
+    server_conn = -1;
+}
+
+// Reads a request header and the three descriptors sent with it
+int recv_request(int conn, struct server_request *req, int fds[3]) {
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = { req, sizeof(*req) };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+        continue;
+    }
+    struct cmsghdr *cm = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+            || cm->cmsg_len != CMSG_LEN(sizeof(int) * 3)) {
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cm), sizeof(int) * 3);
+    if ((n < (ssize_t)sizeof(*req) && read_full(conn, (char *)req + n, sizeof(*req) - n) == -1)
+            || req->magic != SERVER_MAGIC || req->cwd_len > PATH_MAX || req->cmd_len > SERVER_MAXCMD) {
+        for (int i = 0; i < 3; i++) {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+int read_full(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Pre-forked process pool (--zygote N). Forking the shell copies its page
+// tables, which grow with the history, caches and command index it builds
+// up; a pool process comes from a small helper forked before any of that.
+// The helper keeps N idle processes blocked on the pool socket. Each is
+// orphaned onto the shell, a child subreaper, so the shell waits for it like
+// any child it forked. zygote_exec() sends one of them the command, which
+// execs it with the shell's environment, directory and fds 0-2.
+void start_zygote(int size) {
+    int sv[2], notify[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("zygote: socketpair failed");
+        return;
+    }
+    if (pipe2(notify, O_CLOEXEC) == -1 || prctl(PR_SET_CHILD_SUBREAPER, 1) == -1) {
+        perror("zygote: setup failed");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    pid_t shell = getpid();
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(sv[0]);
+        zygote_helper(sv[1], notify, shell, size);
+    }
+    close(sv[1]);
+    close(notify[0]);
+    close(notify[1]);
+    if (pid == -1) {
+        perror("zygote: fork failed");
+        close(sv[0]);
+        return;
+    }
+    zygote_fd = sv[0];
+    zygote_owner = shell;
+    use_zygote = 1;
+}
+
+// The helper starts size pool processes, then one more for every byte a
+// pool process writes to the notify pipe as it takes a request. It dies
+// with the shell.
+void zygote_helper(int pool_fd, int notify[2], pid_t shell, int size) {
+    setpgid(0, 0);  // Out of the terminal's foreground group, away from ^C
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != shell) {
+        _exit(0);
+    }
+    for (int i = 0; i < size; i++) {
+        zygote_spawn(pool_fd, notify[1], shell);
+    }
+    char buf[64];
+    ssize_t n;
+    while ((n = read(notify[0], buf, sizeof(buf))) != 0) {
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++) {
+            zygote_spawn(pool_fd, notify[1], shell);
+        }
+    }
+    _exit(0);
+}
+
+// Double fork, so the pool process is orphaned onto the shell. The middle
+// process holds the only write end of a pipe, so its exit wakes the child.
+void zygote_spawn(int pool_fd, int notify_fd, pid_t shell) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        int orphaned[2];
+        if (pipe2(orphaned, O_CLOEXEC) == -1) {
+            _exit(1);
+        }
+        if (fork() == 0) {
+            close(orphaned[1]);
+            zygote_child(pool_fd, notify_fd, shell, orphaned[0]);
+        }
+        _exit(0);
+    }
+    if (pid > 0) {
+        waitpid(pid, NULL, 0);
+    }
+}
+
+// An idle pool process: waits for one request, answers with its pid and
+// execs the command as fork_job() and execute() would in a forked child.
+void zygote_child(int pool_fd, int notify_fd, pid_t shell, int orphaned_fd) {
+    char c;
+    while (read(orphaned_fd, &c, 1) == -1 && errno == EINTR) {
+        continue;  // End of file once the middle process has exited
+    }
+    close(orphaned_fd);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != shell) {
+        _exit(0);
+    }
+
+    char *buf = malloc(ZYGOTE_MAXMSG);
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec iov = { buf, ZYGOTE_MAXMSG };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    while ((n = recvmsg(pool_fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR) {
+        continue;
+    }
+    if (n <= 0 || write(notify_fd, "+", 1) != 1) {
+        _exit(0);
+    }
+
+    struct zygote_request req;
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    if (cm == NULL || cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS
+            || cm->cmsg_len != CMSG_LEN(sizeof(int) * 3) || n < (ssize_t)sizeof(req)) {
+        _exit(1);
+    }
+    memcpy(&req, buf, sizeof(req));
+    if (req.magic != ZYGOTE_MAGIC || sizeof(req) + req.size != (size_t)n || buf[n - 1] != '\0') {
+        _exit(1);
+    }
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+    char *p = buf + sizeof(req), *end = buf + n;
+    char *cwd = p;
+    p += strlen(p) + 1;
+    char **argv = calloc(req.argc + 1, sizeof(char *));
+    char **envp = calloc(req.envc + 1, sizeof(char *));
+    for (unsigned int i = 0; i < req.argc + req.envc; i++) {
+        if (p >= end) {
+            _exit(1);
+        }
+        if (i < req.argc) {
+            argv[i] = p;
+        } else {
+            envp[i - req.argc] = p;
+        }
+        p += strlen(p) + 1;
+    }
+    if (argv[0] == NULL) {
+        _exit(1);
+    }
+
+    // Join the job's group before the shell learns our pid, as a forked
+    // child does before it runs anything
+    setpgid(0, req.pgid);
+    pid_t self = getpid();
+    if (send(pool_fd, &self, sizeof(self), MSG_NOSIGNAL) != sizeof(self)) {
+        _exit(1);  // The shell gave up on this request
+    }
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+    }
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] > 2) {
+            close(fds[i]);
+        }
+    }
+    if (req.take_terminal) {
+        sigset_t mask, old;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGTTOU);
+        sigprocmask(SIG_BLOCK, &mask, &old);
+        for (int i = 0; i < 3 && tcsetpgrp(i, getpgrp()) == -1; i++) {
+            continue;  // stdin may be redirected; any terminal fd will do
+        }
+        sigprocmask(SIG_SETMASK, &old, NULL);
+    }
+    umask(req.umask);
+    for (int r = 0; r < RLIM_NLIMITS; r++) {
+        struct rlimit cur;
+        if (getrlimit(r, &cur) == 0 && (cur.rlim_cur != req.limits[r].rlim_cur || cur.rlim_max != req.limits[r].rlim_max)) {
+            setrlimit(r, &req.limits[r]);
+        }
+    }
+    if (chdir(cwd) == -1) {
+        perror(cwd);
+    }
+    prctl(PR_SET_PDEATHSIG, 0);  // Commands outlive the shell as forked ones do
+    environ = envp;
+    execvp(argv[0], argv);
+    perror("Command not found...");
+    _exit(1);
+}
+
+// Starts arglist from the pool as fork_job() would in a new child and
+// returns its pid. Returns -1 when it has to be forked instead: there is no
+// pool, a redirection involves a descriptor other than 0-2, or the request
+// is too large. Returns 0 when the redirections failed.
+pid_t zygote_exec(struct job *j, char *arglist[], struct redir *redirs) {
+    if (!use_zygote || zygote_fd == -1 || getpid() != zygote_owner || procsub_count > 0) {
+        return -1;  // Only fds 0-2 are passed, not the pipes of <(list)
+    }
+    for (struct redir *r = redirs; r != NULL; r = r->next) {
+        if (r->fd > 2) {
+            return -1;
+        }
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        return -1;
+    }
+
+    struct zygote_request req;
+    memset(&req, 0, sizeof(req));
+    req.magic = ZYGOTE_MAGIC;
+    req.pgid = job_own_group(j) ? j->pgid : getpgrp();
+    req.take_terminal = job_control && j->foreground;
+    req.umask = umask(0);
+    umask(req.umask);
+    for (int r = 0; r < RLIM_NLIMITS; r++) {
+        getrlimit(r, &req.limits[r]);
+    }
+    size_t size = strlen(cwd) + 1;
+    for (char **w = arglist; *w != NULL; w++, req.argc++) {
+        size += strlen(*w) + 1;
+    }
+    for (char **e = environ; *e != NULL; e++, req.envc++) {
+        size += strlen(*e) + 1;
+    }
+    if (sizeof(req) + size > ZYGOTE_MAXMSG) {
+        return -1;
+    }
+    req.size = size;
+    char *buf = malloc(sizeof(req) + size);
+    char *p = buf + sizeof(req);
+    memcpy(buf, &req, sizeof(req));
+    p = stpcpy(p, cwd) + 1;
+    for (char **w = arglist; *w != NULL; w++) {
+        p = stpcpy(p, *w) + 1;
+    }
+    for (char **e = environ; *e != NULL; e++) {
+        p = stpcpy(p, *e) + 1;
+    }
+
+    // The redirections are opened in the shell and passed as the new fds
+    // 0-2; a redirection closing one of them needs a real fork
+    struct saved_fds saved = { .count = 0 };
+    if (apply_redirs(redirs, &saved) == -1) {
+        restore_fds(&saved);
+        free(buf);
+        return 0;
+    }
+    int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    for (int i = 0; i < 3; i++) {
+        if (fcntl(fds[i], F_GETFD) == -1) {
+            restore_fds(&saved);
+            free(buf);
+            return -1;
+        }
+    }
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    struct iovec iov = { buf, sizeof(req) + size };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+    ssize_t sent;
+    while ((sent = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+        continue;
+    }
+    restore_fds(&saved);
+    free(buf);
+
+    // A pool process answers at once, or within a fork when the helper is
+    // still replacing the last one taken
+    pid_t pid = -1;
+    struct pollfd pfd = { zygote_fd, POLLIN, 0 };
+    int ready = 0;
+    if (sent != -1) {
+        while ((ready = poll(&pfd, 1, 5000)) == -1 && errno == EINTR) {
+            continue;
+        }
+    }
+    if (ready <= 0 || recv(zygote_fd, &pid, sizeof(pid), 0) != sizeof(pid) || pid <= 0) {
+        // A request left queued is dropped by the process that takes it,
+        // as it cannot answer a closed socket
+        fprintf(stderr, "zygote: the pool is not answering, forking commands instead\n");
+        close(zygote_fd);
+        zygote_fd = -1;
+        return -1;
+    }
+    add_proc(j, pid);
+    return pid;
+}
+
+void add_to_history(const char* cmdline) {
+    // Free the previous command if it exists
+    if (command_history[hist_index] != NULL) {
+        free(command_history[hist_index]);
+    }
+    // Store the new command in history
+    command_history[hist_index] = strdup(cmdline);
+    hist_index = (hist_index + 1) % HISTSIZE; // Wrap around
+}
+
+void repeat_command(int command_number) {
+    if (command_number < 0 || command_number >= HISTSIZE || command_history[command_number] == NULL) {
+        printf("No such command in history.\n");
+        return;
+    }
+    printf("Repeating command: %s\n", command_history[command_number]);
+    // Execute the repeated command
+    run_line(command_history[command_number]);
+}
+
+void free_history() {
+    for (int i = 0; i < HISTSIZE; i++) {
+        if (command_history[i] != NULL) {
+            free(command_history[i]);
+        }
+    }
+}
+
+// Puts the shell in its own process group in charge of the terminal when
+// it runs interactively. The shell then ignores the job control signals,
+// which fork_child() resets for the commands it starts.
+void init_job_control() {
+    if (!isatty(STDIN_FILENO)) {
+        return;
+    }
+    // Wait until we are in the foreground if started in the background
+    while (tcgetpgrp(STDIN_FILENO) != (shell_pgid = getpgrp())) {
+        kill(-shell_pgid, SIGTTIN);
+    }
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+
+    setpgid(0, 0);  // Fails harmlessly if the shell already leads its session
+    shell_pgid = getpgrp();
+    tcsetpgrp(STDIN_FILENO, shell_pgid);
+    tcgetattr(STDIN_FILENO, &shell_tmodes);
+    job_control = 1;
+}
+
+// Forks one process of job j. The first process becomes the leader of the
+// job's process group, later ones join it; both sides call setpgid() so it
+// is in place whichever runs first. A foreground job also gets the terminal.
+// Foreground jobs only get their own group when job control is on or they
+// have a timeout, which signals the group.
+pid_t fork_job(struct job *j, sigset_t *oldmask) {
+    int take_terminal = job_control && j->foreground;
+    pid_t pid = fork_child(oldmask);
+
+    if (pid == 0) {
+        if (job_own_group(j)) {
+            setpgid(0, j->pgid);
+            if (take_terminal) {
+                // SIGTTOU is back to its default here; blocked, it does not
+                // stop us for changing the terminal from the background
+                sigset_t mask, old;
+                sigemptyset(&mask);
+                sigaddset(&mask, SIGTTOU);
+                sigprocmask(SIG_BLOCK, &mask, &old);
+                tcsetpgrp(STDIN_FILENO, getpgrp());
+                sigprocmask(SIG_SETMASK, &old, NULL);
+            }
+        }
+        return 0;
+    }
+    if (pid == -1) {
+        return -1;
+    }
+    add_proc(j, pid);
+    return pid;
+}
+
+int job_own_group(struct job *j) {
+    return job_control || !j->foreground || j->deadline.tv_sec != 0;
+}
+
+// Parent side of starting a process of job j, forked or from the pool
+void add_proc(struct job *j, pid_t pid) {
+    if (job_own_group(j)) {
+        setpgid(pid, j->pgid != 0 ? j->pgid : pid);
+        if (j->pgid == 0) {
+            j->pgid = pid;
+            if (job_control && j->foreground) {
+                tcsetpgrp(STDIN_FILENO, pid);
+            }
+        }
+    }
+    j->procs = realloc(j->procs, sizeof(struct proc) * (j->nprocs + 1));
+    j->procs[j->nprocs] = (struct proc){ pid, 0, JOB_RUNNING };
+    clock_gettime(CLOCK_MONOTONIC, &j->procs[j->nprocs].started);
+    j->nprocs++;
+}
+
+// Derived state of a job: done when every process is, stopped when none is
+// running any more and at least one is stopped.
+enum job_state job_state(struct job *j) {
+    int stopped = 0;
+    for (int i = 0; i < j->nprocs; i++) {
+        if (j->procs[i].state == JOB_RUNNING) {
+            return JOB_RUNNING;
+        }
+        stopped |= j->procs[i].state == JOB_STOPPED;
+    }
+    return stopped ? JOB_STOPPED : JOB_DONE;
+}
+
+// Records a wait status for pid in the job table. Called from the SIGCHLD
+// handler, so it only updates fields in place and uses write(). A job that
+// has just finished or stopped is queued for notify_jobs(), or reported at
+// once with set -b.
+void mark_process(pid_t pid, int status) {
+    int slot = lookup_pid(pid);
+    if (slot == -1) {
+        return;
+    }
+    struct job *j = &jobs[slot];
+    for (int k = 0; k < j->nprocs; k++) {
+        struct proc *pr = &j->procs[k];
+        if (pr->pid != pid) {
+            continue;
+        }
+        if (WIFSTOPPED(status)) {
+            pr->state = JOB_STOPPED;
+        } else if (WIFCONTINUED(status)) {
+            pr->state = JOB_RUNNING;
+        } else {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            pr->state = JOB_DONE;
+            pr->status = status;
+            pr->elapsed_ms = (now.tv_sec - pr->started.tv_sec) * 1000.0 + (now.tv_nsec - pr->started.tv_nsec) / 1e6;
+        }
+        break;
+    }
+
+    enum job_state state = job_state(j);
+    if (state == JOB_RUNNING || j->queued) {
+        return;
+    }
+    j->queued = 1;
+    job_events[job_events_tail++ % MAXJOBS] = slot;
+    if (notify_now && state == JOB_DONE) {
+        char line[512];
+        size_t len = format_job(j, line, sizeof(line));
+        if (write(STDOUT_FILENO, line, len) == -1) {
+            return;
+        }
+        j->notified = 1;
+    }
+}
+
+// Index of the slot holding pid, or -1. Entries left over from jobs that
+// are gone, or inherited by a forked child, fail the check against the job.
+int lookup_pid(pid_t pid) {
+    unsigned h = pid & (PIDHASH - 1), n = 0;
+    for (; n < PIDHASH && pid_index[h].pid != 0; h = (h + 1) & (PIDHASH - 1), n++) {
+        if (pid_index[h].pid != pid) {
+            continue;
+        }
+        struct job *j = &jobs[pid_index[h].slot];
+        for (int k = 0; j->id != 0 && pid_index[h].slot < job_count && k < j->nprocs; k++) {
+            if (j->procs[k].pid == pid) {
+                return pid_index[h].slot;
+            }
+        }
+    }
+    if (n < PIDHASH) {
+        return -1;  // An empty slot ends the probe: not a job's process
+    }
+    // The probe went round the whole index, so pid may not have fit in it
+    for (int i = 0; i < job_count; i++) {
+        for (int k = 0; jobs[i].id != 0 && k < jobs[i].nprocs; k++) {
+            if (jobs[i].procs[k].pid == pid) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// Adds the pids of a job to pid_index, reusing deleted entries
+void index_job_pids(int slot) {
+    for (int k = 0; k < jobs[slot].nprocs; k++) {
+        pid_t pid = jobs[slot].procs[k].pid;
+        for (unsigned h = pid & (PIDHASH - 1), n = 0; n < PIDHASH; h = (h + 1) & (PIDHASH - 1), n++) {
+            if (pid_index[h].pid <= 0) {
+                pid_index[h] = (struct pid_entry){ pid, slot };
+                break;
+            }
+        }
+    }
+}
+
+void unindex_job_pids(int slot) {
+    for (int k = 0; k < jobs[slot].nprocs; k++) {
+        pid_t pid = jobs[slot].procs[k].pid;
+        for (unsigned h = pid & (PIDHASH - 1), n = 0; n < PIDHASH && pid_index[h].pid != 0;
+                h = (h + 1) & (PIDHASH - 1), n++) {
+            if (pid_index[h].pid == pid && pid_index[h].slot == slot) {
+                pid_index[h].pid = -1;
+                break;
+            }
+        }
+    }
+}
+
+// Appends text to buf, for building messages in a signal handler
+size_t append_text(char *buf, size_t len, size_t size, const char *text) {
+    while (*text != '\0' && len + 1 < size) {
+        buf[len++] = *text++;
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+size_t append_number(char *buf, size_t len, size_t size, long n) {
+    char digits[24];
+    int i = sizeof(digits) - 1;
+    int negative = n < 0;
+    digits[i] = '\0';
+    if (negative) {
+        n = -n;
+    }
+    do {
+        digits[--i] = '0' + n % 10;
+        n /= 10;
+    } while (n > 0);
+    if (negative) {
+        digits[--i] = '-';
+    }
+    return append_text(buf, len, size, digits + i);
+}
+
+// Formats the notification line of a finished or stopped job, e.g.
+// "[3]+  Done (0)                 make -j8". Safe to call from a handler.
+size_t format_job(struct job *j, char *buf, size_t size) {
+    size_t len = 0;
+    int status = j->nprocs > 0 ? j->procs[j->nprocs - 1].status : 0;
+    len = append_text(buf, len, size, job_control && notify_now ? "\n[" : "[");
+    len = append_number(buf, len, size, j->id);
+    len = append_text(buf, len, size, j - jobs == current_job ? "]+  " : "]   ");
+    size_t start = len;
+    if (job_state(j) == JOB_STOPPED) {
+        len = append_text(buf, len, size, "Stopped");
+    } else if (WIFSIGNALED(status)) {
+        len = append_text(buf, len, size, "Done (");
+        len = append_text(buf, len, size, signal_name(WTERMSIG(status)));
+        len = append_text(buf, len, size, j->timed_out ? ", timed out)" : ")");
+    } else {
+        len = append_text(buf, len, size, "Done (");
+        len = append_number(buf, len, size, WEXITSTATUS(status));
+        len = append_text(buf, len, size, j->timed_out ? ", timed out)" : ")");
+    }
+    do {
+        len = append_text(buf, len, size, " ");
+    } while (len < start + 24 && len + 1 < size);
+    len = append_text(buf, len, size, j->cmd);
+    return append_text(buf, len, size, "\n");
+}
+
+// Reports the jobs queued by the SIGCHLD handler and drops finished ones
+// from the table. Only jobs that changed are visited, however many exist.
+void notify_jobs() {
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
+    drain_outputs();  // A job's last lines come before its Done line
+    while (job_events_head != job_events_tail) {
+        int slot = job_events[job_events_head++ % MAXJOBS];
+        struct job *j = &jobs[slot];
+        if (j->id == 0 || !j->queued) {
+            continue;  // Already reported by jobs or fg
+        }
+        j->queued = 0;
+        enum job_state state = job_state(j);
+        if (state == JOB_RUNNING) {
+            continue;  // Continued again since
+        }
+        if (!j->notified) {
+            char line[512];
+            format_job(j, line, sizeof(line));
+            fputs(line, stdout);
+        }
+        if (state == JOB_DONE) {
+            remove_job(slot);
+        }
+    }
+    fflush(stdout);
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
+}
+
+// Adds a job to the table, keeping its number if it is free again, else
+// taking the lowest free one. SIGCHLD must be blocked. Returns NULL if the
+// table is full.
+struct job* add_job(struct job *j) {
+    int slot = j->id - 1;
+    if (slot < 0 || slot >= job_count || jobs[slot].id != 0) {
+        slot = 0;
+        while (slot < job_count && jobs[slot].id != 0) {
+            slot++;
+        }
+    }
+    if (slot == MAXJOBS) {
+        fprintf(stderr, "Too many background jobs.\n");
+        return NULL;
+    }
+    if (slot == job_count) {
+        job_count++;
+    }
+    j->id = slot + 1;
+    j->foreground = 0;
+    j->queued = 0;
+    j->notified = 0;
+    jobs[slot] = *j;
+    current_job = slot;
+    index_job_pids(slot);
+    return &jobs[slot];
+}
+
+void free_job(struct job *j) {
+    free(j->procs);
+    free(j->cmd);
+}
+
+// Removes jobs[i] from the table. SIGCHLD must be blocked.
+void remove_job(int i) {
+    unindex_job_pids(i);
+    free_job(&jobs[i]);
+    jobs[i].id = 0;
+    jobs[i].queued = 0;
+    while (job_count > 0 && jobs[job_count - 1].id == 0) {
+        job_count--;
+    }
+    if (current_job == i) {
+        // The most recent job before it becomes current
+        current_job = job_count - 1;
+        while (current_job >= 0 && jobs[current_job].id == 0) {
+            current_job--;
+        }
+    }
+}
+
+// Starts reading a background job's output from fd. Returns -1 if it
+// cannot be watched.
+int start_output(int id, int fd) {
+    if (output_epoll == -1) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        output_epoll = epoll_create1(EPOLL_CLOEXEC);
+        sigchld_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (output_epoll == -1 || sigchld_fd == -1) {
+            perror("multiplex: epoll setup failed");
+            return -1;
+        }
+    }
+    struct job_output *o = calloc(1, sizeof(struct job_output));
+    o->id = id;
+    o->fd = fd;
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = o };
+    if (epoll_ctl(output_epoll, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("multiplex: epoll_ctl failed");
+        free(o);
+        return -1;
+    }
+    outputs[output_count++] = o;
+    open_outputs++;
     return 0;
 }
 
-int execute(char* arglist[], char* infile, char* outfile, int background) {
-    int status;
-    int cpid = fork();
-
-    switch (cpid) {
-        case -1:
-            perror("fork failed");
-            exit(1);
-        case 0:
-            if (infile != NULL) {
-                int fd_in = open(infile, O_RDONLY);
-                if (fd_in == -1) {
-                    perror("Failed to open input file");
-                    exit(1);
-                }
-                dup2(fd_in, STDIN_FILENO);
-                close(fd_in);
-            }
-
-            if (outfile != NULL) {
-                int fd_out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd_out == -1) {
-                    perror("Failed to open output file");
-                    exit(1);
-                }
-                dup2(fd_out, STDOUT_FILENO);
-                close(fd_out);
+// Reads what the job has written, as long as there is room that holds no
+// unshown output. A full ring pauses the job's pipe: once the pipe is full
+// too, the job blocks in write() until its lines have been shown.
+void read_output(struct job_output *o) {
+    while (o->fd != -1) {
+        if (o->total >= o->cap && !grow_output(o) && o->cap == 0) {
+            return;  // No memory for even the first ring
+        }
+        size_t room = o->cap - (o->total - o->shown);
+        if (room == 0) {
+            if (!o->paused) {
+                epoll_ctl(output_epoll, EPOLL_CTL_DEL, o->fd, NULL);
+                o->paused = 1;
             }
+            return;
+        }
+        size_t off = o->total % o->cap;
+        ssize_t n = read(o->fd, o->ring + off, room < o->cap - off ? room : o->cap - off);
+        if (n > 0) {
+            o->total += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            return;
+        } else {
+            close(o->fd);  // Also takes it out of output_epoll
+            o->fd = -1;
+            o->finished = ++output_serial;
+            open_outputs--;
+        }
+    }
+}
 
-            execvp(arglist[0], arglist);
-            perror("Command not found...");
-            exit(1);
-        default:
-            if (background) {
-                // Add the PID to the jobs list
-                if (job_count < MAXJOBS) {
-                    jobs[job_count++] = cpid;
-                } else {
-                    fprintf(stderr, "Too many background jobs.\n");
-                }
-                printf("[%d] %d\n", job_count, cpid);
-            } else {
-                waitpid(cpid, &status, 0);
-                printf("Child exited with status %d\n", status >> 8);
+// Doubles the ring, starting at 4 KB, while it is below MUXRING and the
+// budget allows, evicting the output of finished jobs if needed. Returns 1
+// if it grew.
+int grow_output(struct job_output *o) {
+    size_t cap = o->cap == 0 ? 4096 : o->cap * 2;
+    if (cap > MUXRING) {
+        return 0;
+    }
+    while (output_bytes + cap - o->cap > MUXBUDGET) {
+        int oldest = -1;
+        for (int i = 0; i < output_count; i++) {
+            struct job_output *f = outputs[i];
+            if (f->fd == -1 && f->shown == f->total && (oldest == -1 || f->finished < outputs[oldest]->finished)) {
+                oldest = i;
             }
+        }
+        if (oldest == -1) {
             return 0;
+        }
+        drop_output(oldest);
+    }
+    char *ring = malloc(cap);
+    if (ring == NULL) {
+        return 0;
     }
+    for (size_t k = o->total > o->cap ? o->total - o->cap : 0; k < o->total; k++) {
+        ring[k % cap] = o->ring[k % o->cap];
+    }
+    free(o->ring);
+    output_bytes += cap - o->cap;
+    o->ring = ring;
+    o->cap = cap;
+    return 1;
 }
 
-void execute_pipe(char* arglist1[], char* arglist2[], char* infile, char* outfile) {
-    int pipefd[2];
-    pid_t cpid1, cpid2;
-
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
-        exit(1);
+// Writes the complete lines not shown yet, tagged with the job number. With
+// force the rest goes out too, as a line of its own. Returns the number of
+// lines written.
+int emit_output(struct job_output *o, int force) {
+    int lines = 0;
+    while (o->shown < o->total) {
+        size_t end = o->scanned > o->shown ? o->scanned : o->shown;
+        while (end < o->total && o->ring[end % o->cap] != '\n') {
+            end++;
+        }
+        o->scanned = end;
+        if (end == o->total && !force) {
+            break;
+        }
+        if (output_clear_line) {
+            printf("\r\x1b[K");
+            output_clear_line = 0;
+        }
+        printf("[%d] ", o->id);
+        for (size_t k = o->shown; k < end; ) {
+            size_t off = k % o->cap;
+            size_t n = end - k < o->cap - off ? end - k : o->cap - off;
+            fwrite(o->ring + off, 1, n, stdout);
+            k += n;
+        }
+        putchar('\n');
+        o->shown = end < o->total ? end + 1 : end;
+        lines++;
     }
+    return lines;
+}
 
-    cpid1 = fork();
-    if (cpid1 == -1) {
-        perror("fork failed");
-        exit(1);
+// Reads the pipes that are ready without blocking, then shows what may be
+// shown: everything but the output held back while a foreground job has the
+// terminal. Returns the number of lines written.
+int drain_outputs() {
+    if (output_count == 0 || getpid() != shell_pid) {
+        return 0;
+    }
+    struct epoll_event ev[32];
+    int n = 0;
+    if (outputs_active()) {
+        while ((n = epoll_wait(output_epoll, ev, 32, 0)) == -1 && errno == EINTR) {
+            continue;
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        read_output(ev[i].data.ptr);
     }
 
-    if (cpid1 == 0) {
-        if (infile != NULL) {
-            int fd_in = open(infile, O_RDONLY);
-            if (fd_in == -1) {
-                perror("Failed to open input file");
-                exit(1);
+    int lines = 0, finished = 0;
+    for (int i = 0; i < output_count; i++) {
+        struct job_output *o = outputs[i];
+        if (!output_held || o->id == output_fg_id) {
+            lines += emit_output(o, o->fd == -1);
+            if (o->total - o->shown == o->cap) {
+                lines += emit_output(o, 1);  // A line longer than the ring goes out in pieces
             }
-            dup2(fd_in, STDIN_FILENO);
-            close(fd_in);
         }
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[0]);
-        close(pipefd[1]);
-        execvp(arglist1[0], arglist1);
-        perror("Command not found in first command...");
-        exit(1);
-    } else {
-        cpid2 = fork();
-        if (cpid2 == -1) {
-            perror("fork failed");
-            exit(1);
+        if (o->paused && o->total - o->shown < o->cap) {
+            struct epoll_event resume = { .events = EPOLLIN, .data.ptr = o };
+            epoll_ctl(output_epoll, EPOLL_CTL_ADD, o->fd, &resume);
+            o->paused = 0;
         }
-
-        if (cpid2 == 0) {
-            dup2(pipefd[0], STDIN_FILENO);
-            close(pipefd[1]);
-            if (outfile != NULL) {
-                int fd_out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                if (fd_out == -1) {
-                    perror("Failed to open output file");
-                    exit(1);
-                }
-                dup2(fd_out, STDOUT_FILENO);
-                close(fd_out);
+        finished += o->fd == -1;
+    }
+    // Keep the output of the last MUXKEEP finished jobs
+    while (finished > MUXKEEP) {
+        int oldest = -1;
+        for (int i = 0; i < output_count; i++) {
+            struct job_output *f = outputs[i];
+            if (f->fd == -1 && f->shown == f->total && (oldest == -1 || f->finished < outputs[oldest]->finished)) {
+                oldest = i;
             }
-            execvp(arglist2[0], arglist2);
-            perror("Command not found in second command...");
-            exit(1);
-        } else {
-            close(pipefd[0]);
-            close(pipefd[1]);
-            waitpid(cpid1, NULL, 0);
-            waitpid(cpid2, NULL, 0);
         }
+        if (oldest == -1) {
+            break;
+        }
+        drop_output(oldest);
+        finished--;
     }
+    fflush(stdout);
+    return lines;
 }
 
-char** tokenize(char* cmdline) {
-    char **arglist = (char**)malloc(sizeof(char*) * (MAXARGS + 1));
-    for (int j = 0; j < MAXARGS + 1; j++) {
-        arglist[j] = (char*)malloc(sizeof(char) * ARGLEN);
-        bzero(arglist[j], ARGLEN);
+// Shows everything still buffered, e.g. when the shell exits. Jobs that are
+// still running lose their output with the pipe.
+void flush_outputs() {
+    output_held = 0;
+    drain_outputs();
+    for (int i = 0; i < output_count; i++) {
+        emit_output(outputs[i], 1);
     }
+    fflush(stdout);
+}
 
-    if (cmdline[0] == '\0') {
-        return NULL;
+void drop_output(int i) {
+    struct job_output *o = outputs[i];
+    if (o->fd != -1) {
+        close(o->fd);
+        open_outputs--;
     }
+    output_bytes -= o->cap;
+    free(o->ring);
+    free(o);
+    outputs[i] = outputs[--output_count];
+}
 
-    int argnum = 0;
-    char *cp = cmdline;
-    char *start;
-    int len;
-
-    while (*cp != '\0') {
-        while (*cp == ' ' || *cp == '\t') {
-            cp++;
-        }
-        start = cp;
-        len = 1;
-        while (*++cp != '\0' && (*cp != ' ' && *cp != '\t')) {
-            len++;
+// Output of job id: the running job's, else that of the last job to finish
+// under that number
+struct job_output* find_output(int id) {
+    struct job_output *found = NULL;
+    for (int i = 0; i < output_count; i++) {
+        struct job_output *o = outputs[i];
+        if (o->id == id && (found == NULL || o->fd != -1 || (found->fd == -1 && o->finished > found->finished))) {
+            found = o;
         }
+    }
+    return found;
+}
 
-        strncpy(arglist[argnum], start, len);
-        arglist[argnum][len] = '\0';
-        argnum++;
+// Only the shell itself reads the pipes; its children share output_epoll
+int outputs_active() {
+    return open_outputs > 0 && getpid() == shell_pid;
+}
 
-        if (argnum >= MAXARGS) {
-            printf("Too many arguments!\n");
-            return NULL;
+// wait4() for wait_job(). With job output to read, SIGCHLD (blocked) is
+// taken from a signalfd, so the pipes can be drained while waiting.
+pid_t wait_child(int *status, struct rusage *usage) {
+    while (outputs_active()) {
+        struct signalfd_siginfo si;
+        while (read(sigchld_fd, &si, sizeof(si)) > 0) {
+            continue;  // Cleared before looking, so no exit is missed
         }
-
-        while (*cp == ' ' || *cp == '\t') {
-            cp++;
+        pid_t pid = wait4(-1, status, WUNTRACED | WNOHANG, usage);
+        if (pid != 0) {
+            return pid;
+        }
+        struct pollfd fds[2] = { { output_epoll, POLLIN, 0 }, { sigchld_fd, POLLIN, 0 } };
+        if (poll(fds, 2, -1) == -1) {
+            return -1;  // EINTR lets the caller run the timeout handler
+        }
+        if (fds[0].revents & POLLIN) {
+            drain_outputs();
         }
     }
-
-    arglist[argnum] = NULL;
-    return arglist;
+    return wait4(-1, status, WUNTRACED, usage);
 }
 
-char* read_cmd(char* prompt) {
-    printf("%s", prompt);
-    char* cmdline = (char*)malloc(sizeof(char) * 1024);
-    if (fgets(cmdline, 1024, stdin) == NULL) {
-        free(cmdline);
-        return NULL;
+// Waits for a foreground job with SIGCHLD blocked. If it is stopped, e.g.
+// by Ctrl-Z, it moves into the job table and the shell takes the terminal
+// back. Returns the status of the last process, or 128 + the stop signal.
+int wait_job(struct job *j) {
+    struct rusage usage;
+    int stopsig = 0;
+
+    sigset_t alarm_mask;
+    sigemptyset(&alarm_mask);
+    sigaddset(&alarm_mask, SIGALRM);
+    if (j->deadline.tv_sec != 0) {
+        fg_job = j;
+        arm_timer();
     }
 
-    // Remove the newline character at the end, if present
-    int length = strlen(cmdline);
-    if (cmdline[length - 1] == '\n') {
-        cmdline[length - 1] = '\0';
+    // Reap children in the order they finish, so each stage's elapsed time
+    // is taken when it exits. Background children reaped on the way are
+    // recorded as the SIGCHLD handler would.
+    int running = 0;
+    for (int i = 0; i < j->nprocs; i++) {
+        running += j->procs[i].state == JOB_RUNNING;
     }
+    memset(&last_usage, 0, sizeof(last_usage));
+    // Background output waits while this job has the terminal
+    output_held = job_control;
+    output_fg_id = j->id;
+    while (running > 0) {
+        int status;
+        pid_t pid;
+        // The SIGALRM handler may fire a timeout only while we sit in wait4()
+        sigprocmask(SIG_UNBLOCK, &alarm_mask, NULL);
+        while ((pid = wait_child(&status, &usage)) == -1 && errno == EINTR) {
+            continue;
+        }
+        sigprocmask(SIG_BLOCK, &alarm_mask, NULL);
+        if (pid == -1) {
+            break;  // No children left
+        }
 
-    return cmdline;
-}
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        struct proc *pr = NULL;
+        for (int i = 0; i < j->nprocs && pr == NULL; i++) {
+            if (j->procs[i].pid == pid && j->procs[i].state == JOB_RUNNING) {
+                pr = &j->procs[i];
+            }
+        }
+        if (pr == NULL) {
+            mark_process(pid, status);
+            continue;
+        }
+        running--;
+        if (WIFSTOPPED(status)) {
+            pr->state = JOB_STOPPED;
+            stopsig = WSTOPSIG(status);
+        } else {
+            pr->state = JOB_DONE;
+            pr->status = status;
+            pr->elapsed_ms = (now.tv_sec - pr->started.tv_sec) * 1000.0 + (now.tv_nsec - pr->started.tv_nsec) / 1e6;
+            add_usage(&last_usage, &usage);
+        }
+    }
+    output_held = 0;
 
-void add_to_history(const char* cmdline) {
-    // Free the previous command if it exists
-    if (command_history[hist_index] != NULL) {
-        free(command_history[hist_index]);
+    if (job_control) {
+        if (stopsig != 0) {
+            tcgetattr(STDIN_FILENO, &j->tmodes);
+        }
+        tcsetpgrp(STDIN_FILENO, shell_pgid);
+        tcsetattr(STDIN_FILENO, TCSADRAIN, &shell_tmodes);
+    }
+    fg_job = NULL;
+    if (stopsig != 0) {
+        struct job *stopped = add_job(j);
+        if (stopped != NULL) {
+            printf("\n[%d]+  Stopped                 %s\n", stopped->id, stopped->cmd);
+        } else {
+            kill(-j->pgid, SIGKILL);  // No slot to keep it in
+            free_job(j);
+        }
+        arm_timer();
+        return 128 + stopsig;
     }
-    // Store the new command in history
-    command_history[hist_index] = strdup(cmdline);
-    hist_index = (hist_index + 1) % HISTSIZE; // Wrap around
-}
 
-void repeat_command(int command_number) {
-    if (command_number < 0 || command_number >= HISTSIZE || command_history[command_number] == NULL) {
-        printf("No such command in history.\n");
-        return;
+    int *wstatus = malloc(sizeof(int) * (j->nprocs + 1));
+    double *elapsed = malloc(sizeof(double) * (j->nprocs + 1));
+    int status = j->nprocs > 0 ? j->procs[j->nprocs - 1].status : 0;
+    for (int i = 0; i < j->nprocs; i++) {
+        wstatus[i] = j->procs[i].status;
+        elapsed[i] = j->procs[i].elapsed_ms;
     }
-    printf("Repeating command: %s\n", command_history[command_number]);
-    // Execute the repeated command
-    char **arglist = tokenize(command_history[command_number]);
-    if (arglist != NULL) {
-        char *infile = NULL;
-        char *outfile = NULL;
-        int background = 0;
+    // pipefail: the rightmost stage that failed decides
+    for (int i = j->nprocs - 1; pipefail && status == 0 && i >= 0; i--) {
+        status = wstatus[i];
+    }
+    set_pipestatus(j->nprocs, wstatus, elapsed);
+    free(wstatus);
+    free(elapsed);
 
-        // Execute the command as usual
-        execute(arglist, infile, outfile, background);
+    if (j->timed_out) {
+        free_job(j);
+        arm_timer();
+        return 124;
+    }
+    if (job_control && WIFSIGNALED(status) && WTERMSIG(status) == SIGINT) {
+        printf("\n");  // Ctrl-C left the cursor after ^C
+    }
+    free_job(j);
+    return status_code(status);
+}
 
-        // Free the allocated memory for arglist
-        for (int j = 0; j < MAXARGS + 1; j++) {
-            free(arglist[j]);
-        }
-        free(arglist);
+// Job named by a spec: %n or n for job n, %% or %+ or no spec for the
+// most recent job. Returns its index in the table, or -1.
+int find_job(const char *spec) {
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0) {
+        return current_job;
     }
+    int id = atoi(spec[0] == '%' ? spec + 1 : spec);
+    return id >= 1 && id <= job_count && jobs[id - 1].id == id ? id - 1 : -1;
 }
 
-void free_history() {
-    for (int i = 0; i < HISTSIZE; i++) {
-        if (command_history[i] != NULL) {
-            free(command_history[i]);
+// Marks every process of a job running again and sends the group SIGCONT
+void continue_job(struct job *j) {
+    for (int i = 0; i < j->nprocs; i++) {
+        if (j->procs[i].state == JOB_STOPPED) {
+            j->procs[i].state = JOB_RUNNING;
         }
     }
+    kill(-j->pgid, SIGCONT);
 }
 
+// Lists the jobs; finished ones are shown with their status one last time
+// and removed, so they are not reported again at the prompt.
 void list_jobs() {
-    printf("Background jobs:\n");
+    const char *names[] = { "Running", "Stopped", "Done" };
+    sigset_t oldmask;
+    block_sigchld(&oldmask);
     for (int i = 0; i < job_count; i++) {
-        printf("[%d] %d\n", i + 1, jobs[i]);
+        if (jobs[i].id == 0) {
+            continue;
+        }
+        enum job_state state = job_state(&jobs[i]);
+        if (state == JOB_DONE) {
+            if (!jobs[i].notified) {
+                char line[512];
+                format_job(&jobs[i], line, sizeof(line));
+                fputs(line, stdout);
+            }
+            remove_job(i);
+            continue;
+        }
+        printf("[%d]%c  %-8s %6d  %s\n", jobs[i].id, i == current_job ? '+' : ' ',
+               names[state], jobs[i].pgid, jobs[i].cmd);
     }
+    sigprocmask(SIG_SETMASK, &oldmask, NULL);
 }
 
-void kill_job(int job_number) {
-    if (job_number < 1 || job_number > job_count) {
-        fprintf(stderr, "kill: no such job\n");
-        return;
+struct signal_entry {
+    const char *name;
+    int sig;
+};
+
+struct signal_entry signal_names[] = {
+    { "HUP", SIGHUP }, { "INT", SIGINT }, { "QUIT", SIGQUIT }, { "ILL", SIGILL },
+    { "ABRT", SIGABRT }, { "FPE", SIGFPE }, { "KILL", SIGKILL }, { "SEGV", SIGSEGV },
+    { "PIPE", SIGPIPE }, { "USR1", SIGUSR1 }, { "USR2", SIGUSR2 }, { "TERM", SIGTERM },
+    { "CONT", SIGCONT }, { "STOP", SIGSTOP }, { "TSTP", SIGTSTP }, { "ALRM", SIGALRM },
+    { "XCPU", SIGXCPU }, { "XFSZ", SIGXFSZ }, { "BUS", SIGBUS }, { NULL, 0 }
+};
+
+// "SIGTERM" for SIGTERM; "SIG?" for signals not in the table
+const char* signal_name(int sig) {
+    static const char *full[] = {
+        "SIGHUP", "SIGINT", "SIGQUIT", "SIGILL", "SIGABRT", "SIGFPE", "SIGKILL", "SIGSEGV",
+        "SIGPIPE", "SIGUSR1", "SIGUSR2", "SIGTERM", "SIGCONT", "SIGSTOP", "SIGTSTP", "SIGALRM",
+        "SIGXCPU", "SIGXFSZ", "SIGBUS"
+    };
+    for (int i = 0; signal_names[i].name != NULL; i++) {
+        if (signal_names[i].sig == sig) {
+            return full[i];
+        }
+    }
+    return "SIG?";
+}
+
+// Signal named by -NAME, -SIGNAME or -N; 0 if unknown
+int parse_signal(const char *name) {
+    struct signal_entry *signals = signal_names;
+    if (name[0] >= '0' && name[0] <= '9') {
+        return atoi(name);
+    }
+    if (strncmp(name, "SIG", 3) == 0) {
+        name += 3;
     }
-    pid_t pid = jobs[job_number - 1];
-    if (kill(pid, SIGKILL) == 0) {
-        printf("Killed job [%d] %d\n", job_number, pid);
-        // Remove from jobs list
-        for (int i = job_number - 1; i < job_count - 1; i++) {
-            jobs[i] = jobs[i + 1];
+    for (int i = 0; signals[i].name != NULL; i++) {
+        if (strcmp(signals[i].name, name) == 0) {
+            return signals[i].sig;
         }
-        job_count--;
-    } else {
-        perror("kill failed");
     }
+    return 0;
 }
 
 void set_var(char *name, char *value, int global) {
@@ -468,6 +8080,21 @@ void set_var(char *name, char *value, int global) {
     }
 }
 
+// Sets a variable from an assignment or a for loop, keeping it exported if it
+// already was.
+void assign_var(char *name, char *value) {
+    int global = 0;
+    for (int i = 0; i < var_count; i++) {
+        if (strncmp(var_table[i].str, name, strlen(name)) == 0 && var_table[i].str[strlen(name)] == '=') {
+            global = var_table[i].global;
+        }
+    }
+    set_var(name, value, global);
+    if (global) {
+        setenv(name, value, 1);
+    }
+}
+
 char* get_var(char *name) {
     for (int i = 0; i < var_count; i++) {
         if (strncmp(var_table[i].str, name, strlen(name)) == 0 && var_table[i].str[strlen(name)] == '=') {
@@ -502,11 +8129,409 @@ void print_vars() {
     }
 }
 
+// Turns a shell option on or off. redirect-policy takes a comma separated
+// list of policy_flags names: set -o redirect-policy=sequential,noreuse
+int set_option(const char *name, int on) {
+    const char *value = strchr(name, '=');
+    size_t nlen = value != NULL ? (size_t)(value - name) : strlen(name);
+
+    for (int k = 0; shell_options[k].name != NULL; k++) {
+        if (strcmp(shell_options[k].name, name) == 0) {
+            *shell_options[k].value = on;
+            return 0;
+        }
+    }
+
+    if (nlen == strlen("redirect-policy") && strncmp(name, "redirect-policy", nlen) == 0) {
+        if (!on || value == NULL) {
+            redirect_policy = 0;
+            return 0;
+        }
+        int policy = 0;
+        char *list = strdup(value + 1), *save = NULL;
+        for (char *word = strtok_r(list, ",", &save); word != NULL; word = strtok_r(NULL, ",", &save)) {
+            int k = 0;
+            while (policy_flags[k].name != NULL && strcmp(policy_flags[k].name, word) != 0) {
+                k++;
+            }
+            if (policy_flags[k].name == NULL) {
+                fprintf(stderr, "set: unknown redirect policy: %s\n", word);
+                free(list);
+                return 1;
+            }
+            policy |= policy_flags[k].bit;
+        }
+        free(list);
+        redirect_policy = policy;
+        return 0;
+    }
+    fprintf(stderr, "set: unknown option: %s\n", name);
+    return 1;
+}
+
+void print_options() {
+    for (int k = 0; shell_options[k].name != NULL; k++) {
+        printf("%-15s %s\n", shell_options[k].name, *shell_options[k].value ? "on" : "off");
+    }
+    printf("redirect-policy ");
+    int first = 1;
+    for (int k = 0; policy_flags[k].name != NULL; k++) {
+        if (redirect_policy & policy_flags[k].bit) {
+            printf("%s%s", first ? "" : ",", policy_flags[k].name);
+            first = 0;
+        }
+    }
+    printf("%s\n", first ? "off" : "");
+}
+
 void help() {
     printf("Built-in commands:\n");
     printf("  cd <directory>  Change the current working directory.\n");
-    printf("  exit            Terminate the shell.\n");
+    printf("  exit [status]   Terminate the shell.\n");
     printf("  jobs            List background jobs.\n");
-    printf("  kill <job_num>  Terminate a background job.\n");
+    printf("  kill [-SIG] %%n  Signal every process of a job (SIGKILL by default).\n");
+    printf("  fg [%%n]         Continue a job in the foreground.\n");
+    printf("  bg [%%n]         Continue a stopped job in the background.\n");
+    printf("  bench -n N [-w W] [-o file.csv] <pipeline>\n");
+    printf("                  Run a pipeline N times and report latency statistics.\n");
+    printf("  sched [-c CPULIST] [-n NICE] [-i rt|be|idle[:LEVEL]] <command>\n");
+    printf("                  Run a command with CPU affinity, nice value and I/O priority.\n");
+    printf("  limit [-v SIZE] [-t SECS] [-n FILES] [-u PROCS] [-f SIZE] <command>\n");
+    printf("                  Run a command under resource limits (sizes take K/M/G).\n");
+    printf("  ulimit [-H|-S] [-a] [-cdfnstuv] [limit]  Show or set the shell's limits.\n");
+    printf("  timeout DURATION [-s SIG] [-k KILLAFTER] <pipeline>\n");
+    printf("                  Signal the pipeline's process group after DURATION (status 124).\n");
+    printf("  parsecache [-c]  Show parse cache hits and misses (-c clears it).\n");
+    printf("  memo [-d FILE]... [--deps FILE... --] [-e NAME]... <command>\n");
+    printf("                  Serve a command's output and status from $MEMODIR while its inputs are unchanged.\n");
+    printf("  argbatch [-0] [-n MAX] [-P N] [-s] <command>\n");
+    printf("                  Run a command with stdin's lines (NUL-separated with -0) as arguments, in as few execs as fit.\n");
     printf("  help            Display this help message.\n");
-}
\ No newline at end of file
+    printf("Command lists: a ; b   a && b   a || b   a | b | c   a &   ( list )   { list; }\n");
+    printf("Control flow: if/elif/else/fi, while/until ... do ... done, for name in words; do ... done,\n");
+    printf("              case word in pattern) list ;; esac, break [n], continue [n], name=value\n");
+    printf("Functions: name() { list; }, local name[=value], return [n], unset -f name, $1 $# $@\n");
+    printf("Aliases: alias name=value, alias [name], unalias name | -a; a value ending in a blank expands the next word too\n");
+    printf("Redirections: < > >> <> n>&m n>&- &> &>> <<EOF (<<-EOF strips tabs) <<< word, with an optional fd: 2>file\n");
+    printf("Fan-out: producer |> { consumer, consumer, ... } feeds each consumer a copy of the producer's output\n");
+    printf("Substitution: <(list) and >(list) expand to a /dev/fd/N pipe to or from the list\n");
+    printf("Server: ShellV6 --server socket [--max-sessions N] serves commands to ShellV6Client\n");
+    printf("Pool: ShellV6 --zygote N keeps N pre-forked processes to start commands; set +o zygote forks instead\n");
+    printf("Prompt: PS1 with \\u \\h \\w \\W \\$, \\D the last command's time and \\g the git branch (* if dirty), filled in\n");
+    printf("        in the background and repainted when ready\n");
+    printf("Startup: /etc/shellv6rc and ~/.shellv6rc; their state is cached in ~/.shellv6.snap until they change\n");
+    printf("Editing: Tab completes commands, paths and $variables (twice lists them), arrows, Ctrl-A/E/U/C/D\n");
+    printf("Globs: * ? [a-z] [!x] in unquoted words, ** for any depth of directories: src/**/*.c\n");
+    printf("Status: $? of the last command, ${PIPESTATUS[@]} ${PIPESIGNAL[@]} ${PIPETIME[@]} per pipeline stage\n");
+    printf("Options: set -o shows them, set -b (notify) reports finished jobs at once, set -o pipefail,\n");
+    printf("         set -o multiplex tags background output by line as [n] and keeps it for jobs -o n,\n");
+    printf("         set -o redirect-policy=sequential,noreuse,dontneed,direct,noatime\n");
+}
+
+// Per-run measurements collected by bench
+struct bench_run {
+    double wall_ms;
+    double user_ms;
+    double sys_ms;
+    long maxrss_kb;
+    int status;
+};
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest-rank percentile of a sorted array
+double percentile(const double *sorted, int n, double p) {
+    double exact = p / 100.0 * n;
+    int rank = (int)exact;
+    if (rank < exact) {
+        rank++;  // Rounds up, as ceil() would
+    }
+    if (rank < 1) {
+        rank = 1;
+    }
+    return sorted[rank - 1];
+}
+
+// Parses a non-negative decimal count. Returns -1 if malformed.
+int parse_count(const char *text) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || text[0] == '-' || errno == ERANGE || value > INT_MAX) {
+        return -1;
+    }
+    return value;
+}
+
+// Square root by Newton's method, so the shell needs no libm
+double square_root(double x) {
+    if (x <= 0) {
+        return 0;
+    }
+    double r = x > 1 ? x : 1;
+    for (int i = 0; i < 100; i++) {
+        double next = (r + x / r) / 2;
+        if (next >= r) {
+            break;
+        }
+        r = next;
+    }
+    return r;
+}
+
+double timeval_ms(const struct timeval *tv) {
+    return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+// bench -n N [-w W] [-o file.csv] <pipeline>
+// Runs the already parsed pipeline W times as warmup and then N times,
+// timing each run and collecting CPU time and peak RSS from wait4().
+int bench(struct node *n) {
+    int runs = 10, warmup = 0;
+    char *csvfile = NULL;
+    char **opts = expand_words(n->argv);
+
+    // Words may have expanded to more or fewer than the parser's pairs
+    for (int i = 0; opts[i] != NULL && runs > 0; i += 2) {
+        if (opts[i + 1] == NULL) {
+            runs = 0;
+        } else if (strcmp(opts[i], "-n") == 0) {
+            runs = parse_count(opts[i + 1]);
+        } else if (strcmp(opts[i], "-w") == 0) {
+            warmup = parse_count(opts[i + 1]);
+        } else if (strcmp(opts[i], "-o") == 0) {
+            csvfile = opts[i + 1];
+        } else {
+            runs = 0;
+        }
+    }
+    if (runs < 1 || warmup < 0) {
+        fprintf(stderr, "bench: usage: bench -n N [-w W] [-o file.csv] <pipeline>\n");
+        free_words(opts);
+        return 2;
+    }
+
+    struct bench_run *results = malloc(sizeof(struct bench_run) * runs);
+    double *wall = malloc(sizeof(double) * runs);
+    if (results == NULL || wall == NULL) {
+        perror("bench: malloc failed");
+        free(results);
+        free(wall);
+        free_words(opts);
+        return 1;
+    }
+
+    int saved_report = report_status;
+    report_status = 0;
+    for (int k = 0; k < warmup; k++) {
+        exec_node(n->left);
+    }
+
+    int failures = 0;
+    for (int k = 0; k < runs; k++) {
+        struct timespec t0, t1;
+        memset(&last_usage, 0, sizeof(last_usage));
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        results[k].status = exec_node(n->left);
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        results[k].wall_ms = (t1.tv_sec - t0.tv_sec) * 1000.0 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+        results[k].user_ms = timeval_ms(&last_usage.ru_utime);
+        results[k].sys_ms = timeval_ms(&last_usage.ru_stime);
+        results[k].maxrss_kb = last_usage.ru_maxrss;
+        wall[k] = results[k].wall_ms;
+        if (results[k].status != 0) {
+            failures++;
+        }
+    }
+    report_status = saved_report;
+
+    double sum = 0, user = 0, sys = 0;
+    long maxrss = 0;
+    for (int k = 0; k < runs; k++) {
+        sum += results[k].wall_ms;
+        user += results[k].user_ms;
+        sys += results[k].sys_ms;
+        if (results[k].maxrss_kb > maxrss) {
+            maxrss = results[k].maxrss_kb;
+        }
+    }
+    double mean = sum / runs;
+    double var = 0;
+    for (int k = 0; k < runs; k++) {
+        var += (results[k].wall_ms - mean) * (results[k].wall_ms - mean);
+    }
+    double stddev = runs > 1 ? square_root(var / (runs - 1)) : 0;
+    qsort(wall, runs, sizeof(double), compare_double);
+
+    printf("bench: %s\n", n->text);
+    printf("  runs    %d (%d warmup, %d failed)\n", runs, warmup, failures);
+    printf("  wall    min %.3f ms  median %.3f ms  p90 %.3f ms  p99 %.3f ms\n",
+           wall[0], percentile(wall, runs, 50), percentile(wall, runs, 90), percentile(wall, runs, 99));
+    printf("          mean %.3f ms  stddev %.3f ms  max %.3f ms\n", mean, stddev, wall[runs - 1]);
+    printf("  cpu     user %.3f ms  sys %.3f ms (mean per run)\n", user / runs, sys / runs);
+    printf("  maxrss  %ld KB\n", maxrss);
+
+    if (csvfile != NULL) {
+        FILE *fp = fopen(csvfile, "w");
+        if (fp == NULL) {
+            perror("bench: failed to open CSV file");
+        } else {
+            fprintf(fp, "run,wall_ms,user_ms,sys_ms,maxrss_kb,status\n");
+            for (int k = 0; k < runs; k++) {
+                fprintf(fp, "%d,%.6f,%.6f,%.6f,%ld,%d\n", k + 1, results[k].wall_ms,
+                        results[k].user_ms, results[k].sys_ms, results[k].maxrss_kb, results[k].status);
+            }
+            fclose(fp);
+        }
+    }
+
+    free(results);
+    free(wall);
+    free_words(opts);
+    return failures == 0 ? 0 : 1;
+}
+
+struct function* find_function(const char *name) {
+    for (int i = 0; i < func_count; i++) {
+        if (strcmp(func_table[i].name, name) == 0) {
+            return &func_table[i];
+        }
+    }
+    return NULL;
+}
+
+struct alias* find_alias(const char *name) {
+    for (struct alias *a = alias_table[hash_line(name) & (ALIASHASH - 1)]; a != NULL; a = a->next) {
+        if (strcmp(a->name, name) == 0) {
+            return a;
+        }
+    }
+    return NULL;
+}
+
+// Defines or replaces an alias. Cached parse trees may hold the old
+// expansion, so the parse cache is emptied.
+void set_alias(const char *name, const char *value) {
+    struct alias *a = find_alias(name);
+    if (a != NULL) {
+        free(a->value);
+        a->value = strdup(value);
+    } else {
+        unsigned int b = hash_line(name) & (ALIASHASH - 1);
+        a = malloc(sizeof(struct alias));
+        a->name = strdup(name);
+        a->value = strdup(value);
+        a->next = alias_table[b];
+        alias_table[b] = a;
+        alias_count++;
+    }
+    cache_clear();
+}
+
+int unset_alias(const char *name) {
+    for (struct alias **ap = &alias_table[hash_line(name) & (ALIASHASH - 1)]; *ap != NULL; ap = &(*ap)->next) {
+        struct alias *a = *ap;
+        if (strcmp(a->name, name) == 0) {
+            *ap = a->next;
+            free(a->name);
+            free(a->value);
+            free(a);
+            alias_count--;
+            cache_clear();
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Prints an alias so that it can be read back: alias ll='ls -l'
+void print_alias(struct alias *a) {
+    printf("alias %s='", a->name);
+    for (const char *c = a->value; *c != '\0'; c++) {
+        if (*c == '\'') {
+            printf("'\\''");
+        } else {
+            putchar(*c);
+        }
+    }
+    printf("'\n");
+}
+
+int compare_aliases(const void *a, const void *b) {
+    return strcmp((*(struct alias * const *)a)->name, (*(struct alias * const *)b)->name);
+}
+
+// Stores the already compiled body under name, replacing any earlier
+// definition. The body is shared with the tree that defined it.
+void define_function(char *name, struct node *body) {
+    struct function *f = find_function(name);
+    body->refs++;
+    if (f != NULL) {
+        release_tree(f->body);
+        f->body = body;
+        return;
+    }
+    if (func_count < MAXFUNCS) {
+        func_table[func_count].name = strdup(name);
+        func_table[func_count].body = body;
+        func_count++;
+    } else {
+        fprintf(stderr, "Error: Maximum function limit reached.\n");
+        release_tree(body);
+    }
+}
+
+void unset_function(char *name) {
+    struct function *f = find_function(name);
+    if (f != NULL) {
+        free(f->name);
+        release_tree(f->body);
+        *f = func_table[--func_count];  // Move the last function into the gap
+    }
+}
+
+// Runs a function body in the shell process with argv[1..] as $1, $2, ...
+// Variables made local inside it are restored when it returns.
+int call_function(struct node *body, char **argv) {
+    if (frame_depth >= MAXDEPTH) {
+        fprintf(stderr, "%s: maximum function nesting level exceeded\n", argv[0]);
+        return 1;
+    }
+    struct frame *fr = &frames[frame_depth++];
+    fr->args = argv + 1;
+    fr->nargs = 0;
+    while (fr->args[fr->nargs] != NULL) {
+        fr->nargs++;
+    }
+    fr->locals = NULL;
+    fr->nlocals = 0;
+
+    body->refs++;  // Keep the body alive if the function redefines itself
+    int status = exec_node(body);
+    release_tree(body);
+    func_returning = 0;
+
+    // Undo local variables, latest first
+    while (fr->nlocals > 0) {
+        struct saved_var *sv = &fr->locals[--fr->nlocals];
+        if (sv->value != NULL) {
+            set_var(sv->name, sv->value, sv->global);
+        } else {
+            unset_var(sv->name);
+        }
+        if (sv->env != NULL) {
+            setenv(sv->name, sv->env, 1);
+        } else {
+            unsetenv(sv->name);
+        }
+        free(sv->name);
+        free(sv->value);
+        free(sv->env);
+    }
+    free(fr->locals);
+    frame_depth--;
+    return status;
+}
@@ -0,0 +1,274 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Client for the ShellV6 command server (ShellV6 --server socket).
+//
+//   ShellV6Client socket command...
+//       Runs the command in the server with this process's stdin, stdout and
+//       stderr and exits with its status.
+//   ShellV6Client -n N [-c C] [-b shell] socket command...
+//       Load test: C workers send N requests in total, each worker over one
+//       connection, with output going to /dev/null, and the latency of every
+//       request is reported. With -b the same commands are instead run by
+//       starting the given shell once per command, for comparison.
+
+#define SERVER_MAGIC 0x52364853u  // Must match ShellV6.c
+
+struct server_request {
+    unsigned int magic;
+    unsigned int cwd_len;
+    unsigned int cmd_len;
+};
+
+int connect_server(const char *path);
+int run_request(int conn, const char *cwd, const char *cmd, const int fds[3]);
+int run_baseline(const char *shell, const char *cmd, int devnull);
+int read_full(int fd, char *buf, size_t len);
+int compare_double(const void *a, const void *b);
+
+int main(int argc, char *argv[]) {
+    int requests = 0, workers = 1;
+    const char *baseline = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "+n:c:b:")) != -1) {
+        if (opt == 'n') {
+            requests = atoi(optarg);
+        } else if (opt == 'c') {
+            workers = atoi(optarg);
+        } else if (opt == 'b') {
+            baseline = optarg;
+        } else {
+            optind = argc;
+            break;
+        }
+    }
+    if (optind + 2 > argc || workers < 1 || (requests < 1 && (baseline != NULL || requests != 0))) {
+        fprintf(stderr, "usage: %s [-n N [-c C] [-b shell]] socket command...\n", argv[0]);
+        return 2;
+    }
+    const char *path = argv[optind];
+
+    // The command words are joined back into one command line
+    size_t size = 1;
+    for (int i = optind + 1; i < argc; i++) {
+        size += strlen(argv[i]) + 1;
+    }
+    char *cmd = calloc(1, size);
+    for (int i = optind + 1; i < argc; i++) {
+        if (i > optind + 1) {
+            strcat(cmd, " ");
+        }
+        strcat(cmd, argv[i]);
+    }
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL) {
+        strcpy(cwd, "/");
+    }
+
+    if (requests == 0) {
+        int conn = connect_server(path);
+        if (conn == -1) {
+            return 1;
+        }
+        int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+        int status = run_request(conn, cwd, cmd, fds);
+        close(conn);
+        return status == -1 ? 1 : status;
+    }
+
+    // Load test. Each worker writes its latencies in ms to a shared pipe.
+    int results[2];
+    if (pipe(results) == -1) {
+        perror("pipe failed");
+        return 1;
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (int w = 0; w < workers; w++) {
+        int count = requests / workers + (w < requests % workers);
+        pid_t pid = fork();
+        if (pid == -1) {
+            perror("fork failed");
+            return 1;
+        }
+        if (pid > 0) {
+            continue;
+        }
+        close(results[0]);
+        int devnull = open("/dev/null", O_RDWR);
+        int fds[3] = { devnull, devnull, STDERR_FILENO };
+        int conn = baseline == NULL ? connect_server(path) : -1;
+        if (baseline == NULL && conn == -1) {
+            _exit(1);
+        }
+        for (int k = 0; k < count; k++) {
+            struct timespec a, b;
+            clock_gettime(CLOCK_MONOTONIC, &a);
+            int status = baseline == NULL ? run_request(conn, cwd, cmd, fds) : run_baseline(baseline, cmd, devnull);
+            clock_gettime(CLOCK_MONOTONIC, &b);
+            double ms = (b.tv_sec - a.tv_sec) * 1000.0 + (b.tv_nsec - a.tv_nsec) / 1e6;
+            if (status == -1) {
+                ms = -1;  // Failed request
+            }
+            if (write(results[1], &ms, sizeof(ms)) != sizeof(ms)) {
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    close(results[1]);
+
+    double *lat = malloc(sizeof(double) * requests);
+    int got = 0, failed = 0;
+    double ms;
+    while (read_full(results[0], (char *)&ms, sizeof(ms)) == 0) {
+        if (ms < 0) {
+            failed++;
+        } else if (got < requests) {
+            lat[got++] = ms;
+        }
+    }
+    while (wait(NULL) > 0) {
+        continue;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double wall = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    printf("%s: %d requests, %d workers, %d failed\n", baseline != NULL ? baseline : path, got + failed, workers, failed);
+    if (got > 0) {
+        qsort(lat, got, sizeof(double), compare_double);
+        printf("  throughput  %.0f requests/s\n", got / wall);
+        printf("  latency     min %.3f ms  median %.3f ms  p99 %.3f ms  max %.3f ms\n",
+               lat[0], lat[got / 2], lat[(int)(got * 0.99)], lat[got - 1]);
+    }
+    free(lat);
+    free(cmd);
+    return failed == 0 ? 0 : 1;
+}
+
+int connect_server(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int conn = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn == -1 || connect(conn, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror(path);
+        if (conn != -1) {
+            close(conn);
+        }
+        return -1;
+    }
+    return conn;
+}
+
+// Sends one request with fds as the command's stdin, stdout and stderr and
+// waits for its exit status. Returns -1 if the server went away.
+int run_request(int conn, const char *cwd, const char *cmd, const int fds[3]) {
+    struct server_request req = { SERVER_MAGIC, strlen(cwd), strlen(cmd) };
+    char control[CMSG_SPACE(sizeof(int) * 3)];
+    memset(control, 0, sizeof(control));
+    struct iovec iov[3] = {
+        { &req, sizeof(req) },
+        { (char *)cwd, req.cwd_len },
+        { (char *)cmd, req.cmd_len },
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 3;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int) * 3);
+    memcpy(CMSG_DATA(cm), fds, sizeof(int) * 3);
+
+    size_t total = sizeof(req) + req.cwd_len + req.cmd_len;
+    ssize_t sent = sendmsg(conn, &msg, MSG_NOSIGNAL);
+    if (sent == -1) {
+        perror("sendmsg failed");
+        return -1;
+    }
+    // The descriptors went with the first bytes; send whatever is left
+    while ((size_t)sent < total) {
+        size_t skip = sent;
+        int i = 0;
+        while (skip >= iov[i].iov_len) {
+            skip -= iov[i++].iov_len;
+        }
+        ssize_t n = send(conn, (char *)iov[i].iov_base + skip, iov[i].iov_len - skip, MSG_NOSIGNAL);
+        if (n == -1) {
+            perror("send failed");
+            return -1;
+        }
+        sent += n;
+    }
+
+    int status;
+    if (read_full(conn, (char *)&status, sizeof(status)) == -1) {
+        fprintf(stderr, "server closed the connection\n");
+        return -1;
+    }
+    return status;
+}
+
+// Runs the command the usual way: a new shell reading it from a pipe
+int run_baseline(const char *shell, const char *cmd, int devnull) {
+    int in[2];
+    if (pipe(in) == -1) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+        close(in[0]);
+        close(in[1]);
+        execl(shell, shell, (char *)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    if (write(in[1], cmd, strlen(cmd)) == -1 || write(in[1], "\n", 1) == -1) {
+        perror("write failed");
+    }
+    close(in[1]);
+    int status;
+    if (pid == -1 || waitpid(pid, &status, 0) == -1) {
+        return -1;
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int read_full(int fd, char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}